@@ -51,6 +51,14 @@ pub enum MensagoError {
 	ErrBadSession,
 	#[error("Bad message")]
 	ErrBadMessage,
+	#[error("Not connected")]
+	ErrNotConnected,
+	#[error("Canceled")]
+	ErrCanceled,
+	#[error("Server temporarily unavailable")]
+	ErrCircuitOpen,
+	#[error("Read-only")]
+	ErrReadOnly,
 	
 	// Database exceptions are *bad*. This is returned only when there is a major problem with the
 	// data in the database, such as a workspace having no identity entry.
@@ -0,0 +1,292 @@
+//! The budget module keeps the library's caches within a single memory limit. Each cache
+//! registers with a shared MemoryBudget and reports roughly how many bytes it holds. When the
+//! total goes over the limit, the budget asks caches to shrink, starting with the least important
+//! and, among equally important ones, the one used least recently.
+//!
+//! Hosts which receive memory-pressure warnings, such as mobile platforms, can call `trim()` to
+//! release cached data right away.
+
+use std::sync::{Arc, Mutex, MutexGuard, Weak};
+use crate::base::*;
+use crate::config::*;
+
+/// Config field for the memory budget in bytes. 0 or missing means unlimited.
+pub const CONFIG_MEMORY_BUDGET: &str = "memory_budget";
+
+/// CachePriority determines which caches give up memory first. Low priority caches are shrunk
+/// before higher ones are touched.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
+pub enum CachePriority {
+	Low,
+	Normal,
+	High,
+}
+
+/// BudgetedCache is implemented by caches which register with a MemoryBudget. Both calls may
+/// come from any thread, and the budget never calls them while holding its own lock.
+pub trait BudgetedCache: Send + Sync {
+
+	/// Returns an estimate of how much memory the cache holds, in bytes. This is called often, so
+	/// it should return a running total instead of adding up entries.
+	fn get_memory_usage(&self) -> usize;
+
+	/// Frees about the specified number of bytes by dropping the least recently used entries and
+	/// returns how many bytes were freed
+	fn shrink(&self, bytes: usize) -> usize;
+}
+
+struct Registration {
+	id: u64,
+	name: String,
+	priority: CachePriority,
+	last_used: u64,
+	cache: Weak<dyn BudgetedCache>,
+}
+
+struct BudgetState {
+	limit: usize,
+	caches: Vec<Registration>,
+	next_id: u64,
+	clock: u64,
+}
+
+/// MemoryBudget limits the total memory used by the caches registered with it. It is meant to be
+/// shared through an Arc. Caches are held weakly, so dropping a cache is enough to remove it from
+/// the budget.
+pub struct MemoryBudget {
+	state: Mutex<BudgetState>,
+}
+
+impl MemoryBudget {
+
+	/// Creates a new budget. A limit of 0 means unlimited.
+	pub fn new(limit: usize) -> MemoryBudget {
+		MemoryBudget {
+			state: Mutex::new(BudgetState {
+				limit,
+				caches: Vec::new(),
+				next_id: 1,
+				clock: 0,
+			}),
+		}
+	}
+
+	/// Creates a budget using the limit in the `memory_budget` field of the configuration. A
+	/// missing field means unlimited.
+	pub fn from_config(config: &Config) -> Result<MemoryBudget, MensagoError> {
+		match config.get_int(CONFIG_MEMORY_BUDGET) {
+			Ok(v) if v >= 0 => Ok(MemoryBudget::new(v as usize)),
+			Ok(_) => Err(MensagoError::ErrBadValue),
+			Err(MensagoError::ErrNotFound) => Ok(MemoryBudget::new(0)),
+			Err(e) => Err(e),
+		}
+	}
+
+	/// Returns the limit in bytes
+	pub fn get_limit(&self) -> usize {
+		self.lock_state().limit
+	}
+
+	/// Changes the limit and shrinks caches if they are now over it. Returns the number of bytes
+	/// freed.
+	pub fn set_limit(&self, limit: usize) -> usize {
+		self.lock_state().limit = limit;
+		self.enforce()
+	}
+
+	/// Adds a cache to the budget and returns the ID used to refer to it in other calls. The name
+	/// is only used for reporting.
+	pub fn register(&self, name: &str, priority: CachePriority, cache: &Arc<dyn BudgetedCache>)
+	-> u64 {
+		let mut state = self.lock_state();
+		let id = state.next_id;
+		state.next_id += 1;
+		state.clock += 1;
+		let last_used = state.clock;
+		state.caches.push(Registration {
+			id,
+			name: String::from(name),
+			priority,
+			last_used,
+			cache: Arc::downgrade(cache),
+		});
+		id
+	}
+
+	/// Removes a cache from the budget
+	pub fn unregister(&self, id: u64) {
+		self.lock_state().caches.retain(|r| r.id != id);
+	}
+
+	/// Records that a cache has been used, which makes it less likely to be shrunk
+	pub fn touch(&self, id: u64) {
+		let mut state = self.lock_state();
+		state.clock += 1;
+		let now = state.clock;
+		if let Some(r) = state.caches.iter_mut().find(|r| r.id == id) {
+			r.last_used = now;
+		}
+	}
+
+	/// Returns the memory used by all registered caches, in bytes
+	pub fn get_memory_usage(&self) -> usize {
+		self.get_caches().iter().map(|(_, c)| c.get_memory_usage()).sum()
+	}
+
+	/// Returns the name and memory usage of each registered cache, for diagnostics
+	pub fn get_usage_report(&self) -> Vec<(String, usize)> {
+		self.get_caches().iter().map(|(n, c)| (n.clone(), c.get_memory_usage())).collect()
+	}
+
+	/// Shrinks caches until their total is within the limit. Caches should call this after
+	/// adding entries, once they have released their own locks. Returns the number of bytes
+	/// freed.
+	pub fn enforce(&self) -> usize {
+		match self.get_limit() {
+			0 => 0,
+			limit => self.shrink_to(limit),
+		}
+	}
+
+	/// Shrinks caches until their total is at most the specified number of bytes, regardless of
+	/// the limit. This is meant for memory-pressure warnings from the host; `trim(0)` empties
+	/// every cache. Returns the number of bytes freed.
+	pub fn trim(&self, target: usize) -> usize {
+		self.shrink_to(target)
+	}
+
+	fn shrink_to(&self, target: usize) -> usize {
+
+		// get_caches() returns them in the order they should be shrunk
+		let caches = self.get_caches();
+		let mut usage: usize = caches.iter().map(|(_, c)| c.get_memory_usage()).sum();
+		let mut freed = 0;
+		for (_, cache) in caches.iter() {
+			if usage <= target {
+				break
+			}
+			let amount = cache.shrink(usage - target);
+			usage = usage.saturating_sub(amount);
+			freed += amount;
+		}
+
+		freed
+	}
+
+	// Returns the live caches ordered from the first to shrink to the last and forgets those
+	// which have been dropped. The budget's lock is released before the caches are used.
+	fn get_caches(&self) -> Vec<(String, Arc<dyn BudgetedCache>)> {
+
+		let mut state = self.lock_state();
+		state.caches.retain(|r| r.cache.strong_count() > 0);
+		state.caches.sort_by(|a, b| {
+			a.priority.cmp(&b.priority).then_with(|| a.last_used.cmp(&b.last_used))
+		});
+		state.caches.iter()
+			.filter_map(|r| r.cache.upgrade().map(|c| (r.name.clone(), c)))
+			.collect()
+	}
+
+	fn lock_state(&self) -> MutexGuard<'_, BudgetState> {
+		match self.state.lock() {
+			Ok(v) => v,
+			Err(e) => e.into_inner(),
+		}
+	}
+}
+
+#[cfg(test)]
+mod tests {
+	use crate::*;
+	use std::sync::{Arc, Mutex};
+
+	// A cache of fixed-size entries which drops its oldest entries first
+	struct TestCache {
+		entries: Mutex<Vec<usize>>,
+	}
+
+	impl TestCache {
+		fn new(entries: &[usize]) -> Arc<TestCache> {
+			Arc::new(TestCache { entries: Mutex::new(entries.to_vec()) })
+		}
+	}
+
+	impl BudgetedCache for TestCache {
+		fn get_memory_usage(&self) -> usize {
+			self.entries.lock().unwrap().iter().sum()
+		}
+
+		fn shrink(&self, bytes: usize) -> usize {
+			let mut entries = self.entries.lock().unwrap();
+			let mut freed = 0;
+			while freed < bytes && entries.len() > 0 {
+				freed += entries.remove(0);
+			}
+			freed
+		}
+	}
+
+	#[test]
+	fn test_memory_budget() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_memory_budget");
+
+		let budget = MemoryBudget::new(1000);
+		let low = TestCache::new(&[100; 5]);
+		let old = TestCache::new(&[100; 5]);
+		let recent = TestCache::new(&[100; 5]);
+		let low_dyn: Arc<dyn BudgetedCache> = low.clone();
+		let old_dyn: Arc<dyn BudgetedCache> = old.clone();
+		let recent_dyn: Arc<dyn BudgetedCache> = recent.clone();
+		budget.register("low", CachePriority::Low, &low_dyn);
+		let old_id = budget.register("old", CachePriority::Normal, &old_dyn);
+		let recent_id = budget.register("recent", CachePriority::Normal, &recent_dyn);
+		budget.touch(recent_id);
+		budget.touch(old_id);
+		budget.touch(recent_id);
+
+		// 1500 bytes in use, so 500 must go, all of it from the low priority cache
+		if budget.enforce() != 500 || low.get_memory_usage() != 0
+			|| budget.get_memory_usage() != 1000 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: low priority cache not shrunk first", testname)))
+		}
+
+		// Among caches of the same priority, the least recently used is shrunk first
+		budget.set_limit(800);
+		if old.get_memory_usage() != 300 || recent.get_memory_usage() != 500 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: wrong cache shrunk: {:?}", testname, budget.get_usage_report())))
+		}
+
+		// Trimming ignores the limit, and dropped caches are forgotten
+		drop(low_dyn);
+		drop(low);
+		if budget.trim(0) != 800 || budget.get_usage_report().len() != 2 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: trim failed: {:?}", testname, budget.get_usage_report())))
+		}
+
+		Ok(())
+	}
+
+	#[test]
+	fn test_memory_budget_config() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_memory_budget_config");
+
+		let mut config = Config::new("");
+		if MemoryBudget::from_config(&config)?.get_limit() != 0 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: missing budget not unlimited", testname)))
+		}
+
+		config.set_int(CONFIG_MEMORY_BUDGET, ConfigScope::Local, "", 64_000_000)?;
+		if MemoryBudget::from_config(&config)?.get_limit() != 64_000_000 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: budget not loaded from config", testname)))
+		}
+
+		Ok(())
+	}
+}
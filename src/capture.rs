@@ -0,0 +1,347 @@
+//! The capture module records the frames of a session to a file and plays them back later, which
+//! makes it possible to benchmark real traffic patterns without access to the original server.
+//!
+//! A capture file starts with the 5 bytes `MCAP\x01`. Each frame follows as a record made up of
+//! the direction (0 for sent, 1 for received), the number of microseconds since the previous
+//! record as a little-endian u32, and the raw frame itself, header included. The greeting is not
+//! part of a capture because it is sent before framing starts.
+
+use std::fs::File;
+use std::io::{BufReader, BufWriter, Read, Write};
+use std::path::Path;
+use std::sync::{Arc, Mutex};
+use std::thread;
+use std::time::{Duration, Instant};
+use crate::base::*;
+use crate::commands::servermsg::*;
+use crate::transport::*;
+
+const CAPTURE_MAGIC: &[u8; 5] = b"MCAP\x01";
+
+/// Direction of a captured frame from the point of view of the side which made the capture
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Direction {
+	Sent,
+	Received,
+}
+
+/// A frame read from a capture file. `offset` is the time since the start of the capture.
+#[derive(Debug, Clone, PartialEq)]
+pub struct CapturedFrame {
+	pub direction: Direction,
+	pub offset: Duration,
+	pub data: Vec<u8>,
+}
+
+struct CaptureFile {
+	file: BufWriter<File>,
+	last: Instant,
+}
+
+/// Capture writes frames to a capture file. Streams wrapped with `wrap()` record all frames
+/// passing through them.
+#[derive(Clone)]
+pub struct Capture {
+	file: Arc<Mutex<CaptureFile>>,
+}
+
+impl Capture {
+
+	/// Creates a new capture file, overwriting any existing file
+	pub fn create(path: &Path) -> Result<Capture, MensagoError> {
+		let mut file = BufWriter::new(File::create(path)?);
+		file.write_all(CAPTURE_MAGIC)?;
+		Ok(Capture {
+			file: Arc::new(Mutex::new(CaptureFile { file, last: Instant::now() })),
+		})
+	}
+
+	/// Wraps a stream so that frames written to and read from it are captured
+	pub fn wrap<S: Read + Write>(&self, stream: S) -> CaptureStream<S> {
+		CaptureStream {
+			inner: stream,
+			capture: self.clone(),
+			sent: Vec::new(),
+			received: Vec::new(),
+		}
+	}
+
+	/// Writes any buffered records to disk
+	pub fn flush(&self) -> Result<(), MensagoError> {
+		self.lock().file.flush()?;
+		Ok(())
+	}
+
+	// Adds any complete frames at the start of the buffer to the capture and removes them
+	fn record(&self, direction: Direction, buffer: &mut Vec<u8>) -> std::io::Result<()> {
+
+		while buffer.len() >= 3 {
+			let framelen = 3 + ((usize::from(buffer[1]) << 8) | usize::from(buffer[2]));
+			if buffer.len() < framelen {
+				break
+			}
+
+			let mut capfile = self.lock();
+			let now = Instant::now();
+			let delta = now.duration_since(capfile.last).as_micros().min(u32::MAX as u128);
+			capfile.last = now;
+
+			let dirbyte = match direction {
+				Direction::Sent => 0u8,
+				Direction::Received => 1u8,
+			};
+			capfile.file.write_all(&[dirbyte])?;
+			capfile.file.write_all(&(delta as u32).to_le_bytes())?;
+			capfile.file.write_all(&buffer[..framelen])?;
+			drop(capfile);
+
+			buffer.drain(..framelen);
+		}
+		Ok(())
+	}
+
+	fn lock(&self) -> std::sync::MutexGuard<'_, CaptureFile> {
+		match self.file.lock() {
+			Ok(v) => v,
+			Err(e) => e.into_inner(),
+		}
+	}
+}
+
+/// CaptureStream passes data through to the stream it wraps, recording each complete frame. When
+/// the wrapped stream is a Transport, so is the CaptureStream, so commands can be used with it.
+pub struct CaptureStream<S: Read + Write> {
+	inner: S,
+	capture: Capture,
+	sent: Vec<u8>,
+	received: Vec<u8>,
+}
+
+impl<S: Read + Write> CaptureStream<S> {
+
+	/// Returns the wrapped stream
+	pub fn get_ref(&self) -> &S {
+		&self.inner
+	}
+
+	/// Stops capturing and returns the wrapped stream
+	pub fn into_inner(self) -> S {
+		self.inner
+	}
+}
+
+impl<S: Read + Write> Read for CaptureStream<S> {
+	fn read(&mut self, buf: &mut [u8]) -> std::io::Result<usize> {
+		let count = self.inner.read(buf)?;
+		self.received.extend_from_slice(&buf[..count]);
+		self.capture.record(Direction::Received, &mut self.received)?;
+		Ok(count)
+	}
+}
+
+impl<S: Read + Write> Write for CaptureStream<S> {
+	fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+		let count = self.inner.write(buf)?;
+		self.sent.extend_from_slice(&buf[..count]);
+		self.capture.record(Direction::Sent, &mut self.sent)?;
+		Ok(count)
+	}
+
+	fn flush(&mut self) -> std::io::Result<()> {
+		self.inner.flush()
+	}
+}
+
+impl<S: Transport> Transport for CaptureStream<S> {
+
+	// A clone records to the same capture, but keeps its own partial frames
+	fn try_clone_transport(&self) -> Result<Box<dyn Transport>, MensagoError> {
+		Ok(Box::new(self.capture.wrap(self.inner.try_clone_transport()?)))
+	}
+
+	fn shutdown_transport(&self) -> Result<(), MensagoError> {
+		self.inner.shutdown_transport()
+	}
+
+	fn get_read_timeout(&self) -> Result<Option<Duration>, MensagoError> {
+		self.inner.get_read_timeout()
+	}
+
+	fn set_read_timeout(&self, timeout: Option<Duration>) -> Result<(), MensagoError> {
+		self.inner.set_read_timeout(timeout)
+	}
+}
+
+/// Reads all of the frames in a capture file
+pub fn read_capture(path: &Path) -> Result<Vec<CapturedFrame>, MensagoError> {
+
+	let mut file = BufReader::new(File::open(path)?);
+	let mut magic = [0u8; 5];
+	file.read_exact(&mut magic)?;
+	if &magic != CAPTURE_MAGIC {
+		return Err(MensagoError::ErrBadValue)
+	}
+
+	let mut out = Vec::<CapturedFrame>::new();
+	let mut offset = Duration::from_secs(0);
+	let mut header = [0u8; 8];
+	loop {
+		// Each record has a 5-byte header followed by the frame's own 3-byte header
+		match file.read_exact(&mut header) {
+			Ok(_) => (),
+			Err(e) if e.kind() == std::io::ErrorKind::UnexpectedEof => break,
+			Err(e) => return Err(MensagoError::IOError(e)),
+		}
+
+		let direction = match header[0] {
+			0 => Direction::Sent,
+			1 => Direction::Received,
+			_ => return Err(MensagoError::ErrBadValue),
+		};
+		let delta = u32::from_le_bytes([header[1], header[2], header[3], header[4]]);
+		offset += Duration::from_micros(u64::from(delta));
+
+		let paylen = (usize::from(header[6]) << 8) | usize::from(header[7]);
+		let mut data = Vec::with_capacity(3 + paylen);
+		data.extend_from_slice(&header[5..8]);
+		data.resize(3 + paylen, 0);
+		file.read_exact(&mut data[3..])?;
+
+		out.push(CapturedFrame { direction, offset, data });
+	}
+
+	Ok(out)
+}
+
+/// Statistics from a replayed session
+#[derive(Debug, Clone, Default, PartialEq)]
+pub struct ReplayStats {
+	pub frames_sent: usize,
+	pub frames_received: usize,
+	pub bytes_sent: usize,
+	pub bytes_received: usize,
+	pub elapsed: Duration,
+}
+
+/// Plays back a captured session over a connection. `side` chooses which of the captured frames
+/// are sent: Direction::Sent replays the side which made the capture, usually the client, against
+/// a server, and Direction::Received plays the other side, such as for feeding server traffic to
+/// the client stack. Frames from the other side are read and counted in the order they were
+/// captured. Timing between frames is kept, divided by `speed`, so 1.0 plays at the original
+/// speed, 10.0 ten times faster, and f64::INFINITY as quickly as possible.
+pub fn replay<S: Read + Write + ?Sized>(conn: &mut S, frames: &[CapturedFrame], side: Direction,
+	speed: f64) -> Result<ReplayStats, MensagoError> {
+
+	if !(speed > 0.0) {
+		return Err(MensagoError::ErrBadValue)
+	}
+
+	let mut stats = ReplayStats::default();
+	let mut incoming = DataFrame::new();
+	let start = Instant::now();
+	for frame in frames {
+		if frame.direction != side {
+			incoming.read(conn)?;
+			stats.frames_received += 1;
+			stats.bytes_received += incoming.get_size();
+			continue
+		}
+
+		let due = frame.offset.div_f64(speed);
+		let now = start.elapsed();
+		if due > now {
+			thread::sleep(due - now);
+		}
+
+		conn.write_all(&frame.data)?;
+		stats.frames_sent += 1;
+		stats.bytes_sent += frame.data.len() - 3;
+	}
+	conn.flush()?;
+
+	stats.elapsed = start.elapsed();
+	Ok(stats)
+}
+
+#[cfg(test)]
+mod tests {
+	use crate::*;
+	use crate::commands::testserver::*;
+	use crate::testutil::*;
+	use std::io::Write;
+	use std::net::TcpListener;
+	use std::time::Duration;
+
+	#[test]
+	fn test_capture_replay() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_capture_replay");
+		let mut test_path = setup_test(&testname);
+		test_path.push("session.mcap");
+
+		let server = TestServer::start(|req, conn| {
+			if req.action != "NOOP" {
+				return Ok(false)
+			}
+			TestServer::send(conn, &TestServer::response(200, "OK", &[]))?;
+			Ok(true)
+		});
+
+		// Capture a session with a pause between the two commands
+		let mut conn = ServerConnection::new();
+		conn.connect(&server.address, &server.port)?;
+		let capture = Capture::create(&test_path)?;
+		let mut stream = capture.wrap(conn.get_socket()?.try_clone_transport()?);
+		noop(&mut stream)?;
+		std::thread::sleep(Duration::from_millis(200));
+		noop(&mut stream)?;
+		capture.flush()?;
+		conn.disconnect()?;
+
+		let frames = read_capture(&test_path)?;
+		let directions: Vec<Direction> = frames.iter().map(|f| f.direction).collect();
+		if directions != vec![Direction::Sent, Direction::Received, Direction::Sent,
+			Direction::Received] {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: wrong frames captured: {:?}", testname, directions)))
+		}
+		if frames[2].offset < Duration::from_millis(200) {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: timing not captured", testname)))
+		}
+
+		// Replay the client side against the stand-in server, ten times faster than recorded
+		let mut conn = ServerConnection::new();
+		conn.connect(&server.address, &server.port)?;
+		let stats = replay(conn.get_socket()?, &frames, Direction::Sent, 10.0)?;
+		if stats.frames_sent != 2 || stats.frames_received != 2
+			|| stats.elapsed < Duration::from_millis(20)
+			|| stats.elapsed > Duration::from_millis(150) {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: bad client replay: {:?}", testname, stats)))
+		}
+		conn.disconnect()?;
+
+		// Replay the server side to the client stack
+		let listener = TcpListener::bind("127.0.0.1:0")?;
+		let port = listener.local_addr()?.port().to_string();
+		let replayer = std::thread::spawn(move || -> Result<ReplayStats, MensagoError> {
+			let (mut sock, _) = listener.accept()?;
+			sock.write_all(
+				br#"{"name":"Mensago","version":"0.1","code":200,"status":"OK","date":""}"#)?;
+			replay(&mut sock, &frames, Direction::Received, f64::INFINITY)
+		});
+
+		let mut conn = ServerConnection::new();
+		conn.connect("127.0.0.1", &port)?;
+		noop(conn.get_socket()?)?;
+		noop(conn.get_socket()?)?;
+		let stats = replayer.join().unwrap()?;
+		if stats.frames_sent != 2 || stats.frames_received != 2 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: bad server replay: {:?}", testname, stats)))
+		}
+
+		Ok(())
+	}
+}
@@ -0,0 +1,283 @@
+//! The changes module lets several processes, such as a desktop client, a command-line tool and a
+//! sync daemon, share a profile. Writers take turns using an advisory lock file, and each process
+//! can cheaply find out which parts of the profile another one has changed so that it reloads
+//! only what is out of date.
+//!
+//! Every write to a part of the storage database is recorded by bumping that part's counter in the
+//! `changeseq` table. A ChangeMonitor first checks SQLite's `data_version` pragma, which costs no
+//! disk access, and only reads the counters when some other connection has committed something.
+
+use rusqlite;
+use std::collections::HashMap;
+use std::fs;
+use std::path::Path;
+use crate::base::*;
+
+/// The part of the storage database holding the profile's configuration
+pub const CHANGE_CONFIG: &str = "config";
+
+/// The part of the storage database holding messages
+pub const CHANGE_MESSAGES: &str = "messages";
+
+/// The part of the storage database holding the offline command journal
+pub const CHANGE_JOURNAL: &str = "journal";
+
+/// Records that part of the storage database has changed. This should be called as part of the
+/// transaction making the change so that other processes never see one without the other.
+pub fn note_change(conn: &rusqlite::Connection, area: &str) -> Result<(), MensagoError> {
+
+	let sql = "INSERT INTO changeseq(area,seq) VALUES(?1,1)
+		ON CONFLICT(area) DO UPDATE SET seq=seq+1";
+	match conn.execute(sql, [area]) {
+		Ok(_) => Ok(()),
+
+		// Databases created before change tracking was added won't have the table
+		Err(rusqlite::Error::SqliteFailure(_, Some(msg)))
+			if msg.contains("no such table: changeseq") => {
+			ensure_changeseq_table(conn)?;
+			match conn.execute(sql, [area]) {
+				Ok(_) => Ok(()),
+				Err(e) => Err(MensagoError::ErrDatabaseException(e.to_string()))
+			}
+		},
+		Err(e) => Err(MensagoError::ErrDatabaseException(e.to_string()))
+	}
+}
+
+// Creates the change sequence table in databases made before it existed
+fn ensure_changeseq_table(conn: &rusqlite::Connection) -> Result<(), MensagoError> {
+
+	match conn.execute(
+		"CREATE TABLE IF NOT EXISTS 'changeseq'('area' TEXT NOT NULL PRIMARY KEY,
+			'seq' INTEGER NOT NULL);", []) {
+		Ok(_) => Ok(()),
+		Err(e) => {
+			Err(MensagoError::ErrDatabaseException(String::from(e.to_string())))
+		}
+	}
+}
+
+/// ChangeMonitor keeps its own connection to a storage database and reports the parts of it which
+/// have been changed by other connections, including those in other processes.
+#[derive(Debug)]
+pub struct ChangeMonitor {
+	conn: rusqlite::Connection,
+	data_version: i64,
+	seqs: HashMap<String, i64>,
+}
+
+impl ChangeMonitor {
+
+	/// Opens a monitor for the database at the specified path. Only changes made after this call
+	/// are reported.
+	pub fn open(dbpath: &Path) -> Result<ChangeMonitor, MensagoError> {
+
+		let conn = rusqlite::Connection::open_with_flags(dbpath,
+			rusqlite::OpenFlags::SQLITE_OPEN_READ_ONLY)?;
+		let mut out = ChangeMonitor {
+			conn,
+			data_version: 0,
+			seqs: HashMap::new(),
+		};
+		out.data_version = out.get_data_version()?;
+		out.seqs = out.get_seqs()?;
+
+		Ok(out)
+	}
+
+	/// Returns the names of the parts of the database which have changed since the last call. The
+	/// list is empty if nothing has.
+	pub fn poll(&mut self) -> Result<Vec<String>, MensagoError> {
+
+		let version = self.get_data_version()?;
+		if version == self.data_version {
+			return Ok(Vec::new())
+		}
+		self.data_version = version;
+
+		let seqs = self.get_seqs()?;
+		let mut out: Vec<String> = seqs.iter()
+			.filter(|(area, seq)| self.seqs.get(*area) != Some(*seq))
+			.map(|(area, _)| area.clone())
+			.collect();
+		out.sort();
+		self.seqs = seqs;
+
+		Ok(out)
+	}
+
+	fn get_data_version(&self) -> Result<i64, MensagoError> {
+		Ok(self.conn.pragma_query_value(None, "data_version", |row| row.get::<usize,i64>(0))?)
+	}
+
+	fn get_seqs(&self) -> Result<HashMap<String, i64>, MensagoError> {
+
+		let mut out = HashMap::new();
+
+		// The table won't exist until something has been changed in older databases
+		let mut stmt = match self.conn.prepare("SELECT area,seq FROM changeseq") {
+			Ok(v) => v,
+			Err(_) => return Ok(out),
+		};
+		let mut rows = stmt.query([])?;
+		while let Some(row) = rows.next()? {
+			out.insert(row.get::<usize,String>(0)?, row.get::<usize,i64>(1)?);
+		}
+
+		Ok(out)
+	}
+}
+
+/// WriterLock is an advisory lock on a profile, held by a process while it makes changes which
+/// must not be interleaved with another process's, such as applying a batch of updates from the
+/// server. SQLite keeps individual transactions safe on its own. The lock is released when the
+/// WriterLock is dropped or the process exits.
+#[derive(Debug)]
+pub struct WriterLock {
+	file: Option<fs::File>,
+}
+
+impl WriterLock {
+
+	/// Waits until the lock file at the specified path can be locked and then locks it. The file
+	/// is created if it doesn't exist.
+	pub fn acquire(path: &Path) -> Result<WriterLock, MensagoError> {
+		let file = WriterLock::open_file(path)?;
+		file.lock()?;
+		Ok(WriterLock { file: Some(file) })
+	}
+
+	/// Locks the lock file at the specified path if no other process has it locked. Returns None
+	/// if another process holds the lock.
+	pub fn try_acquire(path: &Path) -> Result<Option<WriterLock>, MensagoError> {
+		let file = WriterLock::open_file(path)?;
+		match file.try_lock() {
+			Ok(_) => Ok(Some(WriterLock { file: Some(file) })),
+			Err(fs::TryLockError::WouldBlock) => Ok(None),
+			Err(fs::TryLockError::Error(e)) => Err(MensagoError::from(e)),
+		}
+	}
+
+	/// Returns a lock for a profile which no other process can use, such as one kept in memory.
+	/// There is nothing to wait for, so it doesn't lock anything.
+	pub fn uncontended() -> WriterLock {
+		WriterLock { file: None }
+	}
+
+	fn open_file(path: &Path) -> Result<fs::File, MensagoError> {
+		Ok(fs::OpenOptions::new().read(true).write(true).create(true).truncate(false)
+			.open(path)?)
+	}
+}
+
+impl Drop for WriterLock {
+	fn drop(&mut self) {
+		if let Some(file) = self.file.as_ref() {
+			let _ = file.unlock();
+		}
+	}
+}
+
+#[cfg(test)]
+mod tests {
+	use crate::*;
+	use crate::commands::servermsg::*;
+	use crate::testutil::*;
+
+	#[test]
+	fn test_change_monitor() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_change_monitor");
+		let test_path = setup_test(&testname);
+
+		let mut profman = ProfileManager::new(&test_path);
+		profman.create_profile("Primary")?;
+		profman.activate_profile("Primary")?;
+		let mut dbpath = profman.get_active_profile().unwrap().path.clone();
+		dbpath.push("storage.db");
+
+		// The writer stands in for another process
+		let writer = rusqlite::Connection::open(&dbpath)?;
+		let mut monitor = ChangeMonitor::open(&dbpath)?;
+		if monitor.poll()?.len() != 0 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: changes reported before any were made", testname)))
+		}
+
+		let mut config = Config::new("");
+		config.set("test_field", ConfigScope::Global, "", "value")?;
+		config.update_db(&writer)?;
+		add_journal_entry(&writer, "msg1", &ClientRequest::new("DELETE"), Coalesce::Supersede)?;
+		let changed = monitor.poll()?;
+		if changed != vec![CHANGE_CONFIG, CHANGE_JOURNAL] {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: wrong changes reported: {:?}", testname, changed)))
+		}
+		if monitor.poll()?.len() != 0 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: changes reported twice", testname)))
+		}
+
+		// A profile picks up configuration changed elsewhere when refreshed
+		config.set("test_field", ConfigScope::Global, "", "newvalue")?;
+		config.update_db(&writer)?;
+		let profile = profman.get_active_profile_mut().unwrap();
+		if !profile.refresh()?.contains(&String::from(CHANGE_CONFIG))
+			|| profile.config.get("test_field")? != "newvalue" {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: profile didn't reload config", testname)))
+		}
+
+		Ok(())
+	}
+
+	#[test]
+	fn test_note_change() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_note_change");
+		let conn = rusqlite::Connection::open_in_memory()?;
+
+		// Databases without the changeseq table get one the first time a change is noted
+		note_change(&conn, CHANGE_MESSAGES)?;
+		note_change(&conn, CHANGE_MESSAGES)?;
+		let seq: i64 = conn.query_row("SELECT seq FROM changeseq WHERE area=?1",
+			[CHANGE_MESSAGES], |row| row.get(0))?;
+		if seq != 2 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: wrong sequence number {}", testname, seq)))
+		}
+
+		// Any other error is passed on as is
+		conn.execute("PRAGMA query_only=1", [])?;
+		match note_change(&conn, CHANGE_MESSAGES) {
+			Err(MensagoError::ErrDatabaseException(msg)) if msg.contains("readonly") => (),
+			other => {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: wrong result for read-only database: {:?}", testname, other)))
+			}
+		}
+
+		Ok(())
+	}
+
+	#[test]
+	fn test_writer_lock() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_writer_lock");
+		let mut lockpath = setup_test(&testname);
+		lockpath.push("profile.lock");
+
+		let lock = WriterLock::acquire(&lockpath)?;
+		if WriterLock::try_acquire(&lockpath)?.is_some() {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: lock acquired twice", testname)))
+		}
+		drop(lock);
+		if WriterLock::try_acquire(&lockpath)?.is_none() {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: lock not released", testname)))
+		}
+
+		Ok(())
+	}
+}
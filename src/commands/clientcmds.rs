@@ -1,9 +1,109 @@
 use crate::base::*;
 use crate::commands::servermsg::*;
-use std::net::TcpStream;
+use crate::transport::*;
 
-pub fn quit(conn: &mut TcpStream) -> Result<(), MensagoError> {
+pub fn quit<T: Transport + ?Sized>(conn: &mut T) -> Result<(), MensagoError> {
 
 	let quitreq = ClientRequest::new("QUIT");
 	quitreq.send(conn)
 }
+
+/// Asks the server to push notifications of new updates over this connection so that the client
+/// doesn't need to poll for them. Once this succeeds the connection is dedicated to notifications
+/// and `read_update()` is used to wait for each one. The number of updates already waiting on the
+/// server is returned.
+pub fn idle_notify<T: Transport + ?Sized>(conn: &mut T) -> Result<u64, MensagoError> {
+
+	let req = ClientRequest::from(
+		"IDLE", &vec![
+			("Notify", "1"),
+		]
+	);
+	req.send(conn)?;
+
+	read_update(conn)
+}
+
+/// Waits for the server to push an update notification on a connection set up with
+/// `idle_notify()` and returns the number of new updates.
+pub fn read_update<T: Transport + ?Sized>(conn: &mut T) -> Result<u64, MensagoError> {
+
+	let resp = ServerResponse::receive(conn)?;
+	if resp.status.code != 100 {
+		return Err(MensagoError::ErrProtocol(resp.status))
+	}
+
+	if !resp.check_fields(&vec![("UpdateCount", true)]) {
+		return Err(MensagoError::ErrSchemaFailure)
+	}
+
+	match resp.data.get("UpdateCount").unwrap().parse::<u64>() {
+		Ok(v) => Ok(v),
+		Err(_) => { return Err(MensagoError::ErrBadValue) }
+	}
+}
+
+/// Sends a NOOP command. It does nothing on the server side, which makes it useful for checking
+/// that a connection is still alive and for keeping it from being closed for inactivity.
+pub fn noop<C: Exchange + ?Sized>(conn: &mut C) -> Result<(), MensagoError> {
+
+	let req = ClientRequest::new("NOOP");
+
+	let resp = conn.exchange(&req)?;
+	if resp.status.code != 200 {
+		return Err(MensagoError::ErrProtocol(resp.status))
+	}
+	Ok(())
+}
+
+/// Requests a token which can be used with `resume()` to restore the current session on a new
+/// connection without logging in again. The session must already be authenticated.
+pub fn getresumetoken<C: Exchange + ?Sized>(conn: &mut C) -> Result<String, MensagoError> {
+
+	let req = ClientRequest::new("GETRESUMETOKEN");
+
+	let resp = conn.exchange(&req)?;
+	if resp.status.code != 200 {
+		return Err(MensagoError::ErrProtocol(resp.status))
+	}
+
+	if !resp.check_fields(&vec![("Token", true)]) {
+		return Err(MensagoError::ErrSchemaFailure)
+	}
+
+	Ok(resp.data.get("Token").unwrap().clone())
+}
+
+/// Resumes an authenticated session on a new connection using a token from `getresumetoken()`.
+/// The session features to enable are requested at the same time, so a single round trip replaces
+/// session setup and login. Tokens can only be used once, so the server's reply contains a new
+/// one along with the features it accepted.
+pub fn resume<C: Exchange + ?Sized>(conn: &mut C, token: &str, features: &[String])
+-> Result<(String, Vec<String>), MensagoError> {
+
+	let featurelist = features.join(",");
+	let req = ClientRequest::from(
+		"RESUME", &vec![
+			("Token", token),
+			("Features", featurelist.as_str()),
+		]
+	);
+
+	let resp = conn.exchange(&req)?;
+	if resp.status.code != 200 {
+		return Err(MensagoError::ErrProtocol(resp.status))
+	}
+
+	if !resp.check_fields(&vec![("Token", true), ("Features", false)]) {
+		return Err(MensagoError::ErrSchemaFailure)
+	}
+
+	let accepted = match resp.data.get("Features") {
+		Some(v) => v.split(',')
+			.filter(|f| f.len() > 0 && features.iter().any(|x| x == f))
+			.map(|f| String::from(f))
+			.collect(),
+		None => Vec::new(),
+	};
+	Ok((resp.data.get("Token").unwrap().clone(), accepted))
+}
@@ -0,0 +1,615 @@
+//! Commands for transferring files between the client and the server. Transfers are split into
+//! chunks, and the server acknowledges each chunk with its offset and hash. Progress is recorded
+//! in a journal file after every acknowledged chunk so that an interrupted transfer can be resumed
+//! from where it left off instead of starting over.
+
+use crate::base::*;
+use crate::commands::servermsg::*;
+use crate::transport::*;
+use serde::{Deserialize, Serialize};
+use std::fs;
+use std::io::{Read, Seek, SeekFrom, Write};
+use std::path::{Path, PathBuf};
+
+/// The default size of a transfer chunk, in bytes
+pub const TRANSFER_CHUNK_SIZE: usize = 1048576;
+
+// Algorithm used for verifying individual chunks
+const CHUNK_HASH_ALGORITHM: &str = "BLAKE2B-256";
+
+#[derive(Debug, Clone, Copy, PartialEq, Serialize, Deserialize)]
+pub enum TransferDirection {
+	Upload,
+	Download,
+}
+
+/// TransferJournal records the state of a file transfer. `offset` is the number of bytes which
+/// have been acknowledged by the server in the case of an upload or verified and written to disk
+/// in the case of a download. `temp_name` is the name the server assigned to an upload in
+/// progress.
+#[derive(Debug, Clone, PartialEq, Serialize, Deserialize)]
+pub struct TransferJournal {
+	pub direction: TransferDirection,
+	pub local_path: String,
+	pub server_path: String,
+	pub temp_name: String,
+	pub size: u64,
+	pub chunk_size: usize,
+	pub offset: u64,
+}
+
+impl TransferJournal {
+
+	/// Loads a journal from disk. Ok(None) is returned if there isn't one.
+	pub fn load(path: &Path) -> Result<Option<TransferJournal>, MensagoError> {
+		if !path.exists() {
+			return Ok(None)
+		}
+
+		let rawdata = fs::read(path)?;
+		Ok(Some(serde_json::from_slice(&rawdata)?))
+	}
+
+	/// Saves the journal to disk. The journal is written to a temporary file which is then renamed
+	/// over the old one so that a crash in the middle of saving can't leave a corrupt journal.
+	pub fn save(&self, path: &Path) -> Result<(), MensagoError> {
+		let mut temppath = PathBuf::from(path);
+		temppath.set_extension("tmp");
+		fs::write(&temppath, serde_json::to_vec(self)?)?;
+		fs::rename(&temppath, path)?;
+		Ok(())
+	}
+
+	// Returns true if the journal describes the specified transfer
+	fn matches(&self, direction: TransferDirection, local_path: &str, server_path: &str) -> bool {
+		self.direction == direction && self.local_path == local_path &&
+			self.server_path == server_path
+	}
+}
+
+/// Uploads a file to the specified directory on the server and returns the name of the file on
+/// the server. If the journal file exists and describes the same transfer, the upload resumes
+/// from the last chunk acknowledged by the server. The journal is removed once the upload is
+/// complete.
+///
+/// If the server already has the whole file, such as when the response to the last chunk was
+/// lost or the file is empty, it may either answer the request with the final 200 response or
+/// report an offset equal to the size and then send the final response without waiting for data.
+pub fn upload<T: Transport + ?Sized>(conn: &mut T, localpath: &Path, serverpath: &str,
+	journalpath: &Path) -> Result<String, MensagoError> {
+
+	let localstr = match localpath.to_str() {
+		Some(v) => v,
+		None => { return Err(MensagoError::ErrBadValue) }
+	};
+
+	let mut handle = fs::File::open(localpath)?;
+	let size = handle.metadata()?.len();
+
+	let mut journal = match TransferJournal::load(journalpath)? {
+		Some(v) if v.matches(TransferDirection::Upload, localstr, serverpath) &&
+			v.size == size => v,
+		_ => TransferJournal {
+			direction: TransferDirection::Upload,
+			local_path: String::from(localstr),
+			server_path: String::from(serverpath),
+			temp_name: String::new(),
+			size,
+			chunk_size: TRANSFER_CHUNK_SIZE,
+			offset: 0,
+		},
+	};
+
+	let mut req = ClientRequest::from(
+		"UPLOAD", &vec![
+			("Size", size.to_string().as_str()),
+			("Path", serverpath),
+			("Chunk-Size", journal.chunk_size.to_string().as_str()),
+		]
+	);
+	if journal.temp_name.len() > 0 {
+		req.data.insert(String::from("TempName"), journal.temp_name.clone());
+		req.data.insert(String::from("Offset"), journal.offset.to_string());
+	}
+	req.send(conn)?;
+
+	let resp = ServerResponse::receive(conn)?;
+	if resp.status.code == 200 {
+		return finish_upload(&resp, &journal, journalpath)
+	}
+	if resp.status.code != 100 {
+		return Err(MensagoError::ErrProtocol(resp.status))
+	}
+	if !resp.check_fields(&vec![("TempName", true), ("Offset", true)]) {
+		return Err(MensagoError::ErrSchemaFailure)
+	}
+
+	// The server may have lost data which it previously acknowledged, so it has the final say on
+	// where the transfer resumes, but it can't be further along than what we sent.
+	let offset = parse_offset(&resp, "Offset")?;
+	if offset > journal.offset && journal.temp_name.len() > 0 {
+		return Err(MensagoError::ErrBadValue)
+	}
+	journal.temp_name = resp.data.get("TempName").unwrap().clone();
+	journal.offset = offset;
+	journal.save(journalpath)?;
+
+	if journal.offset == journal.size {
+		let resp = ServerResponse::receive(conn)?;
+		if resp.status.code != 200 {
+			return Err(MensagoError::ErrProtocol(resp.status))
+		}
+		return finish_upload(&resp, &journal, journalpath)
+	}
+
+	handle.seek(SeekFrom::Start(journal.offset))?;
+	let mut buffer = vec![0u8; journal.chunk_size];
+	loop {
+		let chunklen = (journal.size - journal.offset).min(journal.chunk_size as u64) as usize;
+		handle.read_exact(&mut buffer[..chunklen])?;
+		let chunkhash = eznacl::get_hash(CHUNK_HASH_ALGORITHM, &buffer[..chunklen])?;
+
+		write_message(conn, &buffer[..chunklen])?;
+
+		let resp = ServerResponse::receive(conn)?;
+		if resp.status.code != 100 && resp.status.code != 200 {
+			return Err(MensagoError::ErrProtocol(resp.status))
+		}
+		if !resp.check_fields(&vec![("Offset", true), ("Hash", true)]) {
+			return Err(MensagoError::ErrSchemaFailure)
+		}
+
+		let newoffset = journal.offset + chunklen as u64;
+		if parse_offset(&resp, "Offset")? != newoffset ||
+			resp.data.get("Hash").unwrap() != &chunkhash.to_string() {
+			return Err(MensagoError::ErrBadValue)
+		}
+		journal.offset = newoffset;
+
+		if resp.status.code == 200 {
+			return finish_upload(&resp, &journal, journalpath)
+		}
+
+		if journal.offset >= journal.size {
+			return Err(MensagoError::ErrSize)
+		}
+		journal.save(journalpath)?;
+	}
+}
+
+/// Downloads a file from the server. If the journal file exists and describes the same transfer,
+/// the download resumes after the last chunk which was verified and written to disk. The journal
+/// is removed once the download is complete.
+pub fn download<T: Transport + ?Sized>(conn: &mut T, serverpath: &str, localpath: &Path,
+	journalpath: &Path) -> Result<(), MensagoError> {
+
+	let localstr = match localpath.to_str() {
+		Some(v) => v,
+		None => { return Err(MensagoError::ErrBadValue) }
+	};
+
+	let mut journal = match TransferJournal::load(journalpath)? {
+		Some(v) if v.matches(TransferDirection::Download, localstr, serverpath) &&
+			localpath.exists() => v,
+		_ => TransferJournal {
+			direction: TransferDirection::Download,
+			local_path: String::from(localstr),
+			server_path: String::from(serverpath),
+			temp_name: String::new(),
+			size: 0,
+			chunk_size: TRANSFER_CHUNK_SIZE,
+			offset: 0,
+		},
+	};
+
+	let req = ClientRequest::from(
+		"DOWNLOAD", &vec![
+			("Path", serverpath),
+			("Offset", journal.offset.to_string().as_str()),
+			("Chunk-Size", journal.chunk_size.to_string().as_str()),
+		]
+	);
+	req.send(conn)?;
+
+	let resp = ServerResponse::receive(conn)?;
+	if resp.status.code != 100 {
+		return Err(MensagoError::ErrProtocol(resp.status))
+	}
+	if !resp.check_fields(&vec![("Size", true)]) {
+		return Err(MensagoError::ErrSchemaFailure)
+	}
+	let size = parse_offset(&resp, "Size")?;
+	if journal.size != 0 && journal.size != size {
+		// The file changed on the server since we started, so the next attempt has to start over
+		fs::remove_file(journalpath)?;
+		return Err(MensagoError::ErrSize)
+	}
+	journal.size = size;
+
+	// Anything in the local file past the journal's offset was never verified, so get rid of it
+	let mut handle = fs::OpenOptions::new().create(true).write(true).open(localpath)?;
+	handle.set_len(journal.offset)?;
+	handle.seek(SeekFrom::Start(journal.offset))?;
+	journal.save(journalpath)?;
+
+	while journal.offset < journal.size {
+		let header = ServerResponse::receive(conn)?;
+		if header.status.code != 100 {
+			return Err(MensagoError::ErrProtocol(header.status))
+		}
+		if !header.check_fields(&vec![("Offset", true), ("Hash", true)]) {
+			return Err(MensagoError::ErrSchemaFailure)
+		}
+		if parse_offset(&header, "Offset")? != journal.offset {
+			return Err(MensagoError::ErrBadValue)
+		}
+
+		let chunk = read_message(conn)?;
+		if chunk.len() == 0 || journal.offset + chunk.len() as u64 > journal.size {
+			return Err(MensagoError::ErrSize)
+		}
+		let chunkhash = eznacl::get_hash(CHUNK_HASH_ALGORITHM, &chunk)?;
+		if header.data.get("Hash").unwrap() != &chunkhash.to_string() {
+			return Err(MensagoError::ErrBadValue)
+		}
+
+		// The chunk has to be on disk before the journal says it is
+		handle.write_all(&chunk)?;
+		handle.sync_data()?;
+		journal.offset += chunk.len() as u64;
+		journal.save(journalpath)?;
+	}
+
+	fs::remove_file(journalpath)?;
+	Ok(())
+}
+
+// Handles the server's final response to an upload. The server only sends it once it has the
+// whole file, so the journal is no longer needed.
+fn finish_upload(resp: &ServerResponse, journal: &TransferJournal, journalpath: &Path)
+-> Result<String, MensagoError> {
+
+	if !resp.check_fields(&vec![("Offset", true), ("FileName", true)]) {
+		return Err(MensagoError::ErrSchemaFailure)
+	}
+	if parse_offset(resp, "Offset")? != journal.size {
+		return Err(MensagoError::ErrSize)
+	}
+	if journalpath.exists() {
+		fs::remove_file(journalpath)?;
+	}
+	Ok(resp.data.get("FileName").unwrap().clone())
+}
+
+// Utility function to get a numeric field from a server response
+fn parse_offset(resp: &ServerResponse, field: &str) -> Result<u64, MensagoError> {
+	match resp.data.get(field).unwrap().parse::<u64>() {
+		Ok(v) => Ok(v),
+		Err(_) => Err(MensagoError::ErrBadValue),
+	}
+}
+
+#[cfg(test)]
+mod tests {
+	use crate::*;
+	use crate::commands::servermsg::*;
+	use crate::commands::testserver::*;
+	use crate::testutil::*;
+	use std::collections::HashMap;
+	use std::fs;
+	use std::sync::{Arc, Mutex};
+
+	fn make_test_data() -> Vec<u8> {
+		(0..(TRANSFER_CHUNK_SIZE * 3 + 12345)).map(|i| (i % 251) as u8).collect()
+	}
+
+	// Stand-in server state. `drops` is the number of chunks to send or receive before dropping
+	// the connection, which is used to inject a disconnect into the first attempt of a transfer.
+	// `lose_final` drops the connection in place of the final response to an upload. Finished
+	// uploads are kept in `finished` by temporary name so that a client which missed the final
+	// response can still get the file's name.
+	struct TransferState {
+		uploads: HashMap<String, Vec<u8>>,
+		files: HashMap<String, Vec<u8>>,
+		finished: HashMap<String, usize>,
+		drops: Option<usize>,
+		lose_final: bool,
+	}
+
+	impl TransferState {
+		fn new(files: HashMap<String, Vec<u8>>, drops: Option<usize>) -> TransferState {
+			TransferState {
+				uploads: HashMap::new(),
+				files,
+				finished: HashMap::new(),
+				drops,
+				lose_final: false,
+			}
+		}
+
+		// Moves a complete upload into the file list and returns the final response for it, or
+		// None if the response is to be lost
+		fn finish_upload(&mut self, tempname: &str, hash: &str) -> Option<ServerResponse> {
+			let data = self.uploads.remove(tempname).unwrap();
+			let size = data.len().to_string();
+			self.finished.insert(String::from(tempname), data.len());
+			self.files.insert(String::from("uploaded"), data);
+			if self.lose_final {
+				self.lose_final = false;
+				return None
+			}
+			Some(TestServer::response(200, "OK",
+				&[("Offset", &size), ("Hash", hash), ("FileName", "uploaded")]))
+		}
+	}
+
+	fn handle_transfer(req: &ClientRequest, conn: &mut dyn Transport,
+		state: &Mutex<TransferState>) -> Result<bool, MensagoError> {
+
+		match req.action.as_str() {
+			"UPLOAD" => {
+				let size = req.data.get("Size").unwrap().parse::<usize>().unwrap();
+				let tempname = match req.data.get("TempName") {
+					Some(v) => v.clone(),
+					None => format!("upload{}", state.lock().unwrap().finished.len() + 1),
+				};
+				if let Some(v) = state.lock().unwrap().finished.get(&tempname) {
+					TestServer::send(conn, &TestServer::response(200, "OK",
+						&[("Offset", &v.to_string()), ("FileName", "uploaded")]))?;
+					return Ok(true)
+				}
+				let offset = {
+					let mut state = state.lock().unwrap();
+					let data = state.uploads.entry(tempname.clone()).or_insert(Vec::new());
+					if let Some(v) = req.data.get("Offset") {
+						data.truncate(v.parse::<usize>().unwrap());
+					}
+					data.len()
+				};
+				TestServer::send(conn, &TestServer::response(100, "CONTINUE",
+					&[("TempName", &tempname), ("Offset", &offset.to_string())]))?;
+				if offset == size {
+					let resp = state.lock().unwrap().finish_upload(&tempname, "");
+					return match resp {
+						Some(v) => { TestServer::send(conn, &v)?; Ok(true) },
+						None => Ok(false),
+					}
+				}
+
+				let mut offset = offset;
+				while offset < size {
+					let chunk = read_message(conn)?;
+					let mut state = state.lock().unwrap();
+					if let Some(v) = state.drops {
+						if v == 0 {
+							state.drops = None;
+							return Ok(false)
+						}
+						state.drops = Some(v - 1);
+					}
+					state.uploads.get_mut(&tempname).unwrap().extend_from_slice(&chunk);
+					offset += chunk.len();
+
+					let hash = eznacl::get_hash("BLAKE2B-256", &chunk)?.to_string();
+					if offset < size {
+						TestServer::send(conn, &TestServer::response(100, "CONTINUE",
+							&[("Offset", &offset.to_string()), ("Hash", &hash)]))?;
+					} else {
+						match state.finish_upload(&tempname, &hash) {
+							Some(v) => TestServer::send(conn, &v)?,
+							None => return Ok(false),
+						}
+					}
+				}
+				Ok(true)
+			},
+			"DOWNLOAD" => {
+				let offset = req.data.get("Offset").unwrap().parse::<usize>().unwrap();
+				let chunksize = req.data.get("Chunk-Size").unwrap().parse::<usize>().unwrap();
+				let data = state.lock().unwrap().files.get(req.data.get("Path").unwrap())
+					.unwrap().clone();
+				TestServer::send(conn, &TestServer::response(100, "CONTINUE",
+					&[("Size", &data.len().to_string())]))?;
+
+				for start in (offset..data.len()).step_by(chunksize) {
+					{
+						let mut state = state.lock().unwrap();
+						if let Some(v) = state.drops {
+							if v == 0 {
+								state.drops = None;
+								return Ok(false)
+							}
+							state.drops = Some(v - 1);
+						}
+					}
+					let chunk = &data[start..(start + chunksize).min(data.len())];
+					let hash = eznacl::get_hash("BLAKE2B-256", chunk)?.to_string();
+					TestServer::send(conn, &TestServer::response(100, "CONTINUE",
+						&[("Offset", &start.to_string()), ("Hash", &hash)]))?;
+					write_message(conn, chunk)?;
+				}
+				Ok(true)
+			},
+			_ => Ok(false),
+		}
+	}
+
+	#[test]
+	fn test_resumable_upload() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_resumable_upload");
+		let test_path = setup_test(&testname);
+
+		let testdata = make_test_data();
+		let mut localpath = test_path.clone();
+		localpath.push("upload.bin");
+		fs::write(&localpath, &testdata)?;
+		let mut journalpath = test_path.clone();
+		journalpath.push("upload.journal");
+
+		let state = Arc::new(Mutex::new(TransferState::new(HashMap::new(), Some(2))));
+		let serverstate = state.clone();
+		let server = TestServer::start(move |req, conn| handle_transfer(req, conn, &serverstate));
+
+		// Case #1: the connection drops after two chunks
+		let mut conn = ServerConnection::new();
+		conn.connect(&server.address, &server.port)?;
+		match upload(conn.get_socket()?, &localpath, "/ wsp", &journalpath) {
+			Ok(_) => {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: upload succeeded despite disconnect", testname)))
+			},
+			Err(_) => (),
+		}
+
+		let journal = TransferJournal::load(&journalpath)?.unwrap();
+		if journal.offset != (TRANSFER_CHUNK_SIZE * 2) as u64 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: journal offset {} after disconnect", testname, journal.offset)))
+		}
+
+		// Case #2: reconnect and resume
+		let mut conn = ServerConnection::new();
+		conn.connect(&server.address, &server.port)?;
+		match upload(conn.get_socket()?, &localpath, "/ wsp", &journalpath) {
+			Ok(v) => {
+				if v != "uploaded" {
+					return Err(MensagoError::ErrProgramException(
+						format!("{}: bad server file name {}", testname, v)))
+				}
+			},
+			Err(e) => {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: error resuming upload: {}", testname, e.to_string())))
+			},
+		}
+
+		if state.lock().unwrap().files.get("uploaded").unwrap() != &testdata {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: uploaded data mismatch", testname)))
+		}
+		if journalpath.exists() {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: journal not removed after upload", testname)))
+		}
+
+		Ok(())
+	}
+
+	#[test]
+	fn test_upload_lost_final_response() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_upload_lost_final_response");
+		let test_path = setup_test(&testname);
+
+		let testdata = make_test_data();
+		let mut localpath = test_path.clone();
+		localpath.push("upload.bin");
+		fs::write(&localpath, &testdata)?;
+		let mut journalpath = test_path.clone();
+		journalpath.push("upload.journal");
+
+		let state = Arc::new(Mutex::new(TransferState::new(HashMap::new(), None)));
+		state.lock().unwrap().lose_final = true;
+		let serverstate = state.clone();
+		let server = TestServer::start(move |req, conn| handle_transfer(req, conn, &serverstate));
+
+		// Case #1: the server gets the whole file, but the connection drops before the client
+		// hears about it
+		let mut conn = ServerConnection::new();
+		conn.connect(&server.address, &server.port)?;
+		if upload(conn.get_socket()?, &localpath, "/ wsp", &journalpath).is_ok() {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: upload succeeded despite disconnect", testname)))
+		}
+
+		// Case #2: resuming finds the upload already finished without sending anything again
+		let mut conn = ServerConnection::new();
+		conn.connect(&server.address, &server.port)?;
+		match upload(conn.get_socket()?, &localpath, "/ wsp", &journalpath) {
+			Ok(v) if v == "uploaded" => (),
+			other => {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: wrong result resuming upload: {:?}", testname, other)))
+			},
+		}
+		if journalpath.exists() {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: journal not removed after upload", testname)))
+		}
+
+		// Case #3: an empty file has nothing to send, so it finishes right away
+		let mut emptypath = test_path.clone();
+		emptypath.push("empty.bin");
+		fs::write(&emptypath, b"")?;
+		let mut conn = ServerConnection::new();
+		conn.connect(&server.address, &server.port)?;
+		match upload(conn.get_socket()?, &emptypath, "/ wsp", &journalpath) {
+			Ok(_) => (),
+			Err(e) => {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: error uploading empty file: {}", testname, e.to_string())))
+			},
+		}
+		if state.lock().unwrap().files.get("uploaded").unwrap().len() != 0 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: empty file not uploaded", testname)))
+		}
+
+		Ok(())
+	}
+
+	#[test]
+	fn test_resumable_download() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_resumable_download");
+		let test_path = setup_test(&testname);
+
+		let testdata = make_test_data();
+		let mut localpath = test_path.clone();
+		localpath.push("download.bin");
+		let mut journalpath = test_path.clone();
+		journalpath.push("download.journal");
+
+		let mut files = HashMap::new();
+		files.insert(String::from("/ wsp 1"), testdata.clone());
+		let state = Arc::new(Mutex::new(TransferState::new(files, Some(2))));
+		let serverstate = state.clone();
+		let server = TestServer::start(move |req, conn| handle_transfer(req, conn, &serverstate));
+
+		// Case #1: the connection drops after two chunks
+		let mut conn = ServerConnection::new();
+		conn.connect(&server.address, &server.port)?;
+		match download(conn.get_socket()?, "/ wsp 1", &localpath, &journalpath) {
+			Ok(_) => {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: download succeeded despite disconnect", testname)))
+			},
+			Err(_) => (),
+		}
+
+		let journal = TransferJournal::load(&journalpath)?.unwrap();
+		if journal.offset != (TRANSFER_CHUNK_SIZE * 2) as u64 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: journal offset {} after disconnect", testname, journal.offset)))
+		}
+
+		// Case #2: reconnect and resume
+		let mut conn = ServerConnection::new();
+		conn.connect(&server.address, &server.port)?;
+		match download(conn.get_socket()?, "/ wsp 1", &localpath, &journalpath) {
+			Ok(_) => (),
+			Err(e) => {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: error resuming download: {}", testname, e.to_string())))
+			},
+		}
+
+		if fs::read(&localpath)? != testdata {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: downloaded data mismatch", testname)))
+		}
+
+		Ok(())
+	}
+}
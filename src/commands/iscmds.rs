@@ -1,9 +1,8 @@
 use crate::base::*;
 use crate::commands::servermsg::*;
 use libkeycard::*;
-use std::net::TcpStream;
 
-pub fn getwid(conn: &mut TcpStream, uid: &UserID, domain: Option<&Domain>)
+pub fn getwid<C: Exchange + ?Sized>(conn: &mut C, uid: &UserID, domain: Option<&Domain>)
 -> Result<RandomID, MensagoError> {
 
 	let mut req = ClientRequest::from(
@@ -15,9 +14,8 @@ pub fn getwid(conn: &mut TcpStream, uid: &UserID, domain: Option<&Domain>)
 	if domain.is_some() {
 		req.data.insert(String::from("Domain"), String::from(domain.unwrap().as_string()));
 	}
-	req.send(conn)?;
 
-	let resp = ServerResponse::receive(conn)?;
+	let resp = conn.exchange(&req)?;
 	if resp.status.code != 200 {
 		return Err(MensagoError::ErrProtocol(resp.status))
 	}
@@ -32,7 +30,7 @@ pub fn getwid(conn: &mut TcpStream, uid: &UserID, domain: Option<&Domain>)
 	}
 }
 
-pub fn iscurrent(conn: &mut TcpStream, index: usize, wid: Option<RandomID>)
+pub fn iscurrent<C: Exchange + ?Sized>(conn: &mut C, index: usize, wid: Option<RandomID>)
 -> Result<bool, MensagoError> {
 
 	let mut req = ClientRequest::from(
@@ -44,9 +42,8 @@ pub fn iscurrent(conn: &mut TcpStream, index: usize, wid: Option<RandomID>)
 	if wid.is_some() {
 		req.data.insert(String::from("Workspace-ID"), String::from(wid.unwrap().as_string()));
 	}
-	req.send(conn)?;
 
-	let resp = ServerResponse::receive(conn)?;
+	let resp = conn.exchange(&req)?;
 	if resp.status.code != 200 {
 		return Err(MensagoError::ErrProtocol(resp.status))
 	}
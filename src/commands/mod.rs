@@ -1,6 +1,14 @@
 mod clientcmds;
+mod filecmds;
 mod iscmds;
-mod servermsg;
+pub(crate) mod servermsg;
+
+#[cfg(test)]
+pub(crate) mod testserver;
 
 pub use clientcmds::*;
+pub use filecmds::*;
 pub use iscmds::*;
+pub use servermsg::{CancelToken, ClientRequest, Exchange, ServerResponse, SESSION_FEATURE_CANCEL,
+	SESSION_FEATURE_PROGRESS, SESSION_FEATURE_REQUEST_ID, read_message_cancelable,
+	write_message_cancelable};
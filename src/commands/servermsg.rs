@@ -1,4 +1,4 @@
-/// This module enables sending individual messages over a TcpStream connection. It operates under
+/// This module enables sending individual messages over a Transport. It operates under
 /// the assumption that send and receive buffers are 64KiB in size. Messages which are bigger than 
 /// this are broken up into chunks, sent to the remote host, and reassembled.
 /// 
@@ -10,8 +10,11 @@
 /// eliminates all escaping.
 use std::collections::HashMap;
 use std::io::{Read, Write};
+use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, Ordering};
 use std::time::Duration;
 use crate::base::*;
+use crate::transport::*;
 use lazy_static::lazy_static;
 use serde::{Deserialize, Serialize};
 
@@ -21,15 +24,31 @@ lazy_static! {
 
 pub const MAX_MSG_SIZE: u16 = 65532;
 
+// Largest amount of memory reserved up front for a multipart message. The size comes from the
+// remote host, so anything bigger is allowed to grow as the data actually arrives.
+const MAX_PREALLOC_SIZE: usize = 16_777_216;
+
+/// Session feature which enables CancelFrames for aborting multipart transfers
+pub const SESSION_FEATURE_CANCEL: &str = "cancel";
+
+/// Session feature which enables ProgressFrames for reporting the progress of long operations
+pub const SESSION_FEATURE_PROGRESS: &str = "progress";
+
+/// Session feature which allows requests to carry an ID which the server copies into the response,
+/// so responses can be matched to requests when they don't arrive in order
+pub const SESSION_FEATURE_REQUEST_ID: &str = "requestid";
+
 #[derive(Debug, PartialEq, PartialOrd)]
 #[repr(u8)]
-enum FrameType {
+pub(crate) enum FrameType {
 	SingleFrame = 50,
 	MultipartFrameStart = 51,
 	MultipartFrame = 52,
 	MultipartFrameFinal = 53,
 	SessionSetupRequest = 54,
 	SessionSetupResponse = 55,
+	CancelFrame = 56,
+	ProgressFrame = 57,
 	InvalidFrame = 255,
 }
 
@@ -44,6 +63,8 @@ impl FrameType {
 			53 => FrameType::MultipartFrameFinal,
 			54 => FrameType::SessionSetupRequest,
 			55 => FrameType::SessionSetupResponse,
+			56 => FrameType::CancelFrame,
+			57 => FrameType::ProgressFrame,
 			_ => FrameType::InvalidFrame,
 		}		
 	}
@@ -55,7 +76,7 @@ impl FrameType {
 // all cases a DataFrame is required to be equal to or smaller than the buffer size negotiated
 // between the local host and the remote host.
 #[derive(Debug)]
-struct DataFrame {
+pub(crate) struct DataFrame {
 	buffer: [u8; 65535],
 	index: usize,
 }
@@ -112,15 +133,17 @@ impl DataFrame {
 		&self.buffer[3..self.index]
 	}
 
-	pub fn read<R: Read>(&mut self, conn: &mut R) -> Result<(), MensagoError> {
+	pub fn read<R: Read + ?Sized>(&mut self, conn: &mut R) -> Result<(), MensagoError> {
 
 		// Invalidate the index in case we error out
 		self.index = 0;
 
-		// Check how much should be waiting for us
-		let bytes_read = conn.read(&mut self.buffer[..3])?;
+		// Check how much should be waiting for us. A network read can return less than was asked
+		// for when a frame is split across packets, so read_exact() is used for both the header
+		// and the payload.
+		conn.read_exact(&mut self.buffer[..3])?;
 		
-		if bytes_read < 3 || FrameType::from(self.buffer[0]) == FrameType::InvalidFrame {
+		if FrameType::from(self.buffer[0]) == FrameType::InvalidFrame {
 			return Err(MensagoError::ErrInvalidFrame)
 		}
 
@@ -128,65 +151,200 @@ impl DataFrame {
 		// much less of a headache regardless of what archictecture this is compiled for.
 		let payload_size = (u16::from(self.buffer[1]) << 8) + u16::from(self.buffer[2]);
 
-		let bytes_read = conn.read(&mut self.buffer[3..usize::from(3+payload_size)])?;
-		if bytes_read != usize::from(payload_size) {
-			return Err(MensagoError::ErrSize)
-		}
-		self.index = bytes_read+3;
+		conn.read_exact(&mut self.buffer[3..usize::from(3+payload_size)])?;
+		self.index = usize::from(payload_size)+3;
 
 		Ok(())
 	}
 }
 
 /// Writes a DataFrame to a network connection. The payload may not be any larger than 65532 bytes.
-fn write_frame<W: Write>(conn: &mut W, ftype: FrameType, payload: &[u8]) -> Result<(), MensagoError> {
+pub(crate) fn write_frame<W: Write + ?Sized>(conn: &mut W, ftype: FrameType, payload: &[u8])
+-> Result<(), MensagoError> {
 	
 	let paylen = payload.len() as u16;
 
 	if payload.len() > 65532 {
 		return Err(MensagoError::ErrSize)
 	}
-	conn.write(&[
+	conn.write_all(&[
 		ftype as u8,
 		((paylen >> 8) & 255) as u8,
 		(paylen & 255) as u8,
 	])?;
-	conn.write(payload)?;
+	conn.write_all(payload)?;
 	
 	Ok(())
 }
 
-/// Reads an arbitrarily-sized message from an IO::Read and returns it
-pub fn read_message<R: Read>(conn: &mut R) -> Result<Vec::<u8>, MensagoError> {
+/// CancelToken is used to abort a multipart transfer which is in progress on another thread. The
+/// token is cheap to clone, and all clones share the same state.
+#[derive(Debug, Clone, Default)]
+pub struct CancelToken {
+	flag: Arc<AtomicBool>,
+}
 
-	let mut out = Vec::<u8>::new();
+impl CancelToken {
+
+	/// Creates a new CancelToken
+	pub fn new() -> CancelToken {
+		CancelToken::default()
+	}
+
+	/// Requests cancellation of the transfer using this token
+	pub fn cancel(&self) {
+		self.flag.store(true, Ordering::SeqCst);
+	}
+
+	/// Returns true if cancellation has been requested
+	pub fn is_canceled(&self) -> bool {
+		self.flag.load(Ordering::SeqCst)
+	}
+
+	/// Clears the cancellation flag so that the token can be used for another transfer
+	pub fn reset(&self) {
+		self.flag.store(false, Ordering::SeqCst);
+	}
+}
+
+/// Negotiates optional protocol features, such as SESSION_FEATURE_CANCEL, with the remote host.
+/// The request contains a comma-separated list of the features wanted and the response contains
+/// the ones the remote host agreed to. CancelFrames and ProgressFrames must not be sent unless
+/// the corresponding feature was negotiated.
+pub fn setup_session<S: Read + Write + ?Sized>(conn: &mut S, features: &[&str])
+-> Result<Vec<String>, MensagoError> {
+
+	write_frame(conn, FrameType::SessionSetupRequest, features.join(",").as_bytes())?;
+
+	let mut frame = DataFrame::new();
+	frame.read(conn)?;
+	if frame.get_type() != FrameType::SessionSetupResponse {
+		return Err(MensagoError::ErrBadSession)
+	}
+
+	// Ignore anything the remote host sends back which wasn't asked for
+	let accepted = String::from_utf8(frame.get_payload().to_vec())?;
+	Ok(accepted.split(',')
+		.filter(|f| features.contains(f))
+		.map(|f| String::from(f))
+		.collect())
+}
+
+/// Answers a session setup request from the remote host, accepting the requested features which
+/// are also in the supported list. This is the other side of `setup_session()`. Only the tests
+/// play the server's part, so this is only built for them.
+#[cfg(test)]
+pub fn accept_session<S: Read + Write + ?Sized>(conn: &mut S, supported: &[&str])
+-> Result<Vec<String>, MensagoError> {
+
+	let mut frame = DataFrame::new();
+	frame.read(conn)?;
+	if frame.get_type() != FrameType::SessionSetupRequest {
+		return Err(MensagoError::ErrBadSession)
+	}
+
+	let requested = String::from_utf8(frame.get_payload().to_vec())?;
+	let accepted: Vec<String> = requested.split(',')
+		.filter(|f| supported.contains(f))
+		.map(|f| String::from(f))
+		.collect();
+	write_frame(conn, FrameType::SessionSetupResponse, accepted.join(",").as_bytes())?;
+
+	Ok(accepted)
+}
+
+/// Sends a ProgressFrame to tell the remote host how much of a long-running operation has been
+/// completed. ProgressFrames may be sent before or in the middle of a message and do not affect
+/// it. Like `accept_session()`, this is only needed by the tests.
+#[cfg(test)]
+pub fn write_progress<W: Write + ?Sized>(conn: &mut W, done: usize, total: usize)
+-> Result<(), MensagoError> {
+	write_frame(conn, FrameType::ProgressFrame, format!("{}/{}", done, total).as_bytes())
+}
+
+// Parses the payload of a ProgressFrame
+fn parse_progress(frame: &DataFrame) -> Result<(usize, usize), MensagoError> {
+
+	let valstring = String::from_utf8(frame.get_payload().to_vec())?;
+	let parts: Vec<&str> = valstring.split('/').collect();
+	if parts.len() != 2 {
+		return Err(MensagoError::ErrBadValue)
+	}
+	match (parts[0].parse::<usize>(), parts[1].parse::<usize>()) {
+		(Ok(done), Ok(total)) => Ok((done, total)),
+		_ => Err(MensagoError::ErrBadValue),
+	}
+}
+
+// Reads a message from the connection. `progress` is called with the amount of data received and
+// the total size before each frame of a multipart message and for each ProgressFrame received. If
+// `progress` returns true, the transfer is being canceled: the rest of the frames are read and
+// thrown away until the sender acknowledges the cancellation or the message ends. The message is
+// placed in `out`, replacing its contents but reusing its allocation.
+fn read_message_with<R: Read + ?Sized, F>(conn: &mut R, out: &mut Vec<u8>, mut progress: F)
+-> Result<(), MensagoError>
+where F: FnMut(&mut R, usize, usize) -> Result<bool, MensagoError> {
+
+	out.clear();
 	let mut chunk = DataFrame::new();
+	let mut canceled = false;
 
-	chunk.read(conn)?;
+	// The remote host may send ProgressFrames while it works on a long-running operation before
+	// the message itself arrives. Canceling at this point asks it to abandon the operation.
+	loop {
+		chunk.read(conn)?;
 
-	match chunk.get_type() {
-		FrameType::SingleFrame => {
-			out.extend_from_slice(chunk.get_payload());
-			return Ok(out)
-		},
-		FrameType::MultipartFrameStart => (),
-		FrameType::MultipartFrameFinal | FrameType::MultipartFrame => {
-			return Err(MensagoError::ErrBadSession)
-		},
-		_ => {
-			return Err(MensagoError::ErrInvalidFrame)
+		match chunk.get_type() {
+			FrameType::SingleFrame => {
+				out.extend_from_slice(chunk.get_payload());
+				return Ok(())
+			},
+			FrameType::MultipartFrameStart => break,
+			FrameType::ProgressFrame => {
+				let (done, total) = parse_progress(&chunk)?;
+				if !canceled {
+					canceled = progress(conn, done, total)?;
+				}
+			},
+			// A CancelFrame outside of a message means that the remote host finished sending
+			// before it saw our cancellation, so there is nothing left to abort.
+			FrameType::CancelFrame => (),
+			FrameType::MultipartFrameFinal | FrameType::MultipartFrame => {
+				return Err(MensagoError::ErrBadSession)
+			},
+			_ => {
+				return Err(MensagoError::ErrInvalidFrame)
+			}
 		}
 	}
 	
 	// We got this far, so we have a multipart message which we need to reassemble.
 
 	let totalsize = chunk.get_multipart_size()?;
+	out.reserve(totalsize.min(MAX_PREALLOC_SIZE));
 	
 	let mut sizeread: usize = 0;
 	while sizeread < totalsize {
+		if !canceled {
+			canceled = progress(conn, sizeread, totalsize)?;
+		}
+
 		chunk.read(conn)?;
 
-		out.extend_from_slice(chunk.get_payload());
+		match chunk.get_type() {
+			FrameType::MultipartFrame | FrameType::MultipartFrameFinal => (),
+			FrameType::ProgressFrame => continue,
+			FrameType::CancelFrame => {
+				return Err(MensagoError::ErrCanceled)
+			},
+			_ => {
+				return Err(MensagoError::ErrBadSession)
+			}
+		}
+
+		if !canceled {
+			out.extend_from_slice(chunk.get_payload());
+		}
 		sizeread += chunk.get_size();
 
 		if chunk.get_type() == FrameType::MultipartFrameFinal {
@@ -198,18 +356,62 @@ pub fn read_message<R: Read>(conn: &mut R) -> Result<Vec::<u8>, MensagoError> {
 		return Err(MensagoError::ErrSize)
 	}
 
+	if canceled {
+		return Err(MensagoError::ErrCanceled)
+	}
+
+	Ok(())
+}
+
+/// Reads an arbitrarily-sized message from an IO::Read and returns it
+pub fn read_message<R: Read + ?Sized>(conn: &mut R) -> Result<Vec::<u8>, MensagoError> {
+	let mut out = Vec::<u8>::new();
+	read_message_with(conn, &mut out, |_, _, _| Ok(false))?;
 	Ok(out)
 }
 
-/// Reads a message as per `read_message()` but returns the data as a string
-pub fn read_str_message<R: Read>(conn: &mut R) -> Result<String, MensagoError> {
+/// Reads a message as per `read_message()` into a caller-supplied buffer. Reusing the same buffer
+/// for a series of messages saves allocating and growing a new one for each.
+pub fn read_message_into<R: Read + ?Sized>(conn: &mut R, out: &mut Vec<u8>)
+-> Result<(), MensagoError> {
+	read_message_with(conn, out, |_, _, _| Ok(false))
+}
+
+/// Reads a message as per `read_message()`, but if the token is canceled while a multipart message
+/// is being received, a CancelFrame is sent to the remote host and ErrCanceled is returned once
+/// the remote host has stopped sending, leaving the connection ready for the next command.
+/// `progress` is called with the number of bytes received so far and the total. The cancel
+/// feature must have been negotiated with `setup_session()`.
+pub fn read_message_cancelable<S, F>(conn: &mut S, token: &CancelToken, mut progress: F)
+-> Result<Vec::<u8>, MensagoError>
+where S: Read + Write + ?Sized, F: FnMut(usize, usize) {
+
+	let mut out = Vec::<u8>::new();
+	read_message_with(conn, &mut out, |conn, done, total| {
+		progress(done, total);
+		if token.is_canceled() {
+			write_frame(conn, FrameType::CancelFrame, &[])?;
+			return Ok(true)
+		}
+		Ok(false)
+	})?;
+	Ok(out)
+}
+
+/// Reads a message as per `read_message()` but returns the data as a string. Responses are now
+/// received through `ServerResponse::receive_with_buffer()`, so only the tests use this.
+#[cfg(test)]
+pub fn read_str_message<R: Read + ?Sized>(conn: &mut R) -> Result<String, MensagoError> {
 	
 	let rawdata = read_message(conn)?;
 	Ok(String::from_utf8(rawdata)?)
 }
 
-/// Writes an arbitrarily-sized message to an IO::Write
-pub fn write_message<W: Write>(conn: &mut W, msg: &[u8]) -> Result<(), MensagoError> {
+// Writes a message to the connection, calling `check` before each frame of a multipart message.
+// If `check` returns true, a CancelFrame is sent in place of the rest of the message.
+fn write_message_with<W: Write + ?Sized, F>(conn: &mut W, msg: &[u8], mut check: F)
+-> Result<(), MensagoError>
+where F: FnMut() -> bool {
 
 	if msg.len() == 0 {
 		return Err(MensagoError::ErrSize)
@@ -229,11 +431,18 @@ pub fn write_message<W: Write>(conn: &mut W, msg: &[u8]) -> Result<(), MensagoEr
 	// total size in the payload as a string. All messages that follow contain the actual message
 	// data.
 
+	if check() {
+		return Err(MensagoError::ErrCanceled)
+	}
 	write_frame(conn, FrameType::MultipartFrameStart, msg.len().to_string().as_bytes())?;
 	
 	let mut index: usize = 0;
 	let maxmsgsize = usize::from(MAX_MSG_SIZE);
 	while index+maxmsgsize < msg.len() {
+		if check() {
+			write_frame(conn, FrameType::CancelFrame, &[])?;
+			return Err(MensagoError::ErrCanceled)
+		}
 		write_frame(conn, FrameType::MultipartFrame, &msg[index..index+maxmsgsize])?;
 		index += maxmsgsize;
 	}
@@ -241,13 +450,29 @@ pub fn write_message<W: Write>(conn: &mut W, msg: &[u8]) -> Result<(), MensagoEr
 	write_frame(conn, FrameType::MultipartFrameFinal, &msg[index..])
 }
 
+/// Writes an arbitrarily-sized message to an IO::Write
+pub fn write_message<W: Write + ?Sized>(conn: &mut W, msg: &[u8]) -> Result<(), MensagoError> {
+	write_message_with(conn, msg, || false)
+}
+
+/// Writes a message as per `write_message()`, but if the token is canceled while a multipart
+/// message is being sent, the rest of the message is replaced with a CancelFrame and ErrCanceled
+/// is returned. Frames are never cut short, so the connection remains usable afterward. The
+/// cancel feature must have been negotiated with `setup_session()`.
+pub fn write_message_cancelable<W: Write + ?Sized>(conn: &mut W, msg: &[u8], token: &CancelToken)
+-> Result<(), MensagoError> {
+	write_message_with(conn, msg, || token.is_canceled())
+}
+
 /// ClientRequest is a data structure used to represent a Mensago command, such as LOGIN or GETWID.
 /// It is not part of the library's public API because the command functions are intended to
 /// provide a much better developer experience and integrate with other Rust code better.
 #[derive(Debug, Clone, PartialEq, Serialize, Deserialize)]
 pub struct ClientRequest {
 	pub action: String,
-	pub data: HashMap<String, String>
+	pub data: HashMap<String, String>,
+	#[serde(default, skip_serializing_if = "Option::is_none")]
+	pub id: Option<u64>,
 }
 
 impl ClientRequest {
@@ -257,6 +482,7 @@ impl ClientRequest {
 		ClientRequest {
 			action: String::from(action),
 			data: HashMap::<String, String>::new(),
+			id: None,
 		}
 	}
 
@@ -271,7 +497,7 @@ impl ClientRequest {
 	}
 
 	/// Converts the ClientRequest to JSON and sends to the server
-	pub fn send<W: Write>(&self, conn: &mut W) -> Result<(), MensagoError> {
+	pub fn send<W: Write + ?Sized>(&self, conn: &mut W) -> Result<(), MensagoError> {
 		write_message(conn, serde_json::to_string(&self)?.as_bytes())
 	}
 }
@@ -280,23 +506,34 @@ impl ClientRequest {
 /// holds an integer for easy comparisons and a status string for human interpretation where
 /// required. The `info` field is used by the server to offer more insight as to why an error was
 /// received. Any return data from a command is kept in the `data` field and will be specific to
-/// the individual command.
+/// the individual command. The `id` field is set only when the session uses request IDs and
+/// contains the ID of the request being answered.
 #[derive(Debug, Clone, PartialEq, Serialize, Deserialize)]
 pub struct ServerResponse {
 	pub status: CmdStatus,
-	pub data: HashMap<String, String>
+	pub data: HashMap<String, String>,
+	#[serde(default, skip_serializing_if = "Option::is_none")]
+	pub id: Option<u64>,
 }
 
 impl ServerResponse {
 
 	/// Reads a ServerResponse from the connection
-	pub fn receive<R: Read>(conn: &mut R) -> Result<ServerResponse, MensagoError> {
-		
-		let rawjson = match read_str_message(conn) {
-			Ok(v) => v,
+	pub fn receive<R: Read + ?Sized>(conn: &mut R) -> Result<ServerResponse, MensagoError> {
+		ServerResponse::receive_with_buffer(conn, &mut Vec::new())
+	}
+
+	/// Reads a ServerResponse as per `receive()`, using the supplied buffer for the raw message so
+	/// that it can be reused for the next response. The JSON is parsed straight from the raw bytes,
+	/// which validates the UTF-8 in the same pass instead of making a separate one over a copy.
+	pub fn receive_with_buffer<R: Read + ?Sized>(conn: &mut R, buffer: &mut Vec<u8>)
+	-> Result<ServerResponse, MensagoError> {
+
+		match read_message_into(conn, buffer) {
+			Ok(_) => (),
 			Err(_) => { return Err(MensagoError::ErrBadMessage) }
 		};
-		let msg: ServerResponse = match serde_json::from_str(&rawjson) {
+		let msg: ServerResponse = match serde_json::from_slice(buffer) {
 			Ok(v) => v,
 			Err(_) => { return Err(MensagoError::ErrBadMessage) }
 		};
@@ -317,6 +554,20 @@ impl ServerResponse {
 	}
 }
 
+/// Exchange is implemented by anything which can carry a request to the server and return the
+/// matching response. Commands which consist of a single request and response are written against
+/// it so that they work over a plain connection and a connection shared between threads.
+pub trait Exchange {
+	fn exchange(&mut self, req: &ClientRequest) -> Result<ServerResponse, MensagoError>;
+}
+
+impl<T: Transport + ?Sized> Exchange for T {
+	fn exchange(&mut self, req: &ClientRequest) -> Result<ServerResponse, MensagoError> {
+		req.send(self)?;
+		ServerResponse::receive(self)
+	}
+}
+
 #[cfg(test)]
 mod tests {
 	use super::*;
@@ -490,5 +741,293 @@ mod tests {
 
 		Ok(())
 	}
-}
 
+	// Duplex keeps the two directions of a connection apart so that tests can check what a
+	// function sent while reading from a prepared buffer
+	struct Duplex {
+		input: IoBuffer,
+		output: Vec<u8>,
+	}
+
+	impl Read for Duplex {
+		fn read(&mut self, buf: &mut [u8]) -> std::io::Result<usize> {
+			self.input.read(buf)
+		}
+	}
+
+	impl Write for Duplex {
+		fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+			self.output.write(buf)
+		}
+
+		fn flush(&mut self) -> std::io::Result<()> {
+			Ok(())
+		}
+	}
+
+	// Cancels a token after a certain number of bytes have been written
+	struct CancelingWriter {
+		inner: IoBuffer,
+		written: usize,
+		limit: usize,
+		token: CancelToken,
+	}
+
+	impl Write for CancelingWriter {
+		fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+			self.written += buf.len();
+			if self.written >= self.limit {
+				self.token.cancel();
+			}
+			self.inner.write(buf)
+		}
+
+		fn flush(&mut self) -> std::io::Result<()> {
+			Ok(())
+		}
+	}
+
+	#[test]
+	fn test_session_setup() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_session_setup");
+
+		let mut conn = Duplex { input: IoBuffer::new(), output: Vec::new() };
+		write_frame(&mut conn.input, FrameType::SessionSetupResponse, b"cancel,bogus")?;
+
+		let features = setup_session(&mut conn, &[SESSION_FEATURE_CANCEL,
+			SESSION_FEATURE_PROGRESS])?;
+		if features != vec![String::from(SESSION_FEATURE_CANCEL)] {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: wrong features accepted: {:?}", testname, features)
+			))
+		}
+
+		// The other side of the exchange
+		let mut server = Duplex { input: IoBuffer::new(), output: Vec::new() };
+		server.input.write(&conn.output)?;
+		let features = accept_session(&mut server, &[SESSION_FEATURE_PROGRESS])?;
+		if features != vec![String::from(SESSION_FEATURE_PROGRESS)] {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: server accepted wrong features: {:?}", testname, features)
+			))
+		}
+
+		Ok(())
+	}
+
+	#[test]
+	fn test_write_cancel() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_write_cancel");
+
+		// Cancel partway through a message big enough to need 5 frames
+		let token = CancelToken::new();
+		let mut conn = CancelingWriter {
+			inner: IoBuffer::new(),
+			written: 0,
+			limit: 70000,
+			token: token.clone(),
+		};
+		let sentmsg = "ABCDEFGHIJKLMNOPQRSTUVWXYZ".repeat(10000);
+		match write_message_cancelable(&mut conn, sentmsg.as_bytes(), &token) {
+			Err(MensagoError::ErrCanceled) => (),
+			other => {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: write returned {:?} instead of ErrCanceled", testname, other)
+				))
+			}
+		}
+
+		// The connection must still be usable afterward
+		write_message(&mut conn.inner, b"ThisIsATestMessage")?;
+
+		match read_message(&mut conn.inner) {
+			Err(MensagoError::ErrCanceled) => (),
+			other => {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: read returned {:?} instead of ErrCanceled", testname, other)
+				))
+			}
+		}
+
+		let msgstr = read_str_message(&mut conn.inner)?;
+		if msgstr != "ThisIsATestMessage" {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: data mismatch error after cancel: got '{}'", testname, msgstr)
+			))
+		}
+
+		Ok(())
+	}
+
+	#[test]
+	fn test_read_cancel() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_read_cancel");
+
+		// Simulate the sender: the start of a multipart message and one frame of data go out
+		// before it notices the cancellation and acknowledges it with a CancelFrame of its own.
+		let mut conn = Duplex { input: IoBuffer::new(), output: Vec::new() };
+		let data = "A".repeat(usize::from(MAX_MSG_SIZE));
+		write_frame(&mut conn.input, FrameType::MultipartFrameStart, b"200000")?;
+		write_frame(&mut conn.input, FrameType::MultipartFrame, data.as_bytes())?;
+		write_frame(&mut conn.input, FrameType::CancelFrame, &[])?;
+		write_message(&mut conn.input, b"ThisIsATestMessage")?;
+
+		let token = CancelToken::new();
+		token.cancel();
+		let mut updates = Vec::<(usize, usize)>::new();
+		match read_message_cancelable(&mut conn, &token, |done, total| {
+			updates.push((done, total))
+		}) {
+			Err(MensagoError::ErrCanceled) => (),
+			other => {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: read returned {:?} instead of ErrCanceled", testname, other)
+				))
+			}
+		}
+
+		if conn.output != vec![FrameType::CancelFrame as u8, 0, 0] {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: CancelFrame not sent: {:?}", testname, conn.output)
+			))
+		}
+		if updates != vec![(0, 200000)] {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: wrong progress updates: {:?}", testname, updates)
+			))
+		}
+
+		let msgstr = read_str_message(&mut conn)?;
+		if msgstr != "ThisIsATestMessage" {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: data mismatch error after cancel: got '{}'", testname, msgstr)
+			))
+		}
+
+		Ok(())
+	}
+
+	#[test]
+	fn test_progress_frames() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_progress_frames");
+
+		let mut conn = Duplex { input: IoBuffer::new(), output: Vec::new() };
+		write_progress(&mut conn.input, 5, 10)?;
+		write_progress(&mut conn.input, 10, 10)?;
+		write_message(&mut conn.input, b"ThisIsATestMessage")?;
+		write_progress(&mut conn.input, 1, 2)?;
+		write_message(&mut conn.input, b"ThisIsAnotherTestMessage")?;
+
+		let mut updates = Vec::<(usize, usize)>::new();
+		let msg = read_message_cancelable(&mut conn, &CancelToken::new(), |done, total| {
+			updates.push((done, total))
+		})?;
+		if msg != b"ThisIsATestMessage" {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: data mismatch error", testname)
+			))
+		}
+		if updates != vec![(5, 10), (10, 10)] {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: wrong progress updates: {:?}", testname, updates)
+			))
+		}
+
+		// Plain reads skip over progress information
+		let msgstr = read_str_message(&mut conn)?;
+		if msgstr != "ThisIsAnotherTestMessage" {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: data mismatch error: got '{}'", testname, msgstr)
+			))
+		}
+
+		Ok(())
+	}
+
+	// Builds a serialized response with a string field of roughly the requested size
+	fn make_response(size: usize) -> Result<Vec<u8>, MensagoError> {
+		let mut resp = ServerResponse {
+			status: CmdStatus {
+				code: 200,
+				description: String::from("OK"),
+				info: String::new(),
+			},
+			data: HashMap::new(),
+			id: None,
+		};
+		resp.data.insert(String::from("Payload"), "Ünïcødé text ".repeat(size / 16 + 1));
+		let mut out = Vec::<u8>::new();
+		write_message(&mut out, &serde_json::to_vec(&resp).unwrap())?;
+		Ok(out)
+	}
+
+	#[test]
+	fn test_receive_with_buffer() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_receive_with_buffer");
+
+		let mut raw = make_response(100_000)?;
+		raw.extend(make_response(100)?);
+		let mut conn: &[u8] = &raw;
+		let mut buffer = Vec::<u8>::new();
+		for size in [100_000, 100] {
+			let resp = ServerResponse::receive_with_buffer(&mut conn, &mut buffer)?;
+			if resp.data["Payload"].len() < size {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: payload too short for size {}", testname, size)))
+			}
+		}
+
+		// Invalid UTF-8 is still rejected even though there's no separate validation pass
+		let mut bad = make_response(100)?;
+		let pos = bad.iter().position(|b| *b == "Ü".as_bytes()[0]).unwrap();
+		bad[pos] = 0xff;
+		let mut conn: &[u8] = &bad;
+		match ServerResponse::receive_with_buffer(&mut conn, &mut buffer) {
+			Err(MensagoError::ErrBadMessage) => (),
+			_ => {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: invalid UTF-8 not rejected", testname)))
+			}
+		}
+
+		Ok(())
+	}
+
+	// Compares decoding a response by copying it into a String and parsing that against parsing
+	// the raw bytes into a reused buffer. The sizes are a typical command response, a keycard, and
+	// a large multipart directory listing. Run with
+	// `cargo test --release bench_receive -- --ignored --nocapture`.
+	#[test]
+	#[ignore]
+	fn bench_receive() -> Result<(), MensagoError> {
+
+		for (size, rounds) in [(1_000, 20_000), (16_000, 2_000), (512_000, 100)] {
+			let raw = make_response(size)?;
+
+			let start = std::time::Instant::now();
+			for _ in 0..rounds {
+				let mut conn: &[u8] = &raw;
+				let rawjson = read_str_message(&mut conn)?;
+				let _: ServerResponse = serde_json::from_str(&rawjson).unwrap();
+			}
+			let copied = start.elapsed();
+
+			let start = std::time::Instant::now();
+			let mut buffer = Vec::<u8>::new();
+			for _ in 0..rounds {
+				let mut conn: &[u8] = &raw;
+				ServerResponse::receive_with_buffer(&mut conn, &mut buffer)?;
+			}
+			let direct = start.elapsed();
+
+			println!("{} bytes: copy+parse {:?} avg, parse in place {:?} avg", raw.len(),
+				copied / rounds, direct / rounds);
+		}
+		Ok(())
+	}
+}
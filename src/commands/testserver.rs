@@ -0,0 +1,145 @@
+//! A minimal local stand-in for a Mensago server, used by the unit tests. It sends the greeting,
+//! reads requests using the framing layer, and hands each one to a handler supplied by the test.
+//! The handler has full access to the connection, so it can stream data, answer with anything it
+//! likes, or inject failures by returning `false` to drop the connection.
+
+use std::net::{TcpListener, TcpStream};
+use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::thread;
+use std::io::Read;
+use crate::base::*;
+use crate::commands::servermsg::*;
+use crate::transport::*;
+
+pub type Handler = dyn Fn(&ClientRequest, &mut dyn Transport) -> Result<bool, MensagoError>
+	+ Send + Sync;
+
+pub struct TestServer {
+	pub address: String,
+	pub port: String,
+	stop: Arc<AtomicBool>,
+}
+
+impl TestServer {
+
+	/// Starts a server on a random port on the loopback interface. Each connection is handled on
+	/// its own thread.
+	pub fn start<F>(handler: F) -> TestServer
+	where F: Fn(&ClientRequest, &mut dyn Transport) -> Result<bool, MensagoError>
+		+ Send + Sync + 'static {
+
+		let listener = TcpListener::bind("127.0.0.1:0").unwrap();
+		let port = listener.local_addr().unwrap().port().to_string();
+		let stop = Arc::new(AtomicBool::new(false));
+		let handler: Arc<Handler> = Arc::new(handler);
+
+		let thread_stop = stop.clone();
+		thread::spawn(move || {
+			for stream in listener.incoming() {
+				if thread_stop.load(Ordering::SeqCst) {
+					break
+				}
+				let mut stream = match stream {
+					Ok(v) => v,
+					Err(_) => continue,
+				};
+				let handler = handler.clone();
+				thread::spawn(move || {
+					let _ = serve(&mut stream, handler);
+				});
+			}
+		});
+
+		TestServer {
+			address: String::from("127.0.0.1"),
+			port,
+			stop,
+		}
+	}
+
+	/// Starts a server on its own thread which talks to the client over an in-process pipe and
+	/// returns the client's end of the pipe
+	pub fn start_pipe<F>(handler: F) -> PipeEnd
+	where F: Fn(&ClientRequest, &mut dyn Transport) -> Result<bool, MensagoError>
+		+ Send + Sync + 'static {
+
+		let (client, server) = pipe();
+		thread::spawn(move || {
+			let _ = TestServer::serve_transport(Box::new(server), handler);
+		});
+		client
+	}
+
+	/// Serves a single connection over any transport on the calling thread
+	pub fn serve_transport<F>(mut stream: Box<dyn Transport>, handler: F)
+	-> Result<(), MensagoError>
+	where F: Fn(&ClientRequest, &mut dyn Transport) -> Result<bool, MensagoError>
+		+ Send + Sync + 'static {
+		serve(&mut *stream, Arc::new(handler))
+	}
+
+	/// Makes a ServerResponse with the specified code and data
+	pub fn response(code: u16, description: &str, data: &[(&str, &str)]) -> ServerResponse {
+		let mut out = ServerResponse {
+			status: CmdStatus {
+				code,
+				description: String::from(description),
+				info: String::new(),
+			},
+			data: std::collections::HashMap::new(),
+			id: None,
+		};
+		for pair in data {
+			out.data.insert(String::from(pair.0), String::from(pair.1));
+		}
+		out
+	}
+
+	/// Sends a ServerResponse over the connection
+	pub fn send(conn: &mut dyn Transport, response: &ServerResponse) -> Result<(), MensagoError> {
+		write_message(conn, serde_json::to_string(response)?.as_bytes())
+	}
+}
+
+impl Drop for TestServer {
+	fn drop(&mut self) {
+		// The listener thread is blocked in accept(), so poke it with a connection after setting
+		// the flag
+		self.stop.store(true, Ordering::SeqCst);
+		let _ = TcpStream::connect(format!("{}:{}", self.address, self.port));
+	}
+}
+
+fn serve(stream: &mut dyn Transport, handler: Arc<Handler>) -> Result<(), MensagoError> {
+
+	stream.write_all(br#"{"name":"Mensago","version":"0.1","code":200,"status":"OK","date":""}"#)?;
+
+	loop {
+		// Clients may negotiate protocol features at any time before sending a command. The test
+		// server supports all of them. Anything else is the start of a message, so the header is
+		// put back in front of the stream for read_message().
+		let mut header = [0u8; 3];
+		stream.read_exact(&mut header)?;
+		if header[0] == FrameType::SessionSetupRequest as u8 {
+			let mut payload = vec![0u8; (usize::from(header[1]) << 8) | usize::from(header[2])];
+			stream.read_exact(&mut payload)?;
+			let requested = String::from_utf8(payload)?;
+			let accepted: Vec<&str> = requested.split(',')
+				.filter(|f| [SESSION_FEATURE_CANCEL, SESSION_FEATURE_PROGRESS,
+					SESSION_FEATURE_REQUEST_ID].contains(f))
+				.collect();
+			write_frame(stream, FrameType::SessionSetupResponse, accepted.join(",").as_bytes())?;
+			continue
+		}
+
+		let rawdata = read_message(&mut (&header[..]).chain(&mut *stream))?;
+		let req: ClientRequest = serde_json::from_slice(&rawdata)?;
+		if req.action == "QUIT" {
+			return Ok(())
+		}
+		if !handler(&req, stream)? {
+			return Ok(())
+		}
+	}
+}
@@ -5,6 +5,7 @@ use rusqlite;
 use std::collections::HashMap;
 use std::fmt;
 use crate::base::*;
+use crate::changes::*;
 
 /// ConfigScope defines the scope of a configuration setting.
 /// - Global: Setting which applies to the application as a whole, regardless of platform or architecture. A lot of user preferences will go here, such as the theme.
@@ -125,6 +126,15 @@ impl Config {
 		self.signature.clone()
 	}
 
+	/// Returns an estimate of how much memory the configuration takes up, in bytes
+	pub fn get_memory_usage(&self) -> usize {
+		let field_size = std::mem::size_of::<String>() + std::mem::size_of::<ConfigField>();
+		self.data.iter()
+			.map(|(k, v)| field_size + k.len() + v.scopevalue.len() + v.value.len())
+			.sum::<usize>()
+			+ self.modified.iter().map(|v| v.len()).sum::<usize>()
+	}
+
 	/// Returns true if the table has a specific field
 	#[inline]
 	pub fn has(&self, field: &str) -> bool {
@@ -224,6 +234,7 @@ impl Config {
 			}
 		}
 
+		note_change(conn, CHANGE_CONFIG)?;
 		self.modified.clear();
 		
 		Ok(())
@@ -390,6 +401,9 @@ impl Config {
 			}
 		}
 
+		if self.modified.len() > 0 {
+			note_change(conn, CHANGE_CONFIG)?;
+		}
 		self.modified.clear();
 		
 		Ok(())
@@ -413,29 +427,6 @@ impl Config {
 mod tests {
 	use crate::*;
 	use rusqlite;
-	use std::env;
-	use std::fs;
-	use std::path::PathBuf;
-	use std::str::FromStr;
-
-	// Sets up the path to contain the database for the db-based tests
-	fn setup_test(name: &str) -> PathBuf {
-		if name.len() < 1 {
-			panic!("Invalid name {} in setup_test", name);
-		}
-		let args: Vec<String> = env::args().collect();
-		let test_path = PathBuf::from_str(&args[0]).unwrap();
-		let mut test_path = test_path.parent().unwrap().to_path_buf();
-		test_path.push("testfiles");
-		test_path.push(name);
-
-		if test_path.exists() {
-			fs::remove_dir_all(&test_path).unwrap();
-		}
-		fs::create_dir_all(&test_path).unwrap();
-
-		test_path
-	}
 
 	#[test]
 	fn field_get_set() -> Result<(), MensagoError> {
@@ -614,7 +605,6 @@ mod tests {
 	fn save_db() -> Result<(), MensagoError> {
 
 		let testname = String::from("config_save_db");
-		let test_path = setup_test(&testname);
 
 		let mut c = Config::new("test");
 		c.set("field1", ConfigScope::Global, "", "This is field 1's value")?;
@@ -625,9 +615,7 @@ mod tests {
 				format!("{}: incorrect modification state", testname)))
 		}
 		
-		let mut dbpath = test_path.clone();
-		dbpath.push("test.db");
-		let conn = match rusqlite::Connection::open(&dbpath) {
+		let conn = match rusqlite::Connection::open_in_memory() {
 			Ok(v) => v,
 			Err(e) => {
 				return Err(MensagoError::ErrDatabaseException(String::from(e.to_string())));
@@ -714,11 +702,8 @@ mod tests {
 	fn load_db() -> Result<(), MensagoError> {
 
 		let testname = String::from("config_load_db");
-		let test_path = setup_test(&testname);
 	
-		let mut dbpath = test_path.clone();
-		dbpath.push("test.db");
-		let conn = match rusqlite::Connection::open(&dbpath) {
+		let conn = match rusqlite::Connection::open_in_memory() {
 			Ok(v) => v,
 			Err(e) => {
 				return Err(MensagoError::ErrDatabaseException(String::from(e.to_string())));
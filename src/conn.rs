@@ -1,8 +1,14 @@
+use std::collections::HashMap;
+use std::fmt;
 use std::io::Read;
 use std::net::TcpStream;
+use std::sync::{Arc, Mutex};
 use std::time::Duration;
 use crate::base::*;
 use crate::commands::*;
+use crate::commands::servermsg::setup_session;
+use crate::ratelimit::*;
+use crate::transport::*;
 use lazy_static::lazy_static;
 use serde::{Deserialize, Serialize};
 
@@ -23,14 +29,83 @@ struct GreetingData {
 	date: String,
 }
 
-#[derive(Debug)]
+/// ResumeTicket holds what is needed to resume a session with a server: the single-use token the
+/// server issued and the session features which were in effect.
+#[derive(Debug, Clone, PartialEq)]
+pub struct ResumeTicket {
+	pub token: String,
+	pub features: Vec<String>,
+}
+
+/// ResumeCache keeps a ResumeTicket for each server so that reconnecting doesn't require logging
+/// in again. Servers are identified by the address and port used to connect.
+#[derive(Debug, Default)]
+pub struct ResumeCache {
+	tickets: Mutex<HashMap<String, ResumeTicket>>,
+}
+
+impl ResumeCache {
+
+	/// Creates a new, empty ResumeCache
+	pub fn new() -> ResumeCache {
+		ResumeCache::default()
+	}
+
+	/// Returns the ticket for a server, if there is one
+	pub fn get(&self, address: &str, port: &str) -> Option<ResumeTicket> {
+		match self.tickets.lock() {
+			Ok(v) => v.get(&ResumeCache::key(address, port)).cloned(),
+			Err(_) => None,
+		}
+	}
+
+	/// Saves the ticket for a server, replacing any existing one
+	pub fn set(&self, address: &str, port: &str, ticket: ResumeTicket) {
+		if let Ok(mut v) = self.tickets.lock() {
+			v.insert(ResumeCache::key(address, port), ticket);
+		}
+	}
+
+	/// Removes the ticket for a server, such as when logging out
+	pub fn remove(&self, address: &str, port: &str) {
+		if let Ok(mut v) = self.tickets.lock() {
+			v.remove(&ResumeCache::key(address, port));
+		}
+	}
+
+	fn key(address: &str, port: &str) -> String {
+		format!("{}:{}", address, port)
+	}
+}
+
 pub struct ServerConnection {
-	socket: Option<TcpStream>,
+	socket: Option<Box<dyn Transport>>,
 	buffer: [u8; BUFFER_SIZE],
+	features: Vec<String>,
+}
+
+// The transport is left out because it can't be formatted, and the read buffer because it is
+// only scratch space
+impl fmt::Debug for ServerConnection {
+	fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+		f.debug_struct("ServerConnection")
+			.field("connected", &self.socket.is_some())
+			.field("features", &self.features)
+			.finish()
+	}
 }
 
 impl ServerConnection {
 
+	/// Creates a new, unconnected ServerConnection
+	pub fn new() -> ServerConnection {
+		ServerConnection {
+			socket: None,
+			buffer: [0; BUFFER_SIZE],
+			features: Vec::new(),
+		}
+	}
+
 	/// Connects to a Mensago server given the specified address and port
 	pub fn connect(&mut self, address: &str, port: &str) -> Result<(), MensagoError> {
 
@@ -38,18 +113,27 @@ impl ServerConnection {
 			return Err(MensagoError::ErrBadValue)
 		}
 
-		let mut sock =TcpStream::connect(format!("{}:{}", address, port))?;
+		let sock = TcpStream::connect(format!("{}:{}", address, port))?;
+		self.connect_transport(Box::new(sock))
+	}
+
+	/// Connects to a Mensago server, or a proxy for one, listening on a Unix domain socket
+	#[cfg(unix)]
+	pub fn connect_unix(&mut self, path: &std::path::Path) -> Result<(), MensagoError> {
+		let sock = std::os::unix::net::UnixStream::connect(path)?;
+		self.connect_transport(Box::new(sock))
+	}
+
+	/// Starts a session with a server over an already-established transport, such as one end of an
+	/// in-process pipe
+	pub fn connect_transport(&mut self, mut sock: Box<dyn Transport>) -> Result<(), MensagoError> {
 
 		sock.set_read_timeout(Some(*CONN_TIMEOUT))?;
 
 		// absorb the hello string for now
-		sock.read(&mut self.buffer)?;
+		let bytes_read = sock.read(&mut self.buffer)?;
 
-		let rawjson = match String::from_utf8(self.buffer.to_vec()) {
-			Ok(v) => v,
-			Err(_) => { return Err(MensagoError::ErrBadMessage) }
-		};
-		let greeting: GreetingData = match serde_json::from_str(&rawjson) {
+		let greeting: GreetingData = match serde_json::from_slice(&self.buffer[..bytes_read]) {
 			Ok(v) => v,
 			Err(_) => { return Err(MensagoError::ErrBadMessage) }
 		};
@@ -63,22 +147,258 @@ impl ServerConnection {
 		}
 
 		self.socket = Some(sock);
+		self.features.clear();
+
+		Ok(())
+	}
+
+	/// Negotiates optional wire protocol features, such as transfer cancellation, with the server.
+	/// This must be done right after connecting and before any commands are sent.
+	pub fn setup_session(&mut self, features: &[&str]) -> Result<(), MensagoError> {
+		let sock = self.get_socket()?;
+		self.features = setup_session(sock, features)?;
+		Ok(())
+	}
 
+	/// Gets a resumption token for the current session from the server and saves it in the cache
+	/// along with the session's features. This should be called after logging in.
+	pub fn save_session(&mut self, address: &str, port: &str, cache: &ResumeCache)
+	-> Result<(), MensagoError> {
+		let token = getresumetoken(self.get_socket()?)?;
+		cache.set(address, port, ResumeTicket { token, features: self.features.clone() });
 		Ok(())
 	}
 
+	/// Connects to a server and, if the cache has a ticket for it, resumes the previous session
+	/// instead of requiring session setup and login. Returns true if the session was resumed. If
+	/// the server rejects the ticket, it is removed from the cache, false is returned, and the
+	/// connection is ready for a normal login.
+	pub fn connect_resume(&mut self, address: &str, port: &str, cache: &ResumeCache)
+	-> Result<bool, MensagoError> {
+
+		self.connect(address, port)?;
+
+		let ticket = match cache.get(address, port) {
+			Some(v) => v,
+			None => return Ok(false),
+		};
+
+		match resume(self.get_socket()?, &ticket.token, &ticket.features) {
+			Ok((token, features)) => {
+				self.features = features.clone();
+				cache.set(address, port, ResumeTicket { token, features });
+				Ok(true)
+			},
+			Err(MensagoError::ErrProtocol(_)) => {
+				cache.remove(address, port);
+				Ok(false)
+			},
+			Err(e) => {
+				cache.remove(address, port);
+				Err(e)
+			},
+		}
+	}
+
+	/// Limits the rate data is sent on the connection using the specified limiter, charging it as
+	/// the specified class of traffic. This should be called only once per connection.
+	pub fn set_rate_limit(&mut self, limiter: &Arc<RateLimiter>, class: TrafficClass)
+	-> Result<(), MensagoError> {
+		match self.socket.take() {
+			Some(v) => {
+				self.socket = Some(Box::new(limiter.shape(v, class)));
+				Ok(())
+			},
+			None => Err(MensagoError::ErrNotConnected),
+		}
+	}
+
+	/// Returns true if the specified feature was agreed to during session setup
+	pub fn has_feature(&self, feature: &str) -> bool {
+		self.features.iter().any(|f| f == feature)
+	}
+
 	/// Returns true if connected to a server
 	#[inline]
 	pub fn is_connected(&self) -> bool {
 		self.socket.is_some()
 	}
 
+	/// Returns the underlying transport for use with the command functions
+	pub fn get_socket(&mut self) -> Result<&mut dyn Transport, MensagoError> {
+		match self.socket.as_deref_mut() {
+			Some(v) => Ok(v),
+			None => Err(MensagoError::ErrNotConnected),
+		}
+	}
+
+	/// Checks that the server is still responding by sending a NOOP command, waiting no longer than
+	/// the specified time for a reply. A connection which fails the check should be discarded.
+	pub fn ping(&mut self, timeout: Duration) -> Result<(), MensagoError> {
+		let sock = self.get_socket()?;
+		let oldtimeout = sock.get_read_timeout()?;
+		sock.set_read_timeout(Some(timeout))?;
+		noop(sock)?;
+		sock.set_read_timeout(oldtimeout)?;
+		Ok(())
+	}
+
 	/// Disconnects from the server by sending a QUIT command to the server and then closing the 
-	/// TCP session
+	/// connection
 	pub fn disconnect(&mut self) -> Result<(), MensagoError> {
-		match self.socket {
-			Some(_) => { quit(self.socket.as_mut().unwrap()) },
+		match self.socket.take() {
+			Some(mut v) => {
+				self.features.clear();
+				quit(&mut *v)
+			},
 			None => Ok(()),
 		}
 	}
 }
+
+#[cfg(test)]
+mod tests {
+	use crate::*;
+	use crate::commands::servermsg::*;
+	use crate::commands::testserver::*;
+	use std::collections::HashSet;
+	use std::sync::{Arc, Mutex};
+	use std::time::{Duration, Instant};
+
+	// Starts a server which understands just enough of login and session resumption for the tests.
+	// Each reply is delayed to stand in for network latency.
+	fn start_server(latency: Duration) -> TestServer {
+		let tokens = Arc::new(Mutex::new(HashSet::<String>::new()));
+		let counter = Arc::new(Mutex::new(0u64));
+		TestServer::start(move |req, conn| {
+			std::thread::sleep(latency);
+			match req.action.as_str() {
+				"LOGIN" | "PASSWORD" => {
+					TestServer::send(conn, &TestServer::response(100, "CONTINUE", &[]))?;
+				},
+				"DEVICE" => {
+					TestServer::send(conn, &TestServer::response(200, "OK", &[]))?;
+				},
+				"GETRESUMETOKEN" | "RESUME" => {
+					if req.action == "RESUME" {
+						let token = req.data.get("Token").unwrap();
+						if !tokens.lock().unwrap().remove(token) {
+							TestServer::send(conn,
+								&TestServer::response(401, "UNAUTHORIZED", &[]))?;
+							return Ok(true)
+						}
+					}
+					let mut counter = counter.lock().unwrap();
+					*counter += 1;
+					let token = format!("token{}", counter);
+					tokens.lock().unwrap().insert(token.clone());
+					let features = match req.data.get("Features") {
+						Some(v) => v.clone(),
+						None => String::new(),
+					};
+					TestServer::send(conn, &TestServer::response(200, "OK",
+						&[("Token", &token), ("Features", &features)]))?;
+				},
+				_ => return Ok(false),
+			}
+			Ok(true)
+		})
+	}
+
+	// Stands in for the login process, which takes three round trips
+	fn login(conn: &mut dyn Transport) -> Result<(), MensagoError> {
+		for action in ["LOGIN", "PASSWORD", "DEVICE"] {
+			ClientRequest::new(action).send(conn)?;
+			let resp = ServerResponse::receive(conn)?;
+			if resp.status.code != 100 && resp.status.code != 200 {
+				return Err(MensagoError::ErrProtocol(resp.status))
+			}
+		}
+		Ok(())
+	}
+
+	#[test]
+	fn test_connect_resume() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_connect_resume");
+
+		let server = start_server(Duration::from_millis(0));
+		let cache = ResumeCache::new();
+
+		// No ticket yet, so a full login is needed
+		let mut conn = ServerConnection::new();
+		if conn.connect_resume(&server.address, &server.port, &cache)? {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: resumed without a ticket", testname)))
+		}
+		conn.setup_session(&[SESSION_FEATURE_CANCEL])?;
+		login(conn.get_socket()?)?;
+		conn.save_session(&server.address, &server.port, &cache)?;
+		conn.disconnect()?;
+
+		let ticket = cache.get(&server.address, &server.port).unwrap();
+
+		let mut conn = ServerConnection::new();
+		if !conn.connect_resume(&server.address, &server.port, &cache)? {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: failed to resume session", testname)))
+		}
+		if !conn.has_feature(SESSION_FEATURE_CANCEL) {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: session features not restored", testname)))
+		}
+		if cache.get(&server.address, &server.port).unwrap() == ticket {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: resumption token not replaced", testname)))
+		}
+		conn.disconnect()?;
+
+		// A used token must be rejected and dropped from the cache
+		cache.set(&server.address, &server.port, ticket);
+		let mut conn = ServerConnection::new();
+		if conn.connect_resume(&server.address, &server.port, &cache)? {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: resumed with a used token", testname)))
+		}
+		if cache.get(&server.address, &server.port).is_some() {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: rejected ticket left in cache", testname)))
+		}
+		conn.disconnect()?;
+
+		Ok(())
+	}
+
+	// Compares reconnecting with a full session setup and login against resuming the session. Run
+	// with `cargo test --release bench_reconnect -- --ignored --nocapture`.
+	#[test]
+	#[ignore]
+	fn bench_reconnect() -> Result<(), MensagoError> {
+
+		let server = start_server(Duration::from_millis(5));
+		let cache = ResumeCache::new();
+		let rounds = 50;
+
+		let start = Instant::now();
+		for _ in 0..rounds {
+			let mut conn = ServerConnection::new();
+			conn.connect(&server.address, &server.port)?;
+			conn.setup_session(&[SESSION_FEATURE_CANCEL])?;
+			login(conn.get_socket()?)?;
+			conn.save_session(&server.address, &server.port, &cache)?;
+			conn.disconnect()?;
+		}
+		let full = start.elapsed();
+
+		let start = Instant::now();
+		for _ in 0..rounds {
+			let mut conn = ServerConnection::new();
+			assert!(conn.connect_resume(&server.address, &server.port, &cache)?);
+			conn.disconnect()?;
+		}
+		let resumed = start.elapsed();
+
+		println!("full reconnect: {:?} avg, resumed: {:?} avg", full / rounds, resumed / rounds);
+		Ok(())
+	}
+}
@@ -0,0 +1,313 @@
+//! The dispatch module allows many threads to send commands over a single server connection at the
+//! same time. Each request is tagged with an ID which the server copies into its response, and a
+//! reader thread hands each response to the caller waiting for it, in whatever order they arrive.
+
+use std::collections::HashMap;
+use std::sync::{Arc, Mutex, MutexGuard};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::mpsc::{channel, RecvTimeoutError, Sender};
+use std::thread;
+use std::time::Duration;
+use crate::base::*;
+use crate::commands::*;
+use crate::commands::servermsg::*;
+use crate::conn::*;
+use crate::transport::*;
+
+/// The default time a caller waits for the response to a request sent over a SharedConnection
+pub const SHARED_RESPONSE_TIMEOUT: Duration = Duration::from_secs(60);
+
+struct Waiters {
+	senders: HashMap<u64, Sender<ServerResponse>>,
+	closed: bool,
+}
+
+struct Shared {
+	conn: Mutex<ServerConnection>,
+	waiters: Arc<Mutex<Waiters>>,
+	next_id: AtomicU64,
+	timeout: Mutex<Duration>,
+	reader_socket: Mutex<Box<dyn Transport>>,
+	reader: Mutex<Option<thread::JoinHandle<()>>>,
+}
+
+impl Drop for Shared {
+	fn drop(&mut self) {
+		let _ = lock(&self.reader_socket).shutdown_transport();
+		if let Ok(mut guard) = self.reader.lock() {
+			if let Some(handle) = guard.take() {
+				let _ = handle.join();
+			}
+		}
+	}
+}
+
+/// SharedConnection is a handle to a server connection which can be used by several threads at
+/// once. Cloning it is cheap and every clone uses the same connection, so each thread should have
+/// its own clone. It works with the commands which consist of a single request and response, such
+/// as `getwid()` and `noop()`.
+#[derive(Clone)]
+pub struct SharedConnection {
+	shared: Arc<Shared>,
+}
+
+impl SharedConnection {
+
+	/// Takes over a connection for shared use. The request ID feature must have been negotiated
+	/// with `ServerConnection::setup_session()`, or ErrBadSession is returned.
+	pub fn new(mut conn: ServerConnection) -> Result<SharedConnection, MensagoError> {
+
+		if !conn.has_feature(SESSION_FEATURE_REQUEST_ID) {
+			return Err(MensagoError::ErrBadSession)
+		}
+
+		let mut socket = conn.get_socket()?.try_clone_transport()?;
+		let reader_socket = socket.try_clone_transport()?;
+
+		// A shared connection can sit idle for a long time, which mustn't be mistaken for a
+		// failure. The reader is stopped by shutting the socket down instead. Callers have their
+		// own timeout in `exchange()`.
+		socket.set_read_timeout(None)?;
+		let waiters = Arc::new(Mutex::new(Waiters {
+			senders: HashMap::new(),
+			closed: false,
+		}));
+
+		let reader_waiters = waiters.clone();
+		let reader = thread::spawn(move || {
+			// A response without an ID is an error the server sent before it could read the
+			// request's ID, so it goes to the caller which has been waiting longest. Responses
+			// with an ID nobody is waiting for are thrown away. Once the connection fails, every
+			// waiting caller is woken by dropping its sender.
+			let mut buffer = Vec::<u8>::new();
+			while let Ok(resp) = ServerResponse::receive_with_buffer(&mut *socket, &mut buffer) {
+				let sender = {
+					let mut waiters = lock(&reader_waiters);
+					let id = match resp.id {
+						Some(v) => Some(v),
+						None => waiters.senders.keys().min().copied(),
+					};
+					id.and_then(|v| waiters.senders.remove(&v))
+				};
+				if let Some(v) = sender {
+					let _ = v.send(resp);
+				}
+			}
+
+			let mut waiters = lock(&reader_waiters);
+			waiters.closed = true;
+			waiters.senders.clear();
+		});
+
+		Ok(SharedConnection {
+			shared: Arc::new(Shared {
+				conn: Mutex::new(conn),
+				waiters,
+				next_id: AtomicU64::new(1),
+				timeout: Mutex::new(SHARED_RESPONSE_TIMEOUT),
+				reader_socket: Mutex::new(reader_socket),
+				reader: Mutex::new(Some(reader)),
+			}),
+		})
+	}
+
+	/// Sets how long a caller waits for a response before giving up with a TimedOut error. This
+	/// applies to every clone of the connection.
+	pub fn set_timeout(&self, timeout: Duration) {
+		*lock(&self.shared.timeout) = timeout;
+	}
+
+	/// Returns the number of requests which are waiting for a response
+	pub fn count_pending(&self) -> usize {
+		lock(&self.shared.waiters).senders.len()
+	}
+
+	/// Closes the connection. Requests still waiting for a response fail with ErrNotConnected.
+	pub fn disconnect(&self) -> Result<(), MensagoError> {
+		let result = lock(&self.shared.conn).disconnect();
+		let _ = lock(&self.shared.reader_socket).shutdown_transport();
+		result
+	}
+}
+
+impl Exchange for SharedConnection {
+
+	fn exchange(&mut self, req: &ClientRequest) -> Result<ServerResponse, MensagoError> {
+
+		let id = self.shared.next_id.fetch_add(1, Ordering::Relaxed);
+		let (sender, receiver) = channel::<ServerResponse>();
+		{
+			let mut waiters = lock(&self.shared.waiters);
+			if waiters.closed {
+				return Err(MensagoError::ErrNotConnected)
+			}
+			waiters.senders.insert(id, sender);
+		}
+
+		// The lock is held only for the time it takes to write the request, so a slow command
+		// doesn't hold up anyone else
+		let mut tagged = req.clone();
+		tagged.id = Some(id);
+		let sent = match lock(&self.shared.conn).get_socket() {
+			Ok(sock) => tagged.send(sock),
+			Err(e) => Err(e),
+		};
+		if let Err(e) = sent {
+			lock(&self.shared.waiters).senders.remove(&id);
+			return Err(e)
+		}
+
+		let timeout = *lock(&self.shared.timeout);
+		match receiver.recv_timeout(timeout) {
+			Ok(v) => Ok(v),
+			Err(RecvTimeoutError::Timeout) => {
+				lock(&self.shared.waiters).senders.remove(&id);
+				Err(MensagoError::IOError(std::io::Error::from(std::io::ErrorKind::TimedOut)))
+			},
+			Err(RecvTimeoutError::Disconnected) => Err(MensagoError::ErrNotConnected),
+		}
+	}
+}
+
+fn lock<T>(mutex: &Mutex<T>) -> MutexGuard<'_, T> {
+	match mutex.lock() {
+		Ok(v) => v,
+		Err(e) => e.into_inner(),
+	}
+}
+
+#[cfg(test)]
+mod tests {
+	use crate::*;
+	use crate::commands::servermsg::*;
+	use crate::commands::testserver::*;
+	use std::sync::{Arc, Mutex};
+	use std::time::{Duration, Instant};
+
+	#[test]
+	fn test_shared_connection() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_shared_connection");
+
+		// The server answers each request on its own thread after a delay given in the request,
+		// so responses go out in a different order than the requests came in
+		let writelock = Arc::new(Mutex::new(()));
+		let server = TestServer::start(move |req, conn| {
+			if req.action != "NOOP" {
+				return Ok(false)
+			}
+			let delay = req.data.get("Delay").unwrap().parse::<u64>().unwrap();
+			let mut resp = TestServer::response(200, "OK", &[("Delay", &delay.to_string())]);
+			resp.id = req.id;
+
+			let mut conn = conn.try_clone_transport()?;
+			let writelock = writelock.clone();
+			std::thread::spawn(move || {
+				std::thread::sleep(Duration::from_millis(delay));
+				let _guard = writelock.lock().unwrap();
+				let _ = TestServer::send(&mut *conn, &resp);
+			});
+			Ok(true)
+		});
+
+		let mut conn = ServerConnection::new();
+		conn.connect(&server.address, &server.port)?;
+		conn.setup_session(&[SESSION_FEATURE_REQUEST_ID])?;
+		let shared = SharedConnection::new(conn)?;
+
+		let start = Instant::now();
+		let finished = Arc::new(Mutex::new(Vec::<u64>::new()));
+		let handles: Vec<_> = [400u64, 50, 200].iter()
+			.map(|delay| {
+				let mut conn = shared.clone();
+				let finished = finished.clone();
+				let delay = *delay;
+				std::thread::spawn(move || -> Result<(), MensagoError> {
+					let req = ClientRequest::from("NOOP", &[("Delay", &delay.to_string())]);
+					let resp = conn.exchange(&req)?;
+					if resp.data.get("Delay").unwrap() != &delay.to_string() {
+						return Err(MensagoError::ErrBadMessage)
+					}
+					finished.lock().unwrap().push(delay);
+					Ok(())
+				})
+			})
+			.collect();
+
+		for handle in handles {
+			if let Err(e) = handle.join().unwrap() {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: request got wrong response: {}", testname, e.to_string())))
+			}
+		}
+
+		// Requests were answered as soon as their responses arrived, not in the order sent
+		if *finished.lock().unwrap() != vec![50, 200, 400] {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: wrong completion order {:?}", testname, finished.lock().unwrap())))
+		}
+		if start.elapsed() > Duration::from_millis(600) {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: requests were not concurrent", testname)))
+		}
+
+		shared.disconnect()?;
+		let mut conn = shared.clone();
+		match noop(&mut conn) {
+			Err(MensagoError::ErrNotConnected) => (),
+			other => {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: request after disconnect returned {:?}", testname, other)))
+			}
+		}
+
+		Ok(())
+	}
+
+	#[test]
+	fn test_shared_connection_errors() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_shared_connection_errors");
+
+		// The server never answers SILENT, and answers FAIL with an error which has no ID
+		let server = TestServer::start(|req, conn| {
+			match req.action.as_str() {
+				"SILENT" => Ok(true),
+				"FAIL" => {
+					TestServer::send(conn, &TestServer::response(400, "BAD REQUEST", &[]))?;
+					Ok(true)
+				},
+				_ => Ok(false),
+			}
+		});
+
+		let mut conn = ServerConnection::new();
+		conn.connect(&server.address, &server.port)?;
+		conn.setup_session(&[SESSION_FEATURE_REQUEST_ID])?;
+		let shared = SharedConnection::new(conn)?;
+		shared.set_timeout(Duration::from_millis(200));
+
+		let mut conn = shared.clone();
+		match conn.exchange(&ClientRequest::new("SILENT")) {
+			Err(MensagoError::IOError(e)) if e.kind() == std::io::ErrorKind::TimedOut => (),
+			other => {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: unanswered request returned {:?}", testname, other)))
+			}
+		}
+		if shared.count_pending() != 0 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: timed out request still pending", testname)))
+		}
+
+		match conn.exchange(&ClientRequest::new("FAIL")) {
+			Ok(v) if v.status.code == 400 => (),
+			other => {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: error without ID returned {:?}", testname, other)))
+			}
+		}
+
+		Ok(())
+	}
+}
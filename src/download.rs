@@ -0,0 +1,505 @@
+//! The download module spreads queued file downloads across several pooled server connections.
+//! Items are ordered by priority so that interactive requests, such as the attachment the user
+//! just clicked on, jump ahead of background work, and smaller items go ahead of larger ones of
+//! the same priority so a single huge file doesn't hold up everything behind it.
+
+use std::cmp::Ordering;
+use std::collections::{BinaryHeap, HashMap, HashSet};
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, Condvar, Mutex, MutexGuard};
+use std::thread;
+use crate::base::*;
+use crate::commands::*;
+use crate::pool::*;
+use crate::profile::check_file_name;
+
+/// DownloadPriority determines the order in which queued items are downloaded
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
+pub enum DownloadPriority {
+	Background,
+	Normal,
+	Interactive,
+}
+
+/// A file to be downloaded. `size` is the expected size of the file, if known, and is only used
+/// for scheduling.
+#[derive(Debug, Clone, PartialEq)]
+pub struct DownloadItem {
+	pub host: String,
+	pub server_path: String,
+	pub size: u64,
+	pub priority: DownloadPriority,
+}
+
+/// The outcome of a download. On success, `result` contains the path to the file in the blob
+/// store.
+#[derive(Debug)]
+pub struct DownloadResult {
+	pub id: u64,
+	pub item: DownloadItem,
+	pub result: Result<PathBuf, MensagoError>,
+}
+
+#[derive(Debug)]
+struct QueuedDownload {
+	id: u64,
+	item: DownloadItem,
+}
+
+// Items compare as greater when they should be downloaded sooner, which is what BinaryHeap needs
+impl Ord for QueuedDownload {
+	fn cmp(&self, other: &Self) -> Ordering {
+		self.item.priority.cmp(&other.item.priority)
+			.then_with(|| other.item.size.cmp(&self.item.size))
+			.then_with(|| other.id.cmp(&self.id))
+	}
+}
+
+impl PartialOrd for QueuedDownload {
+	fn partial_cmp(&self, other: &Self) -> Option<Ordering> {
+		Some(self.cmp(other))
+	}
+}
+
+impl PartialEq for QueuedDownload {
+	fn eq(&self, other: &Self) -> bool {
+		self.id == other.id
+	}
+}
+
+impl Eq for QueuedDownload {}
+
+struct QueueState {
+	queues: HashMap<String, BinaryHeap<QueuedDownload>>,
+	active: HashMap<String, usize>,
+	limits: HashMap<String, usize>,
+	results: Vec<DownloadResult>,
+	pending: HashSet<u64>,
+	next_id: u64,
+	stopped: bool,
+}
+
+impl QueueState {
+
+	// Removes the most urgent item from the hosts which have capacity for another transfer
+	fn pop_next(&mut self, default_limit: usize) -> Option<QueuedDownload> {
+
+		let mut best: Option<&str> = None;
+		for (host, queue) in self.queues.iter() {
+			let limit = *self.limits.get(host).unwrap_or(&default_limit);
+			if *self.active.get(host).unwrap_or(&0) >= limit {
+				continue
+			}
+			let head = match queue.peek() {
+				Some(v) => v,
+				None => continue,
+			};
+			let better = match best {
+				Some(b) => head > self.queues.get(b).unwrap().peek().unwrap(),
+				None => true,
+			};
+			if better {
+				best = Some(host);
+			}
+		}
+
+		let host = String::from(best?);
+		let item = self.queues.get_mut(&host).unwrap().pop();
+		*self.active.entry(host).or_insert(0) += 1;
+		item
+	}
+
+	fn queued(&self) -> usize {
+		self.queues.values().map(|q| q.len()).sum()
+	}
+}
+
+/// DownloadManager downloads queued files over a pool of connections and writes them directly
+/// into the blob store directory.
+pub struct DownloadManager {
+	pool: Arc<ConnectionPool>,
+	blobdir: PathBuf,
+	workers: usize,
+	state: Mutex<QueueState>,
+	changed: Condvar,
+}
+
+impl DownloadManager {
+
+	/// Creates a new DownloadManager which saves files into the specified directory, such as the
+	/// profile's `files/attachments` folder. Each host's files are kept in a subdirectory named
+	/// after the host so that files with the same name on different servers don't collide.
+	pub fn new(pool: Arc<ConnectionPool>, blobdir: &Path) -> DownloadManager {
+		let workers = pool.get_max_per_host() * 2;
+		DownloadManager {
+			pool,
+			blobdir: PathBuf::from(blobdir),
+			workers,
+			state: Mutex::new(QueueState {
+				queues: HashMap::new(),
+				active: HashMap::new(),
+				limits: HashMap::new(),
+				results: Vec::new(),
+				pending: HashSet::new(),
+				next_id: 1,
+				stopped: false,
+			}),
+			changed: Condvar::new(),
+		}
+	}
+
+	/// Sets the number of worker threads, which is the maximum number of concurrent downloads
+	/// across all hosts
+	pub fn set_workers(&mut self, workers: usize) {
+		self.workers = workers.max(1);
+	}
+
+	/// Sets the maximum number of concurrent downloads from a particular host. The limit can't be
+	/// higher than the connection pool's own per-host limit.
+	pub fn set_host_limit(&self, host: &str, limit: usize) {
+		let mut state = self.lock_state();
+		state.limits.insert(String::from(host), limit.max(1).min(self.pool.get_max_per_host()));
+		self.changed.notify_all();
+	}
+
+	/// Adds an item to the download queue and returns its ID
+	pub fn enqueue(&self, item: DownloadItem) -> u64 {
+		let mut state = self.lock_state();
+		let id = state.next_id;
+		state.next_id += 1;
+		state.pending.insert(id);
+		state.queues.entry(item.host.clone()).or_insert(BinaryHeap::new())
+			.push(QueuedDownload { id, item });
+		self.changed.notify_one();
+		id
+	}
+
+	/// Returns the number of items waiting to be downloaded
+	pub fn count_queued(&self) -> usize {
+		self.lock_state().queued()
+	}
+
+	/// Returns true if the item with the specified ID is still queued or being downloaded
+	pub fn is_pending(&self, id: u64) -> bool {
+		self.lock_state().pending.contains(&id)
+	}
+
+	/// Downloads everything in the queue on the calling thread and a set of worker threads,
+	/// returning once the queue is empty. Results for all downloads finished since the last call
+	/// to `take_results()` are returned.
+	pub fn run(&self) -> Vec<DownloadResult> {
+		thread::scope(|s| {
+			for _ in 1..self.workers {
+				s.spawn(|| self.worker(true));
+			}
+			self.worker(true);
+		});
+		self.take_results()
+	}
+
+	/// Starts worker threads which process the queue in the background until `stop()` is called
+	pub fn start(self: &Arc<Self>) -> Vec<thread::JoinHandle<()>> {
+		self.lock_state().stopped = false;
+		(0..self.workers)
+			.map(|_| {
+				let manager = self.clone();
+				thread::spawn(move || manager.worker(false))
+			})
+			.collect()
+	}
+
+	/// Tells background workers to exit once their current download is finished
+	pub fn stop(&self) {
+		self.lock_state().stopped = true;
+		self.changed.notify_all();
+	}
+
+	/// Returns the results of all downloads which have finished since the last call
+	pub fn take_results(&self) -> Vec<DownloadResult> {
+		std::mem::take(&mut self.lock_state().results)
+	}
+
+	// Worker loop. When `until_idle` is set, the worker exits once the queue is empty. Otherwise it
+	// waits for more work until the manager is stopped.
+	fn worker(&self, until_idle: bool) {
+
+		loop {
+			let queued = {
+				let mut state = self.lock_state();
+				loop {
+					if state.stopped {
+						return
+					}
+					if let Some(v) = state.pop_next(self.pool.get_max_per_host()) {
+						break v
+					}
+					if until_idle && state.queued() == 0 {
+						return
+					}
+					state = match self.changed.wait(state) {
+						Ok(v) => v,
+						Err(e) => e.into_inner(),
+					};
+				}
+			};
+
+			let result = self.fetch(&queued.item);
+
+			let mut state = self.lock_state();
+			if let Some(v) = state.active.get_mut(&queued.item.host) {
+				*v -= 1;
+			}
+			state.pending.remove(&queued.id);
+			state.results.push(DownloadResult { id: queued.id, item: queued.item, result });
+			self.changed.notify_all();
+		}
+	}
+
+	// Downloads a single item. Because downloads resume from their journal, a transfer which fails
+	// because of a broken connection is retried once on a fresh connection.
+	fn fetch(&self, item: &DownloadItem) -> Result<PathBuf, MensagoError> {
+
+		// Both names come from outside the library, so they are checked to keep them from
+		// pointing outside the host's directory
+		let filename = match item.server_path.split(' ').last() {
+			Some(v) => v,
+			None => { return Err(MensagoError::ErrBadValue) }
+		};
+		check_file_name(&item.host)?;
+		check_file_name(filename)?;
+
+		let mut hostdir = self.blobdir.clone();
+		hostdir.push(&item.host);
+		let mut localpath = hostdir.clone();
+		localpath.push(filename);
+		let mut journalpath = hostdir.clone();
+		journalpath.push(format!("{}.journal", filename));
+
+		let mut attempts = 0;
+		loop {
+			attempts += 1;
+			let mut conn = self.pool.get(&item.host)?;
+			fs::create_dir_all(&hostdir)?;
+			let result = match conn.get_socket() {
+				Ok(sock) => download(sock, &item.server_path, &localpath, &journalpath),
+				Err(e) => Err(e),
+			};
+
+			match result {
+				Ok(_) => return Ok(localpath),
+				Err(MensagoError::ErrProtocol(e)) => {
+					// The server can refuse partway through a transfer, leaving unread data on
+					// the connection, so it isn't safe to hand back to the pool
+					conn.discard();
+					return Err(MensagoError::ErrProtocol(e))
+				},
+				Err(e) => {
+					conn.discard();
+					if attempts >= 2 {
+						return Err(e)
+					}
+				},
+			}
+		}
+	}
+
+	fn lock_state(&self) -> MutexGuard<'_, QueueState> {
+		match self.state.lock() {
+			Ok(v) => v,
+			Err(e) => e.into_inner(),
+		}
+	}
+}
+
+#[cfg(test)]
+mod tests {
+	use crate::*;
+	use crate::commands::servermsg::*;
+	use crate::commands::testserver::*;
+	use crate::testutil::*;
+	use std::fs;
+	use std::path::PathBuf;
+	use std::sync::Arc;
+	use std::sync::atomic::{AtomicUsize, Ordering};
+
+	// The stand-in server serves files whose contents are generated from their names and tracks
+	// the highest number of downloads in progress at the same time.
+	fn start_server(current: Arc<AtomicUsize>, peak: Arc<AtomicUsize>) -> TestServer {
+		TestServer::start(move |req, conn| {
+			if req.action != "DOWNLOAD" {
+				return Ok(false)
+			}
+			let path = req.data.get("Path").unwrap();
+			let data = path.repeat(1000).into_bytes();
+
+			let now = current.fetch_add(1, Ordering::SeqCst) + 1;
+			peak.fetch_max(now, Ordering::SeqCst);
+			std::thread::sleep(std::time::Duration::from_millis(50));
+
+			TestServer::send(conn, &TestServer::response(100, "CONTINUE",
+				&[("Size", &data.len().to_string())]))?;
+			let hash = eznacl::get_hash("BLAKE2B-256", &data)?.to_string();
+			TestServer::send(conn, &TestServer::response(100, "CONTINUE",
+				&[("Offset", "0"), ("Hash", &hash)]))?;
+			write_message(conn, &data)?;
+
+			current.fetch_sub(1, Ordering::SeqCst);
+			Ok(true)
+		})
+	}
+
+	fn make_pool(server: &TestServer, max_per_host: usize) -> Arc<ConnectionPool> {
+		let address = server.address.clone();
+		let port = server.port.clone();
+		Arc::new(ConnectionPool::new(move |_host| {
+			let mut conn = ServerConnection::new();
+			conn.connect(&address, &port)?;
+			Ok(conn)
+		}, max_per_host))
+	}
+
+	#[test]
+	fn test_download_priority() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_download_priority");
+		let test_path = setup_test(&testname);
+
+		let server = start_server(Arc::new(AtomicUsize::new(0)), Arc::new(AtomicUsize::new(0)));
+		let mut manager = DownloadManager::new(make_pool(&server, 1), &test_path);
+		manager.set_workers(1);
+
+		let big = manager.enqueue(DownloadItem {
+			host: String::from("host1"),
+			server_path: String::from("/ wsp big"),
+			size: 100000,
+			priority: DownloadPriority::Normal,
+		});
+		let small = manager.enqueue(DownloadItem {
+			host: String::from("host1"),
+			server_path: String::from("/ wsp small"),
+			size: 100,
+			priority: DownloadPriority::Normal,
+		});
+		let background = manager.enqueue(DownloadItem {
+			host: String::from("host1"),
+			server_path: String::from("/ wsp background"),
+			size: 1,
+			priority: DownloadPriority::Background,
+		});
+		let interactive = manager.enqueue(DownloadItem {
+			host: String::from("host1"),
+			server_path: String::from("/ wsp interactive"),
+			size: 1000000,
+			priority: DownloadPriority::Interactive,
+		});
+
+		let results = manager.run();
+		let order: Vec<u64> = results.iter().map(|r| r.id).collect();
+		if order != vec![interactive, small, big, background] {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: wrong download order {:?}", testname, order)))
+		}
+
+		for r in results {
+			let path = match r.result {
+				Ok(v) => v,
+				Err(e) => {
+					return Err(MensagoError::ErrProgramException(
+						format!("{}: error downloading {}: {}", testname, r.item.server_path,
+							e.to_string())))
+				}
+			};
+			if fs::read(&path)? != r.item.server_path.repeat(1000).into_bytes() {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: data mismatch for {}", testname, r.item.server_path)))
+			}
+		}
+
+		Ok(())
+	}
+
+	#[test]
+	fn test_download_host_limit() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_download_host_limit");
+		let test_path = setup_test(&testname);
+
+		let current = Arc::new(AtomicUsize::new(0));
+		let peak = Arc::new(AtomicUsize::new(0));
+		let server = start_server(current.clone(), peak.clone());
+
+		let mut manager = DownloadManager::new(make_pool(&server, 4), &test_path);
+		manager.set_workers(8);
+		manager.set_host_limit("host1", 2);
+
+		for i in 0..10 {
+			manager.enqueue(DownloadItem {
+				host: String::from("host1"),
+				server_path: format!("/ wsp file{}", i),
+				size: 1000,
+				priority: DownloadPriority::Normal,
+			});
+		}
+
+		let results = manager.run();
+		if results.len() != 10 || results.iter().any(|r| r.result.is_err()) {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: downloads failed: {:?}", testname, results)))
+		}
+
+		if peak.load(Ordering::SeqCst) != 2 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: host limit not respected: peak of {} concurrent downloads",
+					testname, peak.load(Ordering::SeqCst))))
+		}
+
+		Ok(())
+	}
+
+	#[test]
+	fn test_download_paths() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_download_paths");
+		let test_path = setup_test(&testname);
+
+		let server = start_server(Arc::new(AtomicUsize::new(0)), Arc::new(AtomicUsize::new(0)));
+		let mut manager = DownloadManager::new(make_pool(&server, 1), &test_path);
+		manager.set_workers(1);
+
+		// Files with the same name on different hosts are saved separately
+		for host in ["host1", "host2"] {
+			manager.enqueue(DownloadItem {
+				host: String::from(host),
+				server_path: String::from("/ wsp same"),
+				size: 1,
+				priority: DownloadPriority::Normal,
+			});
+		}
+		let results = manager.run();
+		let paths: Vec<PathBuf> = results.into_iter().filter_map(|r| r.result.ok()).collect();
+		if paths.len() != 2 || paths[0] == paths[1] ||
+			paths.iter().any(|p| !p.starts_with(&test_path)) {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: wrong download paths {:?}", testname, paths)))
+		}
+
+		// Names which could point outside the download directory are refused
+		for (host, server_path) in [("host1", "/ wsp .."), ("host1", "/ wsp /etc/x"),
+			("..", "/ wsp file"), ("host1", "/ wsp ")] {
+			manager.enqueue(DownloadItem {
+				host: String::from(host),
+				server_path: String::from(server_path),
+				size: 1,
+				priority: DownloadPriority::Normal,
+			});
+		}
+		let results = manager.run();
+		if results.len() != 4 || results.iter().any(|r| r.result.is_ok()) {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: unsafe names accepted: {:?}", testname, results)))
+		}
+
+		Ok(())
+	}
+}
@@ -0,0 +1,214 @@
+//! The folders module keeps a running count of the messages in each folder so that showing the
+//! totals for every folder doesn't mean counting rows in the messages table. The counters are
+//! updated by the message functions in the same transaction as the change they count, so they
+//! can't drift as long as messages are only changed through them. `verify_folder_counters()` and
+//! `rebuild_folder_counters()` exist for when they have anyway, such as after a crash in an older
+//! version or an edit made with another tool.
+
+use rusqlite;
+use std::collections::HashMap;
+use crate::base::*;
+use crate::messages::*;
+
+/// The number of messages in a folder, how many of them are unread and flagged, and their total
+/// size in bytes
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct FolderCounts {
+	pub total: i64,
+	pub unread: i64,
+	pub flagged: i64,
+	pub size: i64,
+}
+
+impl FolderCounts {
+
+	/// Returns the counts for a single message with the specified flags and size
+	pub fn for_message(flags: i64, size: i64) -> FolderCounts {
+		FolderCounts {
+			total: 1,
+			unread: if flags & MSG_FLAG_SEEN == 0 { 1 } else { 0 },
+			flagged: if flags & MSG_FLAG_FLAGGED != 0 { 1 } else { 0 },
+			size,
+		}
+	}
+
+	/// Adds another set of counts to this one
+	pub fn add(&mut self, other: &FolderCounts) {
+		self.total += other.total;
+		self.unread += other.unread;
+		self.flagged += other.flagged;
+		self.size += other.size;
+	}
+
+	/// Returns the counts with their signs flipped, for taking messages out of a folder
+	pub fn negate(&self) -> FolderCounts {
+		FolderCounts {
+			total: -self.total,
+			unread: -self.unread,
+			flagged: -self.flagged,
+			size: -self.size,
+		}
+	}
+}
+
+// SQL for the counts of every folder as found in the messages table
+static COUNT_MESSAGES_SQL: &str = "SELECT folder,COUNT(*),SUM((flags & 1)=0),SUM((flags & 2)!=0),
+	SUM(size) FROM messages GROUP BY folder";
+
+/// Adds the specified amounts to a folder's counters. This is meant to be called within the
+/// transaction which makes the change being counted.
+pub fn adjust_folder_counts(conn: &rusqlite::Connection, folder: &str, delta: &FolderCounts)
+-> Result<(), MensagoError> {
+
+	if *delta == FolderCounts::default() {
+		return Ok(())
+	}
+
+	match conn.execute("INSERT INTO folder_counters(folder,total,unread,flagged,size)
+		VALUES(?1,?2,?3,?4,?5) ON CONFLICT(folder) DO UPDATE SET total=total+excluded.total,
+		unread=unread+excluded.unread,flagged=flagged+excluded.flagged,size=size+excluded.size",
+		rusqlite::params![folder, delta.total, delta.unread, delta.flagged, delta.size]) {
+		Ok(_) => Ok(()),
+		Err(e) => Err(MensagoError::ErrDatabaseException(e.to_string()))
+	}
+}
+
+/// Returns the counts for a folder. Folders without any messages have counts of zero.
+pub fn get_folder_counts(conn: &rusqlite::Connection, folder: &str)
+-> Result<FolderCounts, MensagoError> {
+
+	let mut stmt = conn.prepare(
+		"SELECT total,unread,flagged,size FROM folder_counters WHERE folder=?1")?;
+	let mut rows = stmt.query([folder])?;
+	match rows.next()? {
+		Some(row) => Ok(FolderCounts {
+			total: row.get::<usize,i64>(0)?,
+			unread: row.get::<usize,i64>(1)?,
+			flagged: row.get::<usize,i64>(2)?,
+			size: row.get::<usize,i64>(3)?,
+		}),
+		None => Ok(FolderCounts::default()),
+	}
+}
+
+/// Returns the counts for every folder which has held messages, sorted by folder name
+pub fn get_all_folder_counts(conn: &rusqlite::Connection)
+-> Result<Vec<(String, FolderCounts)>, MensagoError> {
+
+	let mut stmt = conn.prepare(
+		"SELECT folder,total,unread,flagged,size FROM folder_counters ORDER BY folder")?;
+	read_counts(&mut stmt.query([])?)
+}
+
+/// Counts the messages in each folder and returns the names of the folders whose counters don't
+/// match. This reads every message, so it should only be run occasionally, such as after an
+/// unclean shutdown.
+pub fn verify_folder_counters(conn: &rusqlite::Connection) -> Result<Vec<String>, MensagoError> {
+
+	let mut actual: HashMap<String, FolderCounts> = {
+		let mut stmt = conn.prepare(COUNT_MESSAGES_SQL)?;
+		let rows = read_counts(&mut stmt.query([])?)?;
+		rows.into_iter().collect()
+	};
+
+	let mut out = Vec::new();
+	for (folder, stored) in get_all_folder_counts(conn)? {
+		let counted = actual.remove(&folder).unwrap_or_default();
+		if counted != stored {
+			out.push(folder);
+		}
+	}
+	out.extend(actual.into_keys());
+	out.sort();
+
+	Ok(out)
+}
+
+/// Replaces all folder counters with fresh counts of the messages table
+pub fn rebuild_folder_counters(conn: &rusqlite::Connection) -> Result<(), MensagoError> {
+
+	let tx = conn.unchecked_transaction()?;
+	fill_folder_counters(&tx)?;
+	match tx.commit() {
+		Ok(_) => Ok(()),
+		Err(e) => Err(MensagoError::ErrDatabaseException(e.to_string()))
+	}
+}
+
+// Recounts the messages in every folder. This must be called within a transaction.
+pub(crate) fn fill_folder_counters(conn: &rusqlite::Connection) -> Result<(), MensagoError> {
+	conn.execute("DELETE FROM folder_counters", [])?;
+	conn.execute(&format!("INSERT INTO folder_counters(folder,total,unread,flagged,size) {}",
+		COUNT_MESSAGES_SQL), [])?;
+	Ok(())
+}
+
+// Reads folder names and counts from query rows with the columns in the order used above
+fn read_counts(rows: &mut rusqlite::Rows) -> Result<Vec<(String, FolderCounts)>, MensagoError> {
+
+	let mut out = Vec::new();
+	while let Some(row) = rows.next()? {
+		out.push((row.get::<usize,String>(0)?, FolderCounts {
+			total: row.get::<usize,i64>(1)?,
+			unread: row.get::<usize,i64>(2)?,
+			flagged: row.get::<usize,i64>(3)?,
+			size: row.get::<usize,i64>(4)?,
+		}));
+	}
+	Ok(out)
+}
+
+#[cfg(test)]
+mod tests {
+	use crate::*;
+	use crate::testutil::*;
+	use libkeycard::*;
+
+	#[test]
+	fn test_folder_counters() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_folder_counters");
+		let conn = open_storage()?;
+
+		let msgs: Vec<Message> = (0..5).map(|_| make_message("0123456789")).collect();
+		add_messages(&conn, &msgs)?;
+		let ids: Vec<RandomID> = msgs.iter().map(|m| RandomID::from(&m.id).unwrap()).collect();
+
+		set_message_flags(&conn, &ids[0], MSG_FLAG_SEEN, 0)?;
+		set_message_flags(&conn, &ids[1], MSG_FLAG_SEEN | MSG_FLAG_FLAGGED, 0)?;
+		move_message(&conn, &ids[1], "archive")?;
+		move_message(&conn, &ids[2], "archive")?;
+		remove_message(&conn, &ids[3])?;
+
+		let inbox = get_folder_counts(&conn, INBOX_FOLDER)?;
+		let archive = get_folder_counts(&conn, "archive")?;
+		if inbox != (FolderCounts { total: 2, unread: 1, flagged: 0, size: 20 })
+			|| archive != (FolderCounts { total: 2, unread: 1, flagged: 1, size: 20 }) {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: wrong counts: {:?} {:?}", testname, inbox, archive)))
+		}
+
+		let bad = verify_folder_counters(&conn)?;
+		if bad.len() != 0 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: counters reported wrong: {:?}", testname, bad)))
+		}
+
+		// Damage the counters to check that verification notices and rebuilding fixes them
+		conn.execute("UPDATE folder_counters SET unread=7 WHERE folder='archive'", [])?;
+		conn.execute("DELETE FROM folder_counters WHERE folder='inbox'", [])?;
+		let bad = verify_folder_counters(&conn)?;
+		if bad != vec![String::from("archive"), String::from(INBOX_FOLDER)] {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: damaged counters not found: {:?}", testname, bad)))
+		}
+		rebuild_folder_counters(&conn)?;
+		if verify_folder_counters(&conn)?.len() != 0
+			|| get_folder_counts(&conn, INBOX_FOLDER)? != inbox {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: counters not rebuilt", testname)))
+		}
+
+		Ok(())
+	}
+}
@@ -0,0 +1,529 @@
+//! The ingest module implements the staged pipeline used to bring incoming messages into local
+//! storage during a sync. Each message passes through four stages:
+//!
+//! - download: raw envelopes are pulled from a source, usually the server connection
+//! - decrypt: the payload key is unwrapped and the payload decrypted (parallel)
+//! - parse: the decrypted payload is parsed into a Message (parallel)
+//! - insert: messages are written to the database in batches by a single writer
+//!
+//! Stages are connected by bounded channels, so a slow stage applies backpressure to the ones
+//! upstream of it instead of letting queued messages pile up in memory.
+
+use eznacl::*;
+use libkeycard::*;
+use rusqlite;
+use std::sync::{Arc, Mutex};
+use std::sync::mpsc::{sync_channel, Receiver, SyncSender};
+use std::thread;
+use std::time::{Duration, Instant};
+use crate::auth::*;
+use crate::base::*;
+use crate::messages::*;
+use crate::outbox::*;
+use crate::types::*;
+
+/// Throughput information for one stage of the ingest pipeline. `busy` is the total time the
+/// stage's workers spent doing work and `blocked` is the total time they spent waiting for room in
+/// the next stage's queue. A stage with a large `blocked` time is being held up by a stage further
+/// down the pipeline.
+#[derive(Debug, Clone, PartialEq)]
+pub struct StageStats {
+	pub name: &'static str,
+	pub workers: usize,
+	pub items: usize,
+	pub bytes: usize,
+	pub busy: Duration,
+	pub blocked: Duration,
+}
+
+impl StageStats {
+
+	fn new(name: &'static str, workers: usize) -> StageStats {
+		StageStats {
+			name,
+			workers,
+			items: 0,
+			bytes: 0,
+			busy: Duration::ZERO,
+			blocked: Duration::ZERO,
+		}
+	}
+
+	fn merge(&mut self, other: &StageStats) {
+		self.items += other.items;
+		self.bytes += other.bytes;
+		self.busy += other.busy;
+		self.blocked += other.blocked;
+	}
+
+	/// Returns the number of items per second the stage processed while busy, accounting for the
+	/// number of workers in the stage.
+	pub fn items_per_sec(&self) -> f64 {
+		let secs = self.busy.as_secs_f64() / self.workers.max(1) as f64;
+		if secs > 0.0 { self.items as f64 / secs } else { 0.0 }
+	}
+}
+
+/// The results of an ingest run. Messages which could not be downloaded, decrypted, or parsed do
+/// not stop the run. Instead, their position in the source and the error are listed in `failed`.
+#[derive(Debug)]
+pub struct IngestReport {
+	pub stages: [StageStats; 4],
+	pub inserted: usize,
+	pub failed: Vec<(usize, MensagoError)>,
+	pub elapsed: Duration,
+}
+
+/// IngestPipeline holds the tuning parameters for ingesting messages
+#[derive(Debug, Clone)]
+pub struct IngestPipeline {
+	decrypt_workers: usize,
+	parse_workers: usize,
+	queue_size: usize,
+	batch_size: usize,
+}
+
+impl IngestPipeline {
+
+	/// Creates a new pipeline with one decryption worker per available CPU
+	pub fn new() -> IngestPipeline {
+		let cpus = match thread::available_parallelism() {
+			Ok(v) => v.get(),
+			Err(_) => 1,
+		};
+
+		IngestPipeline {
+			decrypt_workers: cpus,
+			parse_workers: (cpus / 2).max(1),
+			queue_size: 64,
+			batch_size: 256,
+		}
+	}
+
+	/// Sets the number of worker threads for the decryption and parsing stages
+	pub fn set_workers(&mut self, decrypt: usize, parse: usize) {
+		self.decrypt_workers = decrypt.max(1);
+		self.parse_workers = parse.max(1);
+	}
+
+	/// Sets the capacity of the queues between stages
+	pub fn set_queue_size(&mut self, size: usize) {
+		self.queue_size = size.max(1);
+	}
+
+	/// Sets the number of messages written to the database per transaction
+	pub fn set_batch_size(&mut self, size: usize) {
+		self.batch_size = size.max(1);
+	}
+
+	/// Runs the pipeline. The source yields sealed envelopes in their serialized form. The
+	/// recipient address is used to locate the wrapped payload key in each envelope, and the
+	/// keypair is the workspace's Encryption-category keypair. Decrypted messages are assigned to
+	/// the workspace address and inserted into the storage database.
+	///
+	/// If a batch can't be inserted, the run stops and the database error is returned. Batches
+	/// committed before the failure are kept, and their message count is given in the error.
+	pub fn run<I>(&self, source: I, recipient: &MAddress, keypair: &EncryptionPair,
+		waddr: &WAddress, conn: &rusqlite::Connection) -> Result<IngestReport, MensagoError>
+	where I: Iterator<Item = Result<Vec<u8>, MensagoError>> + Send {
+
+		let start = Instant::now();
+		let recipient = recipient.to_string();
+		let address = waddr.to_string();
+
+		let (raw_tx, raw_rx) = sync_channel::<(usize, Vec<u8>)>(self.queue_size);
+		let (plain_tx, plain_rx) = sync_channel::<(usize, Vec<u8>)>(self.queue_size);
+		let (msg_tx, msg_rx) = sync_channel::<(usize, Message)>(self.queue_size);
+		// Each worker holds its own reference to the queue it reads from, so a queue is closed as
+		// soon as all of its readers have exited. Otherwise an early exit by a downstream stage
+		// would leave the upstream ones blocked on a full queue.
+		let raw_rx = Arc::new(Mutex::new(raw_rx));
+		let plain_rx = Arc::new(Mutex::new(plain_rx));
+
+		let (results, insert_stats, inserted, insert_error) = thread::scope(|s| {
+
+			let download = s.spawn(move || download_stage(source, raw_tx));
+
+			let decrypters: Vec<_> = (0..self.decrypt_workers)
+				.map(|_| {
+					let tx = plain_tx.clone();
+					let rx = raw_rx.clone();
+					let recipient = &recipient;
+					s.spawn(move || worker_stage("decrypt", &rx, tx, |data| {
+						open_envelope(&data, recipient, keypair)
+					}))
+				})
+				.collect();
+			drop(plain_tx);
+			drop(raw_rx);
+
+			let parsers: Vec<_> = (0..self.parse_workers)
+				.map(|_| {
+					let tx = msg_tx.clone();
+					let rx = plain_rx.clone();
+					let address = &address;
+					s.spawn(move || worker_stage("parse", &rx, tx, |data| {
+						let mut msg = Message::from_bytes(&data)?;
+						msg.address = address.clone();
+						Ok(msg)
+					}))
+				})
+				.collect();
+			drop(msg_tx);
+			drop(plain_rx);
+
+			let (insert_stats, inserted, insert_error) = self.insert_stage(msg_rx, conn);
+
+			let mut results = vec![join_stage(download)];
+			results.push(join_stages(decrypters));
+			results.push(join_stages(parsers));
+			(results, insert_stats, inserted, insert_error)
+		});
+
+		if let Some(e) = insert_error {
+			return Err(MensagoError::ErrDatabaseException(
+				format!("{} ({} messages inserted before the error)", e, inserted)))
+		}
+
+		let mut failed = Vec::new();
+		let mut stages = Vec::with_capacity(4);
+		for result in results {
+			let (stats, errors) = result?;
+			stages.push(stats);
+			failed.extend(errors);
+		}
+		stages.push(insert_stats);
+		failed.sort_by_key(|f| f.0);
+
+		Ok(IngestReport {
+			stages: [stages[0].clone(), stages[1].clone(), stages[2].clone(), stages[3].clone()],
+			inserted,
+			failed,
+			elapsed: start.elapsed(),
+		})
+	}
+
+	// The insert stage runs on the calling thread because it is the only stage which touches the
+	// database. If a batch fails to insert, the stage returns early and drops its receiver, which
+	// causes the upstream stages to shut down. The count returned includes the batches committed
+	// before the failure.
+	fn insert_stage(&self, rx: Receiver<(usize, Message)>, conn: &rusqlite::Connection)
+	-> (StageStats, usize, Option<MensagoError>) {
+
+		let mut stats = StageStats::new("insert", 1);
+		let mut batch = Vec::<Message>::with_capacity(self.batch_size);
+		let mut inserted: usize = 0;
+
+		let mut flush = |batch: &mut Vec<Message>, stats: &mut StageStats| {
+			let started = Instant::now();
+			let result = add_messages(conn, batch);
+			stats.busy += started.elapsed();
+			if result.is_ok() {
+				stats.items += batch.len();
+				inserted += batch.len();
+			}
+			batch.clear();
+			result
+		};
+
+		for (_, msg) in rx.iter() {
+			stats.bytes += msg.body.as_ref().map_or(0, |b| b.len());
+			batch.push(msg);
+			if batch.len() >= self.batch_size {
+				if let Err(e) = flush(&mut batch, &mut stats) {
+					return (stats, inserted, Some(e))
+				}
+			}
+		}
+		if let Err(e) = flush(&mut batch, &mut stats) {
+			return (stats, inserted, Some(e))
+		}
+
+		(stats, inserted, None)
+	}
+}
+
+/// Returns the workspace's Encryption-category keypair, which is used to unwrap the payload keys
+/// of incoming messages
+pub fn get_decryption_pair(secrets: &rusqlite::Connection) -> Result<EncryptionPair, MensagoError> {
+
+	let pair = get_keypair_by_category(secrets, &KeyCategory::Encryption)?;
+	match EncryptionPair::from(&pair[0], &pair[1]) {
+		Some(v) => Ok(v),
+		None => {
+			Err(MensagoError::ErrDatabaseException(
+				String::from("Bad encryption keypair in database in get_decryption_pair()")))
+		}
+	}
+}
+
+/// Unwraps the payload key for the recipient and decrypts the envelope's payload
+fn open_envelope(data: &[u8], recipient: &str, keypair: &EncryptionPair)
+-> Result<Vec<u8>, MensagoError> {
+
+	let envelope: SealedEnvelope = serde_json::from_slice(data)?;
+	let wrapped = match envelope.keys.iter().find(|k| k.recipient == recipient) {
+		Some(v) => v,
+		None => { return Err(MensagoError::ErrNotFound) }
+	};
+
+	let wrappedkey = match CryptoString::from(&wrapped.key) {
+		Some(v) => v,
+		None => { return Err(MensagoError::ErrBadValue) }
+	};
+	let keystr = String::from_utf8(keypair.decrypt(&wrappedkey)?)?;
+	let payloadkey = match SecretKey::from_string(&keystr) {
+		Some(v) => v,
+		None => { return Err(MensagoError::ErrBadValue) }
+	};
+
+	let payload = match CryptoString::from(&envelope.payload) {
+		Some(v) => v,
+		None => { return Err(MensagoError::ErrBadValue) }
+	};
+	Ok(payloadkey.decrypt(&payload)?)
+}
+
+type StageResult = Result<(StageStats, Vec<(usize, MensagoError)>), MensagoError>;
+
+fn download_stage<I>(source: I, tx: SyncSender<(usize, Vec<u8>)>)
+-> (StageStats, Vec<(usize, MensagoError)>)
+where I: Iterator<Item = Result<Vec<u8>, MensagoError>> {
+
+	let mut stats = StageStats::new("download", 1);
+	let mut failed = Vec::new();
+	let mut source = source.enumerate();
+
+	loop {
+		let started = Instant::now();
+		let item = source.next();
+		stats.busy += started.elapsed();
+
+		let (index, data) = match item {
+			Some((i, Ok(v))) => (i, v),
+			Some((i, Err(e))) => {
+				failed.push((i, e));
+				continue
+			},
+			None => break,
+		};
+		stats.items += 1;
+		stats.bytes += data.len();
+
+		let started = Instant::now();
+		if tx.send((index, data)).is_err() {
+			break
+		}
+		stats.blocked += started.elapsed();
+	}
+
+	(stats, failed)
+}
+
+// Generic worker for the parallel stages. Workers pull from a shared receiver until the upstream
+// stage closes it, and stop early if the downstream stage has gone away.
+fn worker_stage<T, F>(name: &'static str, rx: &Mutex<Receiver<(usize, Vec<u8>)>>,
+	tx: SyncSender<(usize, T)>, work: F) -> (StageStats, Vec<(usize, MensagoError)>)
+where F: Fn(Vec<u8>) -> Result<T, MensagoError> {
+
+	let mut stats = StageStats::new(name, 1);
+	let mut failed = Vec::new();
+
+	loop {
+		let item = match rx.lock() {
+			Ok(v) => v.recv(),
+			Err(_) => break,
+		};
+		let (index, data) = match item {
+			Ok(v) => v,
+			Err(_) => break,
+		};
+
+		let started = Instant::now();
+		let size = data.len();
+		let result = work(data);
+		stats.busy += started.elapsed();
+
+		match result {
+			Ok(v) => {
+				stats.items += 1;
+				stats.bytes += size;
+
+				let started = Instant::now();
+				if tx.send((index, v)).is_err() {
+					break
+				}
+				stats.blocked += started.elapsed();
+			},
+			Err(e) => failed.push((index, e)),
+		}
+	}
+
+	(stats, failed)
+}
+
+fn join_stage(handle: thread::ScopedJoinHandle<(StageStats, Vec<(usize, MensagoError)>)>)
+-> StageResult {
+	match handle.join() {
+		Ok(v) => Ok(v),
+		Err(_) => Err(MensagoError::ErrProgramException(
+			String::from("BUG: ingest pipeline worker panicked"))),
+	}
+}
+
+fn join_stages(handles: Vec<thread::ScopedJoinHandle<(StageStats, Vec<(usize, MensagoError)>)>>)
+-> StageResult {
+
+	let workers = handles.len();
+	let mut stats: Option<StageStats> = None;
+	let mut failed = Vec::new();
+	for handle in handles {
+		let (s, f) = join_stage(handle)?;
+		match stats.as_mut() {
+			Some(v) => v.merge(&s),
+			None => stats = Some(s),
+		}
+		failed.extend(f);
+	}
+
+	// Worker counts are always at least 1, so there is always at least one set of stats
+	let mut stats = stats.unwrap();
+	stats.workers = workers;
+	Ok((stats, failed))
+}
+
+#[cfg(test)]
+mod tests {
+	use crate::*;
+	use crate::testutil::*;
+	use eznacl::*;
+	use libkeycard::*;
+
+	// Returns sealed envelopes for test messages with the specified IDs
+	fn seal_messages(ids: &[String], recipient: &Recipient)
+	-> Result<Vec<Result<Vec<u8>, MensagoError>>, MensagoError> {
+
+		let outbox = Outbox::with_workers(1);
+		let mut envelopes = Vec::new();
+		for id in ids {
+			let msg = Message {
+				id: id.clone(),
+				..make_message("This is a test message body")
+			};
+			let envelope = outbox.seal(&serde_json::to_vec(&msg)?, &[recipient.clone()])?;
+			envelopes.push(Ok(serde_json::to_vec(&envelope)?));
+		}
+		Ok(envelopes)
+	}
+
+	#[test]
+	fn test_ingest_pipeline() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_ingest_pipeline");
+		let conn = open_storage()?;
+
+		let keypair = EncryptionPair::generate().unwrap();
+		let recipient = Recipient {
+			address: MAddress::from("csimons/example.com").unwrap(),
+			key: keypair.get_public_key(),
+		};
+		let waddr = WAddress::from("b5a9367e-680d-46c0-bb2c-73932a6d4007/example.com").unwrap();
+
+		let ids: Vec<String> = (0..50).map(|_| RandomID::generate().to_string()).collect();
+		let mut envelopes = seal_messages(&ids, &recipient)?;
+
+		// Corrupt one envelope and add a download failure to make sure bad messages are reported
+		// without stopping the run
+		envelopes[10] = Ok(b"not an envelope".to_vec());
+		envelopes.push(Err(MensagoError::ErrBadMessage));
+
+		let mut pipeline = IngestPipeline::new();
+		pipeline.set_workers(2, 2);
+		pipeline.set_queue_size(4);
+		pipeline.set_batch_size(16);
+
+		let report = match pipeline.run(envelopes.into_iter(), &recipient.address, &keypair,
+			&waddr, &conn) {
+			Ok(v) => v,
+			Err(e) => {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: error running pipeline: {}", testname, e.to_string())))
+			}
+		};
+
+		if report.inserted != 49 || report.failed.len() != 2 || report.failed[0].0 != 10 ||
+			report.failed[1].0 != 50 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: unexpected results: {} inserted, {:?} failed", testname,
+					report.inserted, report.failed)))
+		}
+
+		let msg = get_message(&conn, &RandomID::from(&ids[0]).unwrap())?;
+		if msg.address != waddr.to_string() ||
+			msg.body.as_deref() != Some("This is a test message body") {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: message data mismatch", testname)))
+		}
+
+		// Previews are stored at ingest so that listing doesn't need the bodies
+		let headers = get_message_headers(&conn, 0, 100)?;
+		if headers.len() != 49 || headers.iter().any(|h| h.has_attachments
+			|| h.preview.as_deref() != Some("This is a test message body")) {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: message headers mismatch", testname)))
+		}
+
+		Ok(())
+	}
+
+	#[test]
+	fn test_ingest_insert_failure() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_ingest_insert_failure");
+		let conn = open_storage()?;
+
+		let keypair = EncryptionPair::generate().unwrap();
+		let recipient = Recipient {
+			address: MAddress::from("csimons/example.com").unwrap(),
+			key: keypair.get_public_key(),
+		};
+		let waddr = WAddress::from("b5a9367e-680d-46c0-bb2c-73932a6d4007/example.com").unwrap();
+
+		// Message 20 reuses the ID of message 0, so the third batch fails to insert. The queues
+		// are much smaller than the rest of the source, so the upstream stages are blocked on
+		// full queues when the insert fails and must be shut down for the run to return.
+		let mut ids: Vec<String> = (0..64).map(|_| RandomID::generate().to_string()).collect();
+		ids[20] = ids[0].clone();
+		let envelopes = seal_messages(&ids, &recipient)?;
+
+		let mut pipeline = IngestPipeline::new();
+		pipeline.set_workers(1, 1);
+		pipeline.set_queue_size(2);
+		pipeline.set_batch_size(8);
+
+		match pipeline.run(envelopes.into_iter(), &recipient.address, &keypair, &waddr, &conn) {
+			Ok(_) => {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: failed insert not reported", testname)))
+			},
+			Err(MensagoError::ErrDatabaseException(msg)) => {
+				if !msg.contains("16 messages inserted") {
+					return Err(MensagoError::ErrProgramException(
+						format!("{}: wrong inserted count in error: {}", testname, msg)))
+				}
+			},
+			Err(e) => {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: unexpected error: {}", testname, e.to_string())))
+			},
+		}
+
+		// The batches before the failure stay in the database
+		if get_message_headers(&conn, 0, 100)?.len() != 16 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: committed batches missing", testname)))
+		}
+
+		Ok(())
+	}
+}
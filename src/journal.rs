@@ -0,0 +1,319 @@
+//! The journal module records commands which change things on the server, such as moving or
+//! deleting items, so that they can be made while offline. Commands are saved in the profile's
+//! storage database and sent to the server in batches once it can be reached again. Each one
+//! carries an idempotency key so that a command which was sent, but whose response was lost, is
+//! not carried out twice when it is sent again.
+
+use libkeycard::*;
+use rusqlite;
+use std::collections::HashMap;
+use crate::base::*;
+use crate::changes::*;
+use crate::commands::servermsg::*;
+use crate::retry::*;
+use crate::transport::*;
+
+/// The request field which carries a journaled command's idempotency key
+pub const JOURNAL_KEY_FIELD: &str = "IdempotencyKey";
+
+/// The number of commands sent at once by `replay_journal()` if a batch size isn't given
+pub const DEFAULT_JOURNAL_BATCH: usize = 32;
+
+/// Coalesce decides what happens to commands already in the journal for the same target when a
+/// new one is added
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Coalesce {
+	/// Keep everything. Used for commands such as sending a message, where each one counts.
+	Never,
+	/// Drop earlier commands with the same action, such as setting flags or moving an item,
+	/// where only the last one matters
+	Replace,
+	/// Drop all earlier commands for the target, such as when it is deleted
+	Supersede,
+}
+
+/// JournalEntry is a command waiting in the journal
+#[derive(Debug, Clone, PartialEq)]
+pub struct JournalEntry {
+	pub seq: i64,
+	pub key: String,
+	pub target: String,
+	pub request: ClientRequest,
+	pub created: String,
+	pub attempts: u32,
+}
+
+/// JournalReplay reports the outcome of replaying the journal. Commands the server rejected are
+/// removed from the journal and returned in `rejected` so that the change can be undone locally.
+#[derive(Debug, Default)]
+pub struct JournalReplay {
+	pub sent: usize,
+	pub rejected: Vec<(JournalEntry, CmdStatus)>,
+	pub remaining: usize,
+}
+
+/// Adds a command to the journal and returns its idempotency key. `target` identifies the item the
+/// command changes, such as a message ID or a server path, and is used for coalescing.
+pub fn add_journal_entry(conn: &rusqlite::Connection, target: &str, request: &ClientRequest,
+	coalesce: Coalesce) -> Result<String, MensagoError> {
+
+	if target.len() == 0 || request.action.len() == 0 {
+		return Err(MensagoError::ErrEmptyData)
+	}
+
+	ensure_journal_table(conn)?;
+	let key = RandomID::generate().to_string();
+	let data = serde_json::to_string(&request.data)?;
+
+	let tx = conn.unchecked_transaction()?;
+	match coalesce {
+		Coalesce::Never => 0,
+		Coalesce::Replace => {
+			tx.execute("DELETE FROM journal WHERE target=?1 AND action=?2",
+				rusqlite::params![target, request.action])?
+		},
+		Coalesce::Supersede => tx.execute("DELETE FROM journal WHERE target=?1", [target])?,
+	};
+	tx.execute("INSERT INTO journal(key,action,target,data,created) VALUES(?1,?2,?3,?4,?5)",
+		rusqlite::params![key, request.action, target, data, get_timestamp()])?;
+	note_change(&tx, CHANGE_JOURNAL)?;
+
+	match tx.commit() {
+		Ok(_) => Ok(key),
+		Err(e) => Err(MensagoError::ErrDatabaseException(e.to_string()))
+	}
+}
+
+/// Returns the oldest commands in the journal, up to the specified number
+pub fn get_journal_entries(conn: &rusqlite::Connection, limit: usize)
+-> Result<Vec<JournalEntry>, MensagoError> {
+
+	ensure_journal_table(conn)?;
+	let mut stmt = conn.prepare("SELECT seq,key,target,action,data,created,attempts FROM journal
+		ORDER BY seq LIMIT ?1")?;
+	let mut rows = stmt.query([limit as i64])?;
+
+	let mut out = Vec::<JournalEntry>::new();
+	while let Some(row) = rows.next()? {
+		let mut request = ClientRequest::new(&row.get::<usize,String>(3)?);
+		request.data = match serde_json::from_str::<HashMap<String, String>>(
+			&row.get::<usize,String>(4)?) {
+			Ok(v) => v,
+			Err(e) => {
+				return Err(MensagoError::ErrDatabaseException(
+					format!("bad journal entry data: {}", e)))
+			}
+		};
+		out.push(JournalEntry {
+			seq: row.get::<usize,i64>(0)?,
+			key: row.get::<usize,String>(1)?,
+			target: row.get::<usize,String>(2)?,
+			request,
+			created: row.get::<usize,String>(5)?,
+			attempts: row.get::<usize,u32>(6)?,
+		});
+	}
+
+	Ok(out)
+}
+
+/// Returns the number of commands waiting in the journal
+pub fn count_journal_entries(conn: &rusqlite::Connection) -> Result<usize, MensagoError> {
+	ensure_journal_table(conn)?;
+	Ok(conn.query_row("SELECT COUNT(*) FROM journal", [], |row| row.get::<usize,usize>(0))?)
+}
+
+/// Sends the commands in the journal to the server in the order they were added. Each batch is
+/// written to the connection all at once and the responses are read afterward, which saves a round
+/// trip per command. Commands are removed from the journal once the server accepts or rejects
+/// them. Replay stops after a batch in which the server reported a temporary problem, and stops
+/// right away with an error if the connection fails, leaving the rest for the next attempt.
+pub fn replay_journal<T: Transport + ?Sized>(conn: &rusqlite::Connection, sock: &mut T,
+	batch_size: usize) -> Result<JournalReplay, MensagoError> {
+
+	let batch_size = if batch_size == 0 { DEFAULT_JOURNAL_BATCH } else { batch_size };
+	let mut out = JournalReplay::default();
+
+	loop {
+		let batch = get_journal_entries(conn, batch_size)?;
+		if batch.len() == 0 {
+			break
+		}
+
+		// Attempts are counted before sending so that a command which keeps breaking the
+		// connection can be spotted
+		conn.execute("UPDATE journal SET attempts=attempts+1 WHERE seq BETWEEN ?1 AND ?2",
+			[batch[0].seq, batch[batch.len() - 1].seq])?;
+
+		for entry in batch.iter() {
+			let mut request = entry.request.clone();
+			request.data.insert(String::from(JOURNAL_KEY_FIELD), entry.key.clone());
+			request.send(sock)?;
+		}
+
+		// Every response in the batch is read, even after a failure, so that the connection
+		// stays in step. Finished commands are removed as they come in, so a dropped connection
+		// doesn't cause them to be sent again.
+		let mut retry_later = false;
+		for entry in batch.into_iter() {
+			let resp = ServerResponse::receive(sock)?;
+			out.sent += 1;
+
+			if resp.status.code >= 200 && resp.status.code < 300 {
+				remove_journal_entry(conn, entry.seq)?;
+				continue
+			}
+
+			match classify_error(&MensagoError::ErrProtocol(resp.status.clone())) {
+				ErrorClass::Permanent => {
+					remove_journal_entry(conn, entry.seq)?;
+					out.rejected.push((entry, resp.status));
+				},
+				_ => retry_later = true,
+			}
+		}
+
+		if retry_later {
+			break
+		}
+	}
+
+	out.remaining = count_journal_entries(conn)?;
+	Ok(out)
+}
+
+/// Removes a command from the journal
+pub fn remove_journal_entry(conn: &rusqlite::Connection, seq: i64) -> Result<(), MensagoError> {
+
+	match conn.execute("DELETE FROM journal WHERE seq=?1", [seq]) {
+		Ok(0) => Err(MensagoError::ErrNotFound),
+		Ok(_) => note_change(conn, CHANGE_JOURNAL),
+		Err(e) => {
+			Err(MensagoError::ErrDatabaseException(e.to_string()))
+		}
+	}
+}
+
+// Creates the journal table in databases made before it existed
+fn ensure_journal_table(conn: &rusqlite::Connection) -> Result<(), MensagoError> {
+
+	match conn.execute_batch(
+		"CREATE TABLE IF NOT EXISTS 'journal'('seq' INTEGER PRIMARY KEY AUTOINCREMENT,
+			'key' TEXT NOT NULL UNIQUE, 'action' TEXT NOT NULL, 'target' TEXT NOT NULL,
+			'data' TEXT NOT NULL, 'created' TEXT NOT NULL,
+			'attempts' INTEGER NOT NULL DEFAULT 0);
+		CREATE INDEX IF NOT EXISTS 'journal_target' ON 'journal'('target');") {
+		Ok(_) => Ok(()),
+		Err(e) => {
+			Err(MensagoError::ErrDatabaseException(String::from(e.to_string())))
+		}
+	}
+}
+
+#[cfg(test)]
+mod tests {
+	use crate::*;
+	use crate::commands::servermsg::*;
+	use crate::commands::testserver::*;
+	use crate::testutil::*;
+	use std::collections::HashSet;
+	use std::sync::{Arc, Mutex};
+
+	#[test]
+	fn test_journal_coalesce() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_journal_coalesce");
+		let conn = open_storage()?;
+
+		let setflags = |flags: &str| ClientRequest::from("SETFLAGS", &[("Flags", flags)]);
+		add_journal_entry(&conn, "msg1", &setflags("read"), Coalesce::Replace)?;
+		add_journal_entry(&conn, "msg2", &setflags("read"), Coalesce::Replace)?;
+		add_journal_entry(&conn, "msg1", &setflags("read,flagged"), Coalesce::Replace)?;
+		add_journal_entry(&conn, "msg2", &ClientRequest::from("MOVE", &[("Dest", "/ trash")]),
+			Coalesce::Replace)?;
+		add_journal_entry(&conn, "msg2", &ClientRequest::new("DELETE"), Coalesce::Supersede)?;
+		add_journal_entry(&conn, "msg3", &ClientRequest::new("SEND"), Coalesce::Never)?;
+		add_journal_entry(&conn, "msg3", &ClientRequest::new("SEND"), Coalesce::Never)?;
+
+		let entries = get_journal_entries(&conn, 100)?;
+		let summary: Vec<(&str, &str)> = entries.iter()
+			.map(|e| (e.target.as_str(), e.request.action.as_str()))
+			.collect();
+		if summary != vec![("msg1", "SETFLAGS"), ("msg2", "DELETE"), ("msg3", "SEND"),
+			("msg3", "SEND")] {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: wrong journal contents: {:?}", testname, summary)))
+		}
+		if entries[0].request.data["Flags"] != "read,flagged" {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: replaced entry has old data", testname)))
+		}
+
+		Ok(())
+	}
+
+	#[test]
+	fn test_journal_replay() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_journal_replay");
+		let conn = open_storage()?;
+
+		for i in 0..10 {
+			let target = format!("msg{}", i);
+			add_journal_entry(&conn, &target,
+				&ClientRequest::from("DELETE", &[("Target", &target)]), Coalesce::Supersede)?;
+		}
+		add_journal_entry(&conn, "missing", &ClientRequest::new("DELETE"), Coalesce::Supersede)?;
+
+		// The server remembers the keys it has seen. In the first session it carries out the
+		// sixth command and then drops the connection without answering.
+		let applied = Arc::new(Mutex::new(Vec::<String>::new()));
+		let keys = Arc::new(Mutex::new(HashSet::<String>::new()));
+		let (server_applied, server_keys) = (applied.clone(), keys.clone());
+		let server = TestServer::start(move |req, conn| {
+			let target = match req.data.get("Target") {
+				Some(v) => v.clone(),
+				None => {
+					TestServer::send(conn, &TestServer::response(404, "RESOURCE NOT FOUND", &[]))?;
+					return Ok(true)
+				}
+			};
+
+			let mut keys = server_keys.lock().unwrap();
+			if keys.insert(req.data[JOURNAL_KEY_FIELD].clone()) {
+				server_applied.lock().unwrap().push(target);
+				if keys.len() == 6 {
+					return Ok(false)
+				}
+			}
+			drop(keys);
+
+			TestServer::send(conn, &TestServer::response(200, "OK", &[]))?;
+			Ok(true)
+		});
+
+		let mut sock = ServerConnection::new();
+		sock.connect(&server.address, &server.port)?;
+		if replay_journal(&conn, sock.get_socket()?, 4).is_ok() {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: replay didn't report dropped connection", testname)))
+		}
+
+		sock.connect(&server.address, &server.port)?;
+		let result = replay_journal(&conn, sock.get_socket()?, 4)?;
+		if result.remaining != 0 || result.rejected.len() != 1
+			|| result.rejected[0].0.target != "missing" {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: bad replay result: {:?}", testname, result)))
+		}
+
+		let applied = applied.lock().unwrap();
+		let unique: HashSet<&String> = applied.iter().collect();
+		if applied.len() != 10 || unique.len() != 10 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: commands not applied exactly once: {:?}", testname, applied)))
+		}
+
+		Ok(())
+	}
+}
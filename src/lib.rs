@@ -1,19 +1,55 @@
 mod auth;
 mod base;
+mod budget;
+mod capture;
+mod changes;
 mod commands;
 mod config;
 mod conn;
 mod dbfs;
+mod dispatch;
+mod download;
+mod folders;
+mod ingest;
+mod journal;
+mod messages;
+mod msgcache;
+mod notify;
+mod outbox;
+mod pool;
+mod prefetch;
 mod profile;
+mod ratelimit;
+mod retry;
+#[cfg(test)]
+mod testutil;
+mod transport;
 mod types;
 mod workspace;
 
 pub use auth::*;
 pub use base::*;
+pub use budget::*;
+pub use capture::*;
+pub use changes::*;
 pub use commands::*;
 pub use config::*;
 pub use conn::*;
 pub use dbfs::*;
+pub use dispatch::*;
+pub use download::*;
+pub use folders::*;
+pub use ingest::*;
+pub use journal::*;
+pub use messages::*;
+pub use msgcache::*;
+pub use notify::*;
+pub use outbox::*;
+pub use pool::*;
+pub use prefetch::*;
 pub use profile::*;
+pub use ratelimit::*;
+pub use retry::*;
+pub use transport::*;
 pub use types::*;
 pub use workspace::*;
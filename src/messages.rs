@@ -0,0 +1,668 @@
+//! The messages module provides storage for messages in the profile's storage database
+
+use libkeycard::*;
+use rusqlite;
+use serde::{Deserialize, Serialize};
+use crate::base::*;
+use crate::changes::*;
+use crate::folders::*;
+use crate::msgcache::*;
+
+/// Message is the decrypted, parsed form of a Mensago message. The `address` field is the
+/// workspace address of the local workspace which owns the message, not that of the sender.
+#[derive(Debug, Clone, PartialEq, Serialize, Deserialize)]
+pub struct Message {
+	pub id: String,
+	pub from: String,
+	#[serde(default)]
+	pub address: String,
+	#[serde(default)]
+	pub cc: Option<String>,
+	#[serde(default)]
+	pub bcc: Option<String>,
+	pub date: String,
+	pub thread_id: String,
+	#[serde(default)]
+	pub subject: Option<String>,
+	#[serde(default)]
+	pub body: Option<String>,
+	#[serde(default)]
+	pub attachments: Option<String>,
+}
+
+impl Message {
+
+	/// Parses a message from its serialized JSON form
+	pub fn from_bytes(data: &[u8]) -> Result<Message, MensagoError> {
+		let msg: Message = serde_json::from_slice(data)?;
+
+		if RandomID::from(&msg.id).is_none() || RandomID::from(&msg.thread_id).is_none() {
+			return Err(MensagoError::ErrBadValue)
+		}
+		if msg.from.len() == 0 || msg.date.len() == 0 {
+			return Err(MensagoError::ErrEmptyData)
+		}
+
+		Ok(msg)
+	}
+}
+
+/// The folder new messages are stored in unless another is specified
+pub const INBOX_FOLDER: &str = "inbox";
+
+/// Message flag set once the user has read the message
+pub const MSG_FLAG_SEEN: i64 = 1;
+
+/// Message flag set when the user has flagged the message for follow-up
+pub const MSG_FLAG_FLAGGED: i64 = 2;
+
+/// Message flag set once the user has replied to the message
+pub const MSG_FLAG_ANSWERED: i64 = 4;
+
+/// Message flag set on messages which are drafts and haven't been sent
+pub const MSG_FLAG_DRAFT: i64 = 8;
+
+/// Message flag set on messages which have been moved to the trash and are waiting to be purged
+pub const MSG_FLAG_DELETED: i64 = 16;
+
+/// MessageFilter selects messages for `find_messages()`. Messages must be in `folder` and have
+/// `label` if those are given, must have every flag in `with_flags`, and must have none of the
+/// flags in `without_flags`.
+///
+/// The unread and flagged filters, a `without_flags` of MSG_FLAG_SEEN and a `with_flags` of
+/// MSG_FLAG_FLAGGED, have partial indexes of their own, so they stay fast in large folders.
+#[derive(Debug, Clone, Default, PartialEq)]
+pub struct MessageFilter {
+	pub folder: Option<String>,
+	pub label: Option<String>,
+	pub with_flags: i64,
+	pub without_flags: i64,
+}
+
+/// MessageHeader is the part of a message needed to show it in a message list. It includes a
+/// short plaintext preview of the body, so listing messages never has to load the bodies.
+#[derive(Debug, Clone, PartialEq)]
+pub struct MessageHeader {
+	pub id: String,
+	pub from: String,
+	pub address: String,
+	pub date: String,
+	pub thread_id: String,
+	pub subject: Option<String>,
+	pub preview: Option<String>,
+	pub has_attachments: bool,
+	pub flags: i64,
+}
+
+/// The longest preview stored for a message, in characters
+pub const PREVIEW_LENGTH: usize = 160;
+
+/// Returns a short plaintext preview of a message body: its first lines, skipping quoted text,
+/// with runs of whitespace collapsed and cut at a word boundary at PREVIEW_LENGTH characters
+pub fn make_preview(body: &str) -> String {
+
+	let mut out = String::new();
+	let mut count = 0;
+	let mut truncated = false;
+	let words = body.lines()
+		.filter(|line| !line.trim_start().starts_with('>'))
+		.flat_map(|line| line.split_whitespace());
+	for word in words {
+		let length = word.chars().count();
+		let needed = if count == 0 { length } else { length + 1 };
+		if count + needed > PREVIEW_LENGTH {
+			// A single word longer than the preview is cut instead of being left out
+			if count == 0 {
+				out.extend(word.chars().take(PREVIEW_LENGTH));
+			}
+			truncated = true;
+			break
+		}
+		if count > 0 {
+			out.push(' ');
+		}
+		out.push_str(word);
+		count += needed;
+	}
+	if truncated {
+		out.push('…');
+	}
+
+	out
+}
+
+// Returns the size of a message as counted in its folder's totals: the bytes in its body and
+// attachment list, which make up nearly all of a message
+fn get_stored_size(msg: &Message) -> i64 {
+	(msg.body.as_ref().map_or(0, |v| v.len()) + msg.attachments.as_ref().map_or(0, |v| v.len()))
+		as i64
+}
+
+// Returns true if a message's attachment list has anything in it
+fn has_attachments(attachments: Option<&str>) -> bool {
+	match attachments.map(|v| v.trim()) {
+		None | Some("") | Some("[]") => false,
+		Some(_) => true,
+	}
+}
+
+/// Adds a message to the database
+pub fn add_message(conn: &rusqlite::Connection, msg: &Message) -> Result<(), MensagoError> {
+	add_messages(conn, std::slice::from_ref(msg))
+}
+
+/// Adds a batch of messages to the inbox in a single transaction. Either all of the messages
+/// are added or none of them are.
+pub fn add_messages(conn: &rusqlite::Connection, msgs: &[Message]) -> Result<(), MensagoError> {
+	add_messages_to_folder(conn, INBOX_FOLDER, msgs)
+}
+
+/// Adds a batch of unread messages to the specified folder in a single transaction. Either all of
+/// the messages are added or none of them are.
+pub fn add_messages_to_folder(conn: &rusqlite::Connection, folder: &str, msgs: &[Message])
+-> Result<(), MensagoError> {
+
+	if msgs.len() == 0 {
+		return Ok(())
+	}
+
+	let tx = conn.unchecked_transaction()?;
+	let mut counts = FolderCounts::default();
+	{
+		let mut stmt = tx.prepare(r#"INSERT INTO messages(id,"from",address,cc,bcc,date,thread_id,
+			subject,body,attachments,preview,has_attachments,folder,flags,size)
+			VALUES(?1,?2,?3,?4,?5,?6,?7,?8,?9,?10,?11,?12,?13,0,?14)"#)?;
+
+		for msg in msgs {
+			let preview = msg.body.as_deref().map(make_preview);
+			let size = get_stored_size(msg);
+			match stmt.execute(rusqlite::params![msg.id, msg.from, msg.address, msg.cc, msg.bcc,
+				msg.date, msg.thread_id, msg.subject, msg.body, msg.attachments, preview,
+				has_attachments(msg.attachments.as_deref()), folder, size]) {
+				Ok(_) => (),
+				Err(e) => {
+					return Err(MensagoError::ErrDatabaseException(e.to_string()))
+				}
+			}
+			counts.add(&FolderCounts::for_message(0, size));
+		}
+	}
+	adjust_folder_counts(&tx, folder, &counts)?;
+	note_change(&tx, CHANGE_MESSAGES)?;
+
+	match tx.commit() {
+		Ok(_) => {
+			invalidate_cached_messages(msgs.iter().map(|m| m.id.as_str()));
+			Ok(())
+		},
+		Err(e) => Err(MensagoError::ErrDatabaseException(e.to_string()))
+	}
+}
+
+/// Gets a message from the database
+pub fn get_message(conn: &rusqlite::Connection, id: &RandomID) -> Result<Message, MensagoError> {
+
+	let mut stmt = conn.prepare(r#"SELECT "from",address,cc,bcc,date,thread_id,subject,body,
+		attachments FROM messages WHERE id=?1"#)?;
+
+	let mut rows = stmt.query([id.as_string()])?;
+
+	let option_row = match rows.next() {
+		Ok(v) => v,
+		Err(e) => {
+			return Err(MensagoError::ErrDatabaseException(e.to_string()))
+		}
+	};
+
+	let row = match option_row {
+		Some(v) => v,
+		None => { return Err(MensagoError::ErrNotFound) }
+	};
+
+	Ok(Message {
+		id: String::from(id.as_string()),
+		from: row.get::<usize,String>(0)?,
+		address: row.get::<usize,String>(1)?,
+		cc: row.get::<usize,Option<String>>(2)?,
+		bcc: row.get::<usize,Option<String>>(3)?,
+		date: row.get::<usize,String>(4)?,
+		thread_id: row.get::<usize,String>(5)?,
+		subject: row.get::<usize,Option<String>>(6)?,
+		body: row.get::<usize,Option<String>>(7)?,
+		attachments: row.get::<usize,Option<String>>(8)?,
+	})
+}
+
+/// Returns the headers of the newest messages in the database, skipping the first `offset` of
+/// them. Bodies aren't read.
+pub fn get_message_headers(conn: &rusqlite::Connection, offset: usize, limit: usize)
+-> Result<Vec<MessageHeader>, MensagoError> {
+
+	let mut stmt = conn.prepare(r#"SELECT id,"from",address,date,thread_id,subject,preview,
+		has_attachments,flags FROM messages ORDER BY date DESC LIMIT ?1 OFFSET ?2"#)?;
+	let mut rows = stmt.query(rusqlite::params![limit as i64, offset as i64])?;
+	read_headers(&mut rows)
+}
+
+/// Returns the headers of the messages in a thread, oldest first. Bodies aren't read.
+pub fn get_thread_headers(conn: &rusqlite::Connection, thread_id: &RandomID)
+-> Result<Vec<MessageHeader>, MensagoError> {
+
+	let mut stmt = conn.prepare(r#"SELECT id,"from",address,date,thread_id,subject,preview,
+		has_attachments,flags FROM messages WHERE thread_id=?1 ORDER BY date"#)?;
+	let mut rows = stmt.query([thread_id.as_string()])?;
+	read_headers(&mut rows)
+}
+
+// Reads MessageHeaders from the rows of a query selecting the columns in the order above
+fn read_headers(rows: &mut rusqlite::Rows) -> Result<Vec<MessageHeader>, MensagoError> {
+
+	let mut out = Vec::new();
+	while let Some(row) = rows.next()? {
+		out.push(MessageHeader {
+			id: row.get::<usize,String>(0)?,
+			from: row.get::<usize,String>(1)?,
+			address: row.get::<usize,String>(2)?,
+			date: row.get::<usize,String>(3)?,
+			thread_id: row.get::<usize,String>(4)?,
+			subject: row.get::<usize,Option<String>>(5)?,
+			preview: row.get::<usize,Option<String>>(6)?,
+			has_attachments: row.get::<usize,bool>(7)?,
+			flags: row.get::<usize,i64>(8)?,
+		});
+	}
+	Ok(out)
+}
+
+// The label table and flag indexes for databases created before they existed. The partial
+// indexes' conditions must match the terms find_messages() generates exactly.
+static MESSAGE_LABELS_SETUP_COMMANDS: &str = "
+	CREATE TABLE 'message_labels' (
+		'label' TEXT NOT NULL,
+		'msgid' TEXT NOT NULL,
+		PRIMARY KEY('label','msgid')
+	) WITHOUT ROWID;
+	CREATE INDEX 'message_labels_msgid' ON 'message_labels'('msgid');
+	CREATE INDEX 'messages_unread' ON 'messages'('folder','date') WHERE (flags & 1)=0;
+	CREATE INDEX 'messages_flagged' ON 'messages'('date') WHERE (flags & 2)!=0;";
+
+/// Brings the messages table of a storage database created by an older version up to date. New
+/// columns are filled in for the messages already stored. This does nothing to databases which
+/// are already current.
+pub fn update_message_schema(conn: &rusqlite::Connection) -> Result<(), MensagoError> {
+
+	let mut columns = Vec::<String>::new();
+	{
+		let mut stmt = conn.prepare("PRAGMA table_info('messages')")?;
+		let mut rows = stmt.query([])?;
+		while let Some(row) = rows.next()? {
+			columns.push(row.get::<usize,String>(1)?);
+		}
+	}
+
+	let tx = conn.unchecked_transaction()?;
+	if !columns.iter().any(|c| c == "preview") {
+		tx.execute("ALTER TABLE messages ADD COLUMN 'preview' TEXT", [])?;
+		tx.execute(
+			"ALTER TABLE messages ADD COLUMN 'has_attachments' INTEGER NOT NULL DEFAULT 0", [])?;
+
+		let mut select = tx.prepare("SELECT id,body,attachments FROM messages")?;
+		let mut update = tx.prepare(
+			"UPDATE messages SET preview=?2,has_attachments=?3 WHERE id=?1")?;
+		let mut rows = select.query([])?;
+		while let Some(row) = rows.next()? {
+			let flag = has_attachments(row.get::<usize,Option<String>>(2)?.as_deref());
+			let preview = row.get::<usize,Option<String>>(1)?.as_deref().map(make_preview);
+			update.execute(rusqlite::params![row.get::<usize,String>(0)?, preview, flag])?;
+		}
+		tx.execute("CREATE INDEX 'messages_date' ON 'messages'('date')", [])?;
+		tx.execute("CREATE INDEX 'messages_thread' ON 'messages'('thread_id','date')", [])?;
+	}
+	if !columns.iter().any(|c| c == "folder") {
+		tx.execute(&format!("ALTER TABLE messages ADD COLUMN 'folder' TEXT NOT NULL DEFAULT '{}'",
+			INBOX_FOLDER), [])?;
+		tx.execute("ALTER TABLE messages ADD COLUMN 'flags' INTEGER NOT NULL DEFAULT 0", [])?;
+		tx.execute("ALTER TABLE messages ADD COLUMN 'size' INTEGER NOT NULL DEFAULT 0", [])?;
+		tx.execute("UPDATE messages SET size=coalesce(length(CAST(body AS BLOB)),0)
+			+ coalesce(length(CAST(attachments AS BLOB)),0)", [])?;
+		tx.execute("CREATE INDEX 'messages_folder' ON 'messages'('folder','date')", [])?;
+		tx.execute("CREATE TABLE IF NOT EXISTS 'folder_counters'(
+			'folder' TEXT NOT NULL PRIMARY KEY, 'total' INTEGER NOT NULL,
+			'unread' INTEGER NOT NULL, 'flagged' INTEGER NOT NULL, 'size' INTEGER NOT NULL)", [])?;
+		fill_folder_counters(&tx)?;
+	}
+	let has_labels = tx
+		.prepare("SELECT name FROM sqlite_master WHERE type='table' AND name='message_labels'")?
+		.exists([])?;
+	if !has_labels {
+		tx.execute_batch(MESSAGE_LABELS_SETUP_COMMANDS)?;
+	}
+
+	match tx.commit() {
+		Ok(_) => Ok(()),
+		Err(e) => Err(MensagoError::ErrDatabaseException(e.to_string()))
+	}
+}
+
+/// Returns the headers of the newest messages in a folder, skipping the first `offset` of them.
+/// Bodies aren't read.
+pub fn get_folder_headers(conn: &rusqlite::Connection, folder: &str, offset: usize,
+	limit: usize) -> Result<Vec<MessageHeader>, MensagoError> {
+
+	let mut stmt = conn.prepare(r#"SELECT id,"from",address,date,thread_id,subject,preview,
+		has_attachments,flags FROM messages WHERE folder=?1 ORDER BY date DESC
+		LIMIT ?2 OFFSET ?3"#)?;
+	let mut rows = stmt.query(rusqlite::params![folder, limit as i64, offset as i64])?;
+	read_headers(&mut rows)
+}
+
+/// Returns the headers of the newest messages matching a filter, skipping the first `offset` of
+/// them. Bodies aren't read.
+pub fn find_messages(conn: &rusqlite::Connection, filter: &MessageFilter, offset: usize,
+	limit: usize) -> Result<Vec<MessageHeader>, MensagoError> {
+
+	let mut sql = String::from(r#"SELECT m.id,m."from",m.address,m.date,m.thread_id,m.subject,
+		m.preview,m.has_attachments,m.flags FROM messages m"#);
+	let mut params = Vec::<&str>::new();
+	if let Some(label) = filter.label.as_ref() {
+		sql.push_str(" JOIN message_labels l ON l.msgid=m.id AND l.label=?");
+		params.push(label);
+	}
+	sql.push_str(" WHERE 1");
+	if let Some(folder) = filter.folder.as_ref() {
+		sql.push_str(" AND m.folder=?");
+		params.push(folder);
+	}
+
+	// Each flag is tested with its own literal term because SQLite only uses a partial index
+	// when the query contains the index's condition as written
+	for bit in 0..63 {
+		let flag = 1i64 << bit;
+		if filter.with_flags & flag != 0 {
+			sql.push_str(&format!(" AND (m.flags & {})!=0", flag));
+		}
+		if filter.without_flags & flag != 0 {
+			sql.push_str(&format!(" AND (m.flags & {})=0", flag));
+		}
+	}
+	sql.push_str(&format!(" ORDER BY m.date DESC LIMIT {} OFFSET {}", limit, offset));
+
+	let mut stmt = conn.prepare(&sql)?;
+	let params: Vec<&dyn rusqlite::ToSql> = params.iter()
+		.map(|v| v as &dyn rusqlite::ToSql)
+		.collect();
+	let mut rows = stmt.query(&params[..])?;
+	read_headers(&mut rows)
+}
+
+/// Adds a label to a message. Adding a label the message already has does nothing.
+pub fn add_message_label(conn: &rusqlite::Connection, id: &RandomID, label: &str)
+-> Result<(), MensagoError> {
+
+	if label.len() == 0 {
+		return Err(MensagoError::ErrEmptyData)
+	}
+
+	let tx = conn.unchecked_transaction()?;
+	get_message_state(&tx, id)?;
+	if tx.execute("INSERT OR IGNORE INTO message_labels(label,msgid) VALUES(?1,?2)",
+		[label, id.as_string()])? > 0 {
+		note_change(&tx, CHANGE_MESSAGES)?;
+	}
+
+	match tx.commit() {
+		Ok(_) => Ok(()),
+		Err(e) => Err(MensagoError::ErrDatabaseException(e.to_string()))
+	}
+}
+
+/// Removes a label from a message
+pub fn remove_message_label(conn: &rusqlite::Connection, id: &RandomID, label: &str)
+-> Result<(), MensagoError> {
+
+	match conn.execute("DELETE FROM message_labels WHERE label=?1 AND msgid=?2",
+		[label, id.as_string()]) {
+		Ok(0) => Err(MensagoError::ErrNotFound),
+		Ok(_) => note_change(conn, CHANGE_MESSAGES),
+		Err(e) => Err(MensagoError::ErrDatabaseException(e.to_string()))
+	}
+}
+
+/// Returns the labels on a message, sorted by name
+pub fn get_message_labels(conn: &rusqlite::Connection, id: &RandomID)
+-> Result<Vec<String>, MensagoError> {
+
+	let mut stmt = conn.prepare(
+		"SELECT label FROM message_labels WHERE msgid=?1 ORDER BY label")?;
+	let mut rows = stmt.query([id.as_string()])?;
+	let mut out = Vec::new();
+	while let Some(row) = rows.next()? {
+		out.push(row.get::<usize,String>(0)?);
+	}
+	Ok(out)
+}
+
+/// Returns the flags of a message, such as MSG_FLAG_SEEN
+pub fn get_message_flags(conn: &rusqlite::Connection, id: &RandomID)
+-> Result<i64, MensagoError> {
+	Ok(get_message_state(conn, id)?.1)
+}
+
+/// Sets the flags in `set` and clears those in `clear` on a message, updating its folder's
+/// counters in the same transaction
+pub fn set_message_flags(conn: &rusqlite::Connection, id: &RandomID, set: i64, clear: i64)
+-> Result<(), MensagoError> {
+
+	let tx = conn.unchecked_transaction()?;
+	let (folder, oldflags, size) = get_message_state(&tx, id)?;
+	let newflags = (oldflags | set) & !clear;
+	if newflags == oldflags {
+		return Ok(())
+	}
+
+	tx.execute("UPDATE messages SET flags=?2 WHERE id=?1",
+		rusqlite::params![id.as_string(), newflags])?;
+	let mut delta = FolderCounts::for_message(newflags, size);
+	delta.add(&FolderCounts::for_message(oldflags, size).negate());
+	adjust_folder_counts(&tx, &folder, &delta)?;
+	note_change(&tx, CHANGE_MESSAGES)?;
+
+	match tx.commit() {
+		Ok(_) => Ok(()),
+		Err(e) => Err(MensagoError::ErrDatabaseException(e.to_string()))
+	}
+}
+
+/// Moves a message to another folder, updating both folders' counters in the same transaction
+pub fn move_message(conn: &rusqlite::Connection, id: &RandomID, folder: &str)
+-> Result<(), MensagoError> {
+
+	if folder.len() == 0 {
+		return Err(MensagoError::ErrEmptyData)
+	}
+
+	let tx = conn.unchecked_transaction()?;
+	let (oldfolder, flags, size) = get_message_state(&tx, id)?;
+	if oldfolder == folder {
+		return Ok(())
+	}
+
+	tx.execute("UPDATE messages SET folder=?2 WHERE id=?1",
+		rusqlite::params![id.as_string(), folder])?;
+	let counts = FolderCounts::for_message(flags, size);
+	adjust_folder_counts(&tx, &oldfolder, &counts.negate())?;
+	adjust_folder_counts(&tx, folder, &counts)?;
+	note_change(&tx, CHANGE_MESSAGES)?;
+
+	match tx.commit() {
+		Ok(_) => Ok(()),
+		Err(e) => Err(MensagoError::ErrDatabaseException(e.to_string()))
+	}
+}
+
+/// Stores the body of a message, such as one whose body was downloaded after its header, and
+/// updates its preview and its folder's size in the same transaction
+pub fn set_message_body(conn: &rusqlite::Connection, id: &RandomID, body: &str)
+-> Result<(), MensagoError> {
+
+	let tx = conn.unchecked_transaction()?;
+	let (folder, flags, oldsize) = get_message_state(&tx, id)?;
+	let oldbody = tx.query_row("SELECT body FROM messages WHERE id=?1", [id.as_string()],
+		|row| row.get::<usize,Option<String>>(0))?;
+	let size = oldsize - oldbody.map_or(0, |v| v.len() as i64) + body.len() as i64;
+
+	tx.execute("UPDATE messages SET body=?2,preview=?3,size=?4 WHERE id=?1",
+		rusqlite::params![id.as_string(), body, make_preview(body), size])?;
+	let mut delta = FolderCounts::for_message(flags, size);
+	delta.add(&FolderCounts::for_message(flags, oldsize).negate());
+	adjust_folder_counts(&tx, &folder, &delta)?;
+	note_change(&tx, CHANGE_MESSAGES)?;
+
+	match tx.commit() {
+		Ok(_) => {
+			invalidate_cached_messages([id.as_string()]);
+			Ok(())
+		},
+		Err(e) => Err(MensagoError::ErrDatabaseException(e.to_string()))
+	}
+}
+
+// Returns the folder, flags, and size of a message
+fn get_message_state(conn: &rusqlite::Connection, id: &RandomID)
+-> Result<(String, i64, i64), MensagoError> {
+
+	let mut stmt = conn.prepare("SELECT folder,flags,size FROM messages WHERE id=?1")?;
+	let mut rows = stmt.query([id.as_string()])?;
+	match rows.next()? {
+		Some(row) => Ok((row.get::<usize,String>(0)?, row.get::<usize,i64>(1)?,
+			row.get::<usize,i64>(2)?)),
+		None => Err(MensagoError::ErrNotFound),
+	}
+}
+
+/// Deletes a message from the database
+pub fn remove_message(conn: &rusqlite::Connection, id: &RandomID) -> Result<(), MensagoError> {
+
+	let tx = conn.unchecked_transaction()?;
+	let (folder, flags, size) = get_message_state(&tx, id)?;
+	match tx.execute("DELETE FROM messages WHERE id=?1", [id.as_string()]) {
+		Ok(0) => return Err(MensagoError::ErrNotFound),
+		Ok(_) => (),
+		Err(e) => {
+			return Err(MensagoError::ErrDatabaseException(e.to_string()))
+		}
+	}
+	tx.execute("DELETE FROM message_labels WHERE msgid=?1", [id.as_string()])?;
+	adjust_folder_counts(&tx, &folder, &FolderCounts::for_message(flags, size).negate())?;
+	note_change(&tx, CHANGE_MESSAGES)?;
+
+	match tx.commit() {
+		Ok(_) => {
+			invalidate_cached_messages([id.as_string()]);
+			Ok(())
+		},
+		Err(e) => Err(MensagoError::ErrDatabaseException(e.to_string()))
+	}
+}
+
+#[cfg(test)]
+mod tests {
+	use crate::*;
+	use crate::testutil::*;
+	use libkeycard::*;
+
+	#[test]
+	fn test_make_preview() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_make_preview");
+
+		let preview = make_preview("Hi Corbin,\n\n> quoted reply\n  Lunch   tomorrow?\n");
+		if preview != "Hi Corbin, Lunch tomorrow?" {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: wrong preview '{}'", testname, preview)))
+		}
+
+		let preview = make_preview(&"word ".repeat(100));
+		if preview.chars().count() > PREVIEW_LENGTH + 1 || !preview.ends_with("word…") {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: long body not cut at a word: '{}'", testname, preview)))
+		}
+
+		let preview = make_preview(&"é".repeat(500));
+		if preview.chars().count() != PREVIEW_LENGTH + 1 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: long word not cut: '{}'", testname, preview)))
+		}
+
+		Ok(())
+	}
+
+	#[test]
+	fn test_message_filters() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_message_filters");
+		let conn = open_storage()?;
+
+		let mut ids = Vec::new();
+		for i in 0..6 {
+			let msg = Message {
+				date: format!("2022-07-0{}T12:00:00Z", i + 1),
+				subject: Some(format!("Message {}", i)),
+				..make_message("body")
+			};
+			add_message(&conn, &msg)?;
+			ids.push(RandomID::from(&msg.id).unwrap());
+		}
+
+		// Messages 0-2 are read, 1 and 4 are flagged, 4 and 5 are archived, and 2 and 5 are
+		// labeled
+		for i in 0..3 {
+			set_message_flags(&conn, &ids[i], MSG_FLAG_SEEN, 0)?;
+		}
+		set_message_flags(&conn, &ids[1], MSG_FLAG_FLAGGED, 0)?;
+		set_message_flags(&conn, &ids[4], MSG_FLAG_FLAGGED, 0)?;
+		move_message(&conn, &ids[4], "archive")?;
+		move_message(&conn, &ids[5], "archive")?;
+		add_message_label(&conn, &ids[2], "work")?;
+		add_message_label(&conn, &ids[5], "work")?;
+		add_message_label(&conn, &ids[5], "travel")?;
+
+		let find = |folder: Option<&str>, label: Option<&str>, with: i64, without: i64| {
+			let filter = MessageFilter {
+				folder: folder.map(String::from),
+				label: label.map(String::from),
+				with_flags: with,
+				without_flags: without,
+			};
+			find_messages(&conn, &filter, 0, 100).map(|headers| {
+				headers.iter().map(|h| h.subject.clone().unwrap()).collect::<Vec<String>>()
+			})
+		};
+
+		let checks = [
+			(find(Some(INBOX_FOLDER), None, 0, MSG_FLAG_SEEN)?, vec!["Message 3"]),
+			(find(None, None, MSG_FLAG_FLAGGED, 0)?, vec!["Message 4", "Message 1"]),
+			(find(None, Some("work"), 0, 0)?, vec!["Message 5", "Message 2"]),
+			(find(Some("archive"), Some("work"), 0, MSG_FLAG_SEEN)?, vec!["Message 5"]),
+		];
+		for (i, (found, expected)) in checks.iter().enumerate() {
+			if found != expected {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: filter {} found {:?}", testname, i, found)))
+			}
+		}
+
+		// Labels go away with their message
+		if get_message_labels(&conn, &ids[5])? != vec!["travel", "work"] {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: wrong labels on message", testname)))
+		}
+		remove_message(&conn, &ids[5])?;
+		if find(None, Some("travel"), 0, 0)?.len() != 0 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: labels left behind by deleted message", testname)))
+		}
+
+		Ok(())
+	}
+}
@@ -0,0 +1,411 @@
+//! The msgcache module keeps recently opened messages in memory so that going back to one, which
+//! users do constantly when moving around the message list, doesn't touch the database again.
+//!
+//! Entries are invalidated by the message write path itself: `add_messages()` and
+//! `remove_message()` notify every live MessageCache in the process. Changes made by other
+//! processes are not seen this way, so a cache should be cleared when `Profile::refresh()` reports
+//! CHANGE_MESSAGES.
+
+use libkeycard::*;
+use rusqlite;
+use std::collections::{BTreeMap, HashMap};
+use std::sync::{Arc, Mutex, MutexGuard, Weak};
+use std::sync::atomic::{AtomicU64, Ordering};
+use crate::base::*;
+use crate::budget::*;
+use crate::messages::*;
+
+// Every live cache, so that the message write path can invalidate entries without being handed
+// a cache. Message IDs are random, so invalidating an ID in another profile's cache is harmless.
+static MESSAGE_CACHES: Mutex<Vec<Weak<MessageCache>>> = Mutex::new(Vec::new());
+
+/// Hit and miss counts and current size of a MessageCache
+#[derive(Debug, Clone, PartialEq)]
+pub struct CacheStats {
+	pub hits: u64,
+	pub misses: u64,
+	pub evictions: u64,
+	pub invalidations: u64,
+	pub entries: usize,
+	pub bytes: usize,
+}
+
+impl CacheStats {
+
+	/// Returns the fraction of lookups which were found in the cache
+	pub fn hit_rate(&self) -> f64 {
+		let total = self.hits + self.misses;
+		if total > 0 { self.hits as f64 / total as f64 } else { 0.0 }
+	}
+}
+
+struct CacheEntry {
+	msg: Arc<Message>,
+	size: usize,
+	tick: u64,
+}
+
+struct CacheState {
+	entries: HashMap<String, CacheEntry>,
+	// Entries by the time they were last used, oldest first
+	order: BTreeMap<u64, String>,
+	bytes: usize,
+	clock: u64,
+	// Bumped on every invalidation so that a load which raced with a write isn't cached
+	generation: u64,
+}
+
+impl CacheState {
+
+	fn remove(&mut self, id: &str) -> bool {
+		match self.entries.remove(id) {
+			Some(entry) => {
+				self.order.remove(&entry.tick);
+				self.bytes -= entry.size;
+				true
+			},
+			None => false,
+		}
+	}
+
+	fn pop_oldest(&mut self) -> usize {
+		let id = match self.order.iter().next() {
+			Some((_, v)) => v.clone(),
+			None => return 0,
+		};
+		let size = self.entries.get(&id).map(|e| e.size).unwrap_or(0);
+		self.remove(&id);
+		size
+	}
+}
+
+/// MessageCache is a bounded, thread-safe cache of decoded messages keyed by message ID. When it
+/// is full, the least recently used messages are dropped. Messages are handed out as Arcs so that
+/// a cache hit doesn't copy the message.
+pub struct MessageCache {
+	state: Mutex<CacheState>,
+	max_entries: usize,
+	max_bytes: usize,
+	hits: AtomicU64,
+	misses: AtomicU64,
+	evictions: AtomicU64,
+	invalidations: AtomicU64,
+	budget: Mutex<Option<(Arc<MemoryBudget>, u64)>>,
+}
+
+impl MessageCache {
+
+	/// Creates a new cache holding at most the specified number of messages and bytes. A limit of
+	/// 0 means unlimited.
+	pub fn new(max_entries: usize, max_bytes: usize) -> Arc<MessageCache> {
+
+		let out = Arc::new(MessageCache {
+			state: Mutex::new(CacheState {
+				entries: HashMap::new(),
+				order: BTreeMap::new(),
+				bytes: 0,
+				clock: 0,
+				generation: 0,
+			}),
+			max_entries,
+			max_bytes,
+			hits: AtomicU64::new(0),
+			misses: AtomicU64::new(0),
+			evictions: AtomicU64::new(0),
+			invalidations: AtomicU64::new(0),
+			budget: Mutex::new(None),
+		});
+
+		let mut caches = lock(&MESSAGE_CACHES);
+		caches.retain(|c| c.strong_count() > 0);
+		caches.push(Arc::downgrade(&out));
+
+		out
+	}
+
+	/// Adds the cache to a memory budget, which may shrink it when the library's caches use too
+	/// much memory
+	pub fn set_budget(self: &Arc<Self>, budget: &Arc<MemoryBudget>, priority: CachePriority) {
+		let cache: Arc<dyn BudgetedCache> = self.clone();
+		let id = budget.register("messages", priority, &cache);
+		if let Some((old, oldid)) = lock(&self.budget).replace((budget.clone(), id)) {
+			old.unregister(oldid);
+		}
+	}
+
+	/// Returns the message with the specified ID, loading it from the database if it isn't
+	/// cached
+	pub fn get(&self, conn: &rusqlite::Connection, id: &RandomID)
+	-> Result<Arc<Message>, MensagoError> {
+
+		let generation = {
+			let mut state = lock(&self.state);
+			if let Some(msg) = touch_entry(&mut state, id.as_string()) {
+				drop(state);
+				self.hits.fetch_add(1, Ordering::Relaxed);
+				self.touch_budget();
+				return Ok(msg)
+			}
+			state.generation
+		};
+		self.misses.fetch_add(1, Ordering::Relaxed);
+
+		let msg = Arc::new(get_message(conn, id)?);
+		self.insert_arc(msg.clone(), generation);
+		Ok(msg)
+	}
+
+	/// Returns the message with the specified ID if it is cached
+	pub fn lookup(&self, id: &str) -> Option<Arc<Message>> {
+		let msg = touch_entry(&mut lock(&self.state), id);
+		match msg {
+			Some(_) => {
+				self.hits.fetch_add(1, Ordering::Relaxed);
+				self.touch_budget();
+			},
+			None => { self.misses.fetch_add(1, Ordering::Relaxed); },
+		}
+		msg
+	}
+
+	/// Returns true if the message with the specified ID is cached. This doesn't count as a use.
+	pub fn contains(&self, id: &str) -> bool {
+		lock(&self.state).entries.contains_key(id)
+	}
+
+	/// Returns the message with the specified ID if it is cached. Unlike `lookup()`, this doesn't
+	/// count as a use, so it is meant for background work such as prefetching.
+	pub fn peek(&self, id: &str) -> Option<Arc<Message>> {
+		lock(&self.state).entries.get(id).map(|e| e.msg.clone())
+	}
+
+	/// Adds a message which was decoded elsewhere to the cache
+	pub fn insert(&self, msg: Message) -> Arc<Message> {
+		let generation = lock(&self.state).generation;
+		let msg = Arc::new(msg);
+		self.insert_arc(msg.clone(), generation);
+		msg
+	}
+
+	/// Removes the message with the specified ID from the cache
+	pub fn invalidate(&self, id: &str) {
+		let mut state = lock(&self.state);
+		state.generation += 1;
+		if state.remove(id) {
+			self.invalidations.fetch_add(1, Ordering::Relaxed);
+		}
+	}
+
+	/// Removes all messages from the cache
+	pub fn clear(&self) {
+		let mut state = lock(&self.state);
+		state.generation += 1;
+		let count = state.entries.len() as u64;
+		state.entries.clear();
+		state.order.clear();
+		state.bytes = 0;
+		self.invalidations.fetch_add(count, Ordering::Relaxed);
+	}
+
+	/// Returns the cache's hit and miss counts and its current size
+	pub fn get_stats(&self) -> CacheStats {
+		let state = lock(&self.state);
+		CacheStats {
+			hits: self.hits.load(Ordering::Relaxed),
+			misses: self.misses.load(Ordering::Relaxed),
+			evictions: self.evictions.load(Ordering::Relaxed),
+			invalidations: self.invalidations.load(Ordering::Relaxed),
+			entries: state.entries.len(),
+			bytes: state.bytes,
+		}
+	}
+
+	// Adds a message unless the cache was invalidated since the specified generation, in which
+	// case the message may already be out of date
+	fn insert_arc(&self, msg: Arc<Message>, generation: u64) {
+
+		let size = get_message_size(&msg);
+		{
+			let mut state = lock(&self.state);
+			if state.generation != generation {
+				return
+			}
+
+			state.remove(&msg.id);
+			state.clock += 1;
+			let tick = state.clock;
+			state.order.insert(tick, msg.id.clone());
+			state.entries.insert(msg.id.clone(), CacheEntry { msg, size, tick });
+			state.bytes += size;
+
+			let mut evicted = 0;
+			while state.entries.len() > 1
+				&& ((self.max_entries > 0 && state.entries.len() > self.max_entries)
+					|| (self.max_bytes > 0 && state.bytes > self.max_bytes)) {
+				state.pop_oldest();
+				evicted += 1;
+			}
+			self.evictions.fetch_add(evicted, Ordering::Relaxed);
+		}
+
+		// The budget calls back into the cache, so our lock must be released first
+		if let Some((budget, id)) = lock(&self.budget).clone() {
+			budget.touch(id);
+			budget.enforce();
+		}
+	}
+
+	fn touch_budget(&self) {
+		if let Some((budget, id)) = lock(&self.budget).as_ref() {
+			budget.touch(*id);
+		}
+	}
+}
+
+impl BudgetedCache for MessageCache {
+
+	fn get_memory_usage(&self) -> usize {
+		lock(&self.state).bytes
+	}
+
+	fn shrink(&self, bytes: usize) -> usize {
+		let mut state = lock(&self.state);
+		let mut freed = 0;
+		let mut evicted = 0;
+		while freed < bytes && state.entries.len() > 0 {
+			freed += state.pop_oldest();
+			evicted += 1;
+		}
+		self.evictions.fetch_add(evicted, Ordering::Relaxed);
+		freed
+	}
+}
+
+/// Removes the messages with the specified IDs from every MessageCache in the process. This is
+/// called by the functions which change messages in the database.
+pub fn invalidate_cached_messages<'a, I>(ids: I)
+where I: IntoIterator<Item = &'a str> + Clone {
+
+	let caches: Vec<Arc<MessageCache>> = {
+		let mut caches = lock(&MESSAGE_CACHES);
+		caches.retain(|c| c.strong_count() > 0);
+		caches.iter().filter_map(|c| c.upgrade()).collect()
+	};
+
+	for cache in caches {
+		for id in ids.clone() {
+			cache.invalidate(id);
+		}
+	}
+}
+
+// Looks up a message and marks it as the most recently used
+fn touch_entry(state: &mut CacheState, id: &str) -> Option<Arc<Message>> {
+
+	state.clock += 1;
+	let tick = state.clock;
+	let entry = state.entries.get_mut(id)?;
+	let oldtick = entry.tick;
+	entry.tick = tick;
+	let msg = entry.msg.clone();
+	let id = state.order.remove(&oldtick)?;
+	state.order.insert(tick, id);
+	Some(msg)
+}
+
+// Returns an estimate of how much memory a message takes up, in bytes
+fn get_message_size(msg: &Message) -> usize {
+	let optional = |v: &Option<String>| v.as_ref().map(|s| s.len()).unwrap_or(0);
+	std::mem::size_of::<Message>() + msg.id.len() * 2 + msg.from.len() + msg.address.len()
+		+ msg.date.len() + msg.thread_id.len() + optional(&msg.cc) + optional(&msg.bcc)
+		+ optional(&msg.subject) + optional(&msg.body) + optional(&msg.attachments)
+}
+
+fn lock<T>(mutex: &Mutex<T>) -> MutexGuard<'_, T> {
+	match mutex.lock() {
+		Ok(v) => v,
+		Err(e) => e.into_inner(),
+	}
+}
+
+#[cfg(test)]
+mod tests {
+	use crate::*;
+	use crate::testutil::*;
+	use libkeycard::*;
+	use std::sync::Arc;
+
+	#[test]
+	fn test_message_cache() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_message_cache");
+		let conn = open_storage()?;
+		let cache = MessageCache::new(10, 0);
+
+		let msg = make_message("This is a test message body");
+		add_message(&conn, &msg)?;
+		let id = RandomID::from(&msg.id).unwrap();
+
+		let first = cache.get(&conn, &id)?;
+		let second = cache.get(&conn, &id)?;
+		let stats = cache.get_stats();
+		if !Arc::ptr_eq(&first, &second) || stats.hits != 1 || stats.misses != 1 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: second get not served from cache: {:?}", testname, stats)))
+		}
+
+		// Deleting the message drops it from the cache without the cache being told directly
+		remove_message(&conn, &id)?;
+		if cache.contains(&msg.id) {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: deleted message still cached", testname)))
+		}
+		match cache.get(&conn, &id) {
+			Err(MensagoError::ErrNotFound) => (),
+			_ => {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: deleted message returned", testname)))
+			}
+		}
+
+		Ok(())
+	}
+
+	#[test]
+	fn test_message_cache_lru() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_message_cache_lru");
+		let cache = MessageCache::new(2, 0);
+
+		let msgs: Vec<Message> = (0..3).map(|_| make_message("body")).collect();
+		cache.insert(msgs[0].clone());
+		cache.insert(msgs[1].clone());
+
+		// Using the first message makes the second one the oldest
+		cache.lookup(&msgs[0].id);
+		cache.insert(msgs[2].clone());
+		if !cache.contains(&msgs[0].id) || cache.contains(&msgs[1].id)
+			|| cache.get_stats().evictions != 1 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: wrong message evicted", testname)))
+		}
+
+		// The write path reaches every cache
+		invalidate_cached_messages([msgs[0].id.as_str()]);
+		if cache.contains(&msgs[0].id) || cache.get_stats().invalidations != 1 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: message not invalidated", testname)))
+		}
+
+		// A memory budget can empty the cache
+		let budget = Arc::new(MemoryBudget::new(0));
+		cache.set_budget(&budget, CachePriority::Normal);
+		if budget.get_memory_usage() == 0 || budget.trim(0) == 0
+			|| cache.get_stats().entries != 0 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: cache not trimmed", testname)))
+		}
+
+		Ok(())
+	}
+}
@@ -0,0 +1,259 @@
+//! The notify module keeps a dedicated connection open to the server so that new updates are pushed
+//! to the client as they arrive instead of being found by polling. If the connection drops, the
+//! listener reconnects, waiting longer between each failed attempt.
+
+use std::sync::{Arc, Mutex};
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::mpsc::{channel, Receiver, RecvTimeoutError, Sender};
+use std::thread;
+use std::time::Duration;
+use crate::base::*;
+use crate::commands::*;
+use crate::conn::*;
+use crate::pool::ConnectionFactory;
+use crate::transport::*;
+
+/// NotifyListener waits for update notifications from a server on its own thread and passes each
+/// one to a callback, which is expected to wake whatever processes updates.
+pub struct NotifyListener {
+	host: String,
+	factory: Arc<ConnectionFactory>,
+	min_backoff: Duration,
+	max_backoff: Duration,
+	stop: Arc<AtomicBool>,
+	socket: Arc<Mutex<Option<Box<dyn Transport>>>>,
+	wake: Option<Sender<()>>,
+	thread: Option<thread::JoinHandle<()>>,
+}
+
+impl NotifyListener {
+
+	/// Creates a new listener. The factory is called with the host string each time a connection
+	/// is needed and is responsible for connecting and logging in.
+	pub fn new<F>(host: &str, factory: F) -> NotifyListener
+	where F: Fn(&str) -> Result<ServerConnection, MensagoError> + Send + Sync + 'static {
+
+		NotifyListener {
+			host: String::from(host),
+			factory: Arc::new(factory),
+			min_backoff: Duration::from_secs(1),
+			max_backoff: Duration::from_secs(300),
+			stop: Arc::new(AtomicBool::new(false)),
+			socket: Arc::new(Mutex::new(None)),
+			wake: None,
+			thread: None,
+		}
+	}
+
+	/// Sets the shortest and longest times to wait before reconnecting. The wait doubles after
+	/// each failed attempt and goes back to the minimum once a connection is made.
+	pub fn set_backoff(&mut self, min: Duration, max: Duration) {
+		self.min_backoff = min;
+		self.max_backoff = max.max(min);
+	}
+
+	/// Returns true if the listener thread is running
+	pub fn is_running(&self) -> bool {
+		self.thread.is_some()
+	}
+
+	/// Starts listening. `on_update` is called with the number of new updates each time the server
+	/// sends a notification. It is also called after each successful connection if updates are
+	/// already waiting, so that those which arrived while disconnected aren't missed.
+	pub fn start<F>(&mut self, on_update: F) -> Result<(), MensagoError>
+	where F: Fn(u64) + Send + 'static {
+
+		if self.thread.is_some() {
+			return Err(MensagoError::ErrExists)
+		}
+
+		let (wake, sleeper) = channel::<()>();
+		self.wake = Some(wake);
+		self.stop.store(false, Ordering::SeqCst);
+
+		let host = self.host.clone();
+		let factory = self.factory.clone();
+		let min_backoff = self.min_backoff;
+		let max_backoff = self.max_backoff;
+		let stop = self.stop.clone();
+		let socket = self.socket.clone();
+		self.thread = Some(thread::spawn(move || {
+			let mut delay = min_backoff;
+			loop {
+				let mut connected = false;
+				let _ = listen(&host, &factory, &stop, &socket, &mut connected, &on_update);
+				if connected {
+					delay = min_backoff;
+				}
+
+				if stop.load(Ordering::SeqCst) || !wait(&sleeper, delay) {
+					break
+				}
+				delay = (delay * 2).min(max_backoff);
+			}
+		}));
+
+		Ok(())
+	}
+
+	/// Stops the listener and waits for its thread to exit
+	pub fn stop(&mut self) {
+
+		self.stop.store(true, Ordering::SeqCst);
+
+		// Shutting the socket down unblocks the read the listener is waiting in and dropping the
+		// channel ends any backoff wait
+		if let Ok(guard) = self.socket.lock() {
+			if let Some(sock) = guard.as_ref() {
+				let _ = sock.shutdown_transport();
+			}
+		}
+		self.wake = None;
+
+		if let Some(handle) = self.thread.take() {
+			let _ = handle.join();
+		}
+	}
+}
+
+impl Drop for NotifyListener {
+	fn drop(&mut self) {
+		self.stop();
+	}
+}
+
+// Sleeps for the specified time. Returns false if the listener was stopped in the meantime.
+fn wait(sleeper: &Receiver<()>, delay: Duration) -> bool {
+	match sleeper.recv_timeout(delay) {
+		Err(RecvTimeoutError::Timeout) => true,
+		_ => false,
+	}
+}
+
+// Connects to the server, switches the connection to notification mode, and passes notifications
+// to the callback until the connection fails or the listener is stopped
+fn listen<F: Fn(u64)>(host: &str, factory: &Arc<ConnectionFactory>, stop: &AtomicBool,
+	socket: &Mutex<Option<Box<dyn Transport>>>, connected: &mut bool, on_update: &F)
+-> Result<(), MensagoError> {
+
+	let mut conn = factory(host)?;
+	let sock = conn.get_socket()?;
+
+	// Keep a handle to the socket so that stop() can interrupt a blocking read. The flag is
+	// checked afterward because stop() may have run while we were connecting.
+	match socket.lock() {
+		Ok(mut guard) => { *guard = Some(sock.try_clone_transport()?) },
+		Err(_) => {
+			return Err(MensagoError::ErrProgramException(
+				String::from("BUG: NotifyListener socket lock poisoned")))
+		}
+	}
+	if stop.load(Ordering::SeqCst) {
+		return Ok(())
+	}
+
+	let result = (|| {
+		let waiting = idle_notify(sock)?;
+		*connected = true;
+		if waiting > 0 {
+			on_update(waiting);
+		}
+
+		while !stop.load(Ordering::SeqCst) {
+			on_update(read_update(sock)?);
+		}
+		Ok(())
+	})();
+
+	if let Ok(mut guard) = socket.lock() {
+		*guard = None;
+	}
+	result
+}
+
+#[cfg(test)]
+mod tests {
+	use crate::*;
+	use crate::commands::testserver::*;
+	use std::sync::Arc;
+	use std::sync::atomic::{AtomicUsize, Ordering};
+	use std::sync::mpsc::channel;
+	use std::time::Duration;
+
+	#[test]
+	fn test_notify_listener() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_notify_listener");
+
+		// The first session sends one notification and then drops the connection. Later sessions
+		// report a waiting update when they start and send one more notification each.
+		let sessions = Arc::new(AtomicUsize::new(0));
+		let server_sessions = sessions.clone();
+		let server = TestServer::start(move |req, conn| {
+			if req.action != "IDLE" || req.data.get("Notify").is_none() {
+				return Ok(false)
+			}
+			let session = server_sessions.fetch_add(1, Ordering::SeqCst);
+			let waiting = if session == 0 { "0" } else { "1" };
+			TestServer::send(conn, &TestServer::response(100, "CONTINUE",
+				&[("UpdateCount", waiting)]))?;
+
+			std::thread::sleep(Duration::from_millis(20));
+			TestServer::send(conn, &TestServer::response(100, "UPDATE",
+				&[("UpdateCount", "2")]))?;
+			if session == 0 {
+				return Ok(false)
+			}
+
+			// Hold the connection open until the client goes away
+			std::thread::sleep(Duration::from_secs(5));
+			Ok(false)
+		});
+
+		let address = server.address.clone();
+		let port = server.port.clone();
+		let mut listener = NotifyListener::new("host1", move |_host| {
+			let mut conn = ServerConnection::new();
+			conn.connect(&address, &port)?;
+			Ok(conn)
+		});
+		listener.set_backoff(Duration::from_millis(10), Duration::from_millis(100));
+
+		let (tx, rx) = channel::<u64>();
+		let tx = std::sync::Mutex::new(tx);
+		listener.start(move |count| {
+			let _ = tx.lock().unwrap().send(count);
+		})?;
+
+		let mut updates = Vec::<u64>::new();
+		for _ in 0..3 {
+			match rx.recv_timeout(Duration::from_secs(5)) {
+				Ok(v) => updates.push(v),
+				Err(_) => {
+					return Err(MensagoError::ErrProgramException(
+						format!("{}: timed out waiting for updates, got {:?}", testname, updates)))
+				},
+			}
+		}
+		if updates != vec![2, 1, 2] {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: wrong updates received: {:?}", testname, updates)))
+		}
+
+		if sessions.load(Ordering::SeqCst) != 2 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: expected 2 sessions, got {}", testname,
+					sessions.load(Ordering::SeqCst))))
+		}
+
+		// Stopping must not wait for the server to send anything else
+		let start = std::time::Instant::now();
+		listener.stop();
+		if listener.is_running() || start.elapsed() > Duration::from_secs(1) {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: listener did not stop promptly", testname)))
+		}
+
+		Ok(())
+	}
+}
@@ -0,0 +1,267 @@
+//! The outbox module handles preparing outgoing messages for delivery. A message body is encrypted
+//! exactly once with a freshly-generated symmetric payload key, and then that payload key is
+//! wrapped with the encryption key of each recipient. Wrapping keys is an asymmetric operation and
+//! is by far the most expensive part of sending to many recipients, so it is spread across a pool
+//! of worker threads.
+
+use eznacl::*;
+use libkeycard::*;
+use serde::{Deserialize, Serialize};
+use std::io::Write;
+use std::thread;
+use crate::base::*;
+use crate::commands::servermsg::*;
+
+/// A Recipient pairs a Mensago address with the public encryption key listed in the current entry
+/// of the recipient's keycard.
+#[derive(Debug, Clone)]
+pub struct Recipient {
+	pub address: MAddress,
+	pub key: CryptoString,
+}
+
+/// A payload key wrapped with the encryption key for a specific recipient
+#[derive(Debug, Clone, PartialEq, Serialize, Deserialize)]
+pub struct WrappedKey {
+	pub recipient: String,
+	pub key: String,
+}
+
+/// SealedEnvelope holds an encrypted message body and a copy of the payload key for each recipient.
+/// Both the payload and the wrapped keys are stored as CryptoString-formatted strings.
+#[derive(Debug, Clone, PartialEq, Serialize, Deserialize)]
+pub struct SealedEnvelope {
+	pub keys: Vec<WrappedKey>,
+	pub payload: String,
+}
+
+impl SealedEnvelope {
+
+	/// Returns the wrapped payload key for the specified recipient, if the envelope has one.
+	pub fn get_key(&self, recipient: &MAddress) -> Option<&WrappedKey> {
+		let addr = recipient.to_string();
+		self.keys.iter().find(|k| k.recipient == addr)
+	}
+}
+
+/// The Outbox type encrypts outgoing messages and sends them to the server. Its only state is the
+/// size of its worker pool, so it is cheap to create and share.
+#[derive(Debug, Clone)]
+pub struct Outbox {
+	workers: usize,
+}
+
+impl Outbox {
+
+	/// Creates a new Outbox with one worker thread per available CPU
+	pub fn new() -> Outbox {
+		let workers = match thread::available_parallelism() {
+			Ok(v) => v.get(),
+			Err(_) => 1,
+		};
+		Outbox { workers }
+	}
+
+	/// Creates a new Outbox with the specified number of worker threads. A value of 0 is treated
+	/// as 1.
+	pub fn with_workers(workers: usize) -> Outbox {
+		Outbox { workers: workers.max(1) }
+	}
+
+	/// Returns the number of worker threads used for wrapping payload keys
+	#[inline]
+	pub fn get_workers(&self) -> usize {
+		self.workers
+	}
+
+	/// Encrypts a message body once and wraps the payload key for each recipient in parallel. The
+	/// keys in the returned envelope are in the same order as the recipient list.
+	pub fn seal(&self, body: &[u8], recipients: &[Recipient])
+	-> Result<SealedEnvelope, MensagoError> {
+
+		if body.len() == 0 || recipients.len() == 0 {
+			return Err(MensagoError::ErrEmptyData)
+		}
+
+		let payloadkey = match SecretKey::generate() {
+			Some(v) => v,
+			None => {
+				return Err(MensagoError::ErrProgramException(
+					String::from("BUG: Outbox.seal(): error generating payload key")))
+			}
+		};
+		let payload = payloadkey.encrypt(body)?;
+		let keystr = payloadkey.get_public_str();
+
+		// Small recipient lists aren't worth the cost of spinning up threads
+		let workers = self.workers.min(recipients.len());
+		if workers == 1 {
+			return Ok(SealedEnvelope {
+				keys: wrap_keys(keystr.as_bytes(), recipients)?,
+				payload: payload.to_string(),
+			})
+		}
+
+		let chunksize = (recipients.len() + workers - 1) / workers;
+		let results = thread::scope(|s| {
+			let handles: Vec<_> = recipients.chunks(chunksize)
+				.map(|chunk| {
+					let keybytes = keystr.as_bytes();
+					s.spawn(move || wrap_keys(keybytes, chunk))
+				})
+				.collect();
+
+			handles.into_iter()
+				.map(|h| match h.join() {
+					Ok(v) => v,
+					Err(_) => Err(MensagoError::ErrProgramException(
+						String::from("BUG: Outbox.seal(): key wrapping worker panicked"))),
+				})
+				.collect::<Vec<_>>()
+		});
+
+		let mut keys = Vec::<WrappedKey>::with_capacity(recipients.len());
+		for result in results {
+			keys.extend(result?);
+		}
+
+		Ok(SealedEnvelope { keys, payload: payload.to_string() })
+	}
+
+	/// Seals a message for the specified recipients and writes it to the connection as a single
+	/// message, which will be sent as multipart if it is large enough.
+	pub fn send<W: Write>(&self, conn: &mut W, body: &[u8], recipients: &[Recipient])
+	-> Result<(), MensagoError> {
+
+		let envelope = self.seal(body, recipients)?;
+
+		// The encrypted payload dominates the envelope's size, so reserving space for it and the
+		// keys up front avoids the serializer repeatedly reallocating a multi-megabyte buffer.
+		let estimate = envelope.payload.len() +
+			envelope.keys.iter().map(|k| k.recipient.len() + k.key.len() + 32).sum::<usize>() + 32;
+		let mut rawdata = Vec::<u8>::with_capacity(estimate);
+		serde_json::to_writer(&mut rawdata, &envelope)?;
+
+		write_message(conn, &rawdata)
+	}
+}
+
+/// Wraps a payload key for each of a list of recipients
+fn wrap_keys(keybytes: &[u8], recipients: &[Recipient]) -> Result<Vec<WrappedKey>, MensagoError> {
+
+	let mut out = Vec::<WrappedKey>::with_capacity(recipients.len());
+	for r in recipients {
+		let enckey = match EncryptionKey::from(&r.key) {
+			Some(v) => v,
+			None => { return Err(MensagoError::ErrUnsupportedAlgorithm) }
+		};
+
+		out.push(WrappedKey {
+			recipient: r.address.to_string(),
+			key: enckey.encrypt(keybytes)?.to_string(),
+		});
+	}
+
+	Ok(out)
+}
+
+#[cfg(test)]
+mod tests {
+	use crate::*;
+	use eznacl::*;
+	use libkeycard::*;
+	use std::time::Instant;
+
+	// Creates a list of recipients along with their keypairs so the test can decrypt the results
+	fn make_recipients(count: usize) -> Vec<(Recipient, EncryptionPair)> {
+		let mut out = Vec::new();
+		for i in 0..count {
+			let pair = EncryptionPair::generate().unwrap();
+			out.push((Recipient {
+				address: MAddress::from(&format!("user{}/example.com", i)).unwrap(),
+				key: pair.get_public_key(),
+			}, pair));
+		}
+		out
+	}
+
+	#[test]
+	fn test_outbox_seal() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_outbox_seal");
+
+		let body = "This is a test message body. ".repeat(100);
+		let pairs = make_recipients(10);
+		let recipients: Vec<Recipient> = pairs.iter().map(|p| p.0.clone()).collect();
+
+		// Case #1: empty recipient list
+		match Outbox::with_workers(4).seal(body.as_bytes(), &Vec::new()) {
+			Ok(_) => {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: failed to catch empty recipient list", testname)))
+			},
+			Err(_) => (),
+		}
+
+		// Case #2: successful seal, checking that every recipient can open the envelope
+		let envelope = match Outbox::with_workers(4).seal(body.as_bytes(), &recipients) {
+			Ok(v) => v,
+			Err(e) => {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: error sealing envelope: {}", testname, e.to_string())))
+			}
+		};
+
+		if envelope.keys.len() != recipients.len() {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: wrapped key count mismatch: {}", testname, envelope.keys.len())))
+		}
+
+		for (recipient, pair) in &pairs {
+			let wrapped = match envelope.get_key(&recipient.address) {
+				Some(v) => v,
+				None => {
+					return Err(MensagoError::ErrProgramException(
+						format!("{}: missing key for {}", testname, recipient.address)))
+				}
+			};
+			let keystr = pair.decrypt(&CryptoString::from(&wrapped.key).unwrap())?;
+			let payloadkey = SecretKey::from_string(&String::from_utf8(keystr)?).unwrap();
+			let decrypted = payloadkey.decrypt(&CryptoString::from(&envelope.payload).unwrap())?;
+			if decrypted != body.as_bytes() {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: payload mismatch for {}", testname, recipient.address)))
+			}
+		}
+
+		Ok(())
+	}
+
+	// Throughput benchmark for sealing by recipient count. Run with
+	// `cargo test --release bench_outbox_seal -- --ignored --nocapture`
+	#[test]
+	#[ignore]
+	fn bench_outbox_seal() -> Result<(), MensagoError> {
+
+		let body = "A".repeat(65536);
+		let pairs = make_recipients(256);
+		let recipients: Vec<Recipient> = pairs.iter().map(|p| p.0.clone()).collect();
+		let iterations = 20;
+
+		for count in [1, 4, 16, 64, 256] {
+			for workers in [1, Outbox::new().get_workers()] {
+				let outbox = Outbox::with_workers(workers);
+				let start = Instant::now();
+				for _ in 0..iterations {
+					outbox.seal(body.as_bytes(), &recipients[..count])?;
+				}
+				let elapsed = start.elapsed().as_secs_f64();
+				println!("recipients: {:>4} workers: {:>3} {:>10.1} msgs/sec {:>10.1} keys/sec",
+					count, workers, iterations as f64 / elapsed,
+					(iterations * count) as f64 / elapsed);
+			}
+		}
+
+		Ok(())
+	}
+}
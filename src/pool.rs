@@ -0,0 +1,349 @@
+//! The pool module keeps connections to Mensago servers open for reuse. Connections are created on
+//! demand by a factory supplied by the caller, which is responsible for connecting and logging in,
+//! and the number of connections open to any one host is capped.
+
+use std::collections::HashMap;
+use std::ops::{Deref, DerefMut};
+use std::sync::{Arc, Condvar, Mutex};
+use std::sync::mpsc::{channel, RecvTimeoutError, Sender};
+use std::thread;
+use std::time::{Duration, Instant};
+use crate::base::*;
+use crate::conn::*;
+
+/// Type for the function used by the pool to create new connections to a host
+pub type ConnectionFactory = dyn Fn(&str) -> Result<ServerConnection, MensagoError> + Send + Sync;
+
+// Time to wait for a reply to a keepalive before deciding that the server is gone
+const KEEPALIVE_TIMEOUT: Duration = Duration::from_secs(10);
+
+struct IdleConnection {
+	conn: ServerConnection,
+	since: Instant,
+}
+
+struct PoolState {
+	idle: HashMap<String, Vec<IdleConnection>>,
+	open: HashMap<String, usize>,
+}
+
+/// ConnectionPool hands out connections to servers, creating them as needed, up to a limit for
+/// each host. Connections are identified by a host string, which is passed to the factory
+/// unchanged, so it can be anything the factory understands, such as "example.com:2001".
+pub struct ConnectionPool {
+	factory: Box<ConnectionFactory>,
+	max_per_host: usize,
+	state: Mutex<PoolState>,
+	available: Condvar,
+}
+
+impl ConnectionPool {
+
+	/// Creates a new pool which uses the supplied function to create connections
+	pub fn new<F>(factory: F, max_per_host: usize) -> ConnectionPool
+	where F: Fn(&str) -> Result<ServerConnection, MensagoError> + Send + Sync + 'static {
+
+		ConnectionPool {
+			factory: Box::new(factory),
+			max_per_host: max_per_host.max(1),
+			state: Mutex::new(PoolState {
+				idle: HashMap::new(),
+				open: HashMap::new(),
+			}),
+			available: Condvar::new(),
+		}
+	}
+
+	/// Returns the maximum number of connections the pool will open to a single host
+	#[inline]
+	pub fn get_max_per_host(&self) -> usize {
+		self.max_per_host
+	}
+
+	/// Returns the number of connections currently open to a host, whether idle or in use
+	pub fn count_open(&self, host: &str) -> usize {
+		let state = self.lock_state();
+		*state.open.get(host).unwrap_or(&0)
+	}
+
+	/// Gets a connection to the host, waiting for one to be returned to the pool if the host is
+	/// already at its connection limit.
+	pub fn get(&self, host: &str) -> Result<PooledConnection<'_>, MensagoError> {
+
+		let mut state = self.lock_state();
+		loop {
+			if let Some(idle) = state.idle.get_mut(host).and_then(|v| v.pop()) {
+				return Ok(PooledConnection::new(self, host, idle.conn))
+			}
+
+			if *state.open.get(host).unwrap_or(&0) < self.max_per_host {
+				break
+			}
+
+			state = match self.available.wait(state) {
+				Ok(v) => v,
+				Err(_) => {
+					return Err(MensagoError::ErrProgramException(
+						String::from("BUG: ConnectionPool state lock poisoned")))
+				}
+			};
+		}
+
+		// Reserve the slot before connecting so that the lock isn't held during the connection
+		// process and other threads can't overshoot the limit in the meantime.
+		*state.open.entry(String::from(host)).or_insert(0) += 1;
+		drop(state);
+
+		match (self.factory)(host) {
+			Ok(conn) => Ok(PooledConnection::new(self, host, conn)),
+			Err(e) => {
+				self.release(host, None);
+				Err(e)
+			}
+		}
+	}
+
+	/// Disconnects all idle connections
+	pub fn clear(&self) {
+		let mut state = self.lock_state();
+		for (host, conns) in state.idle.drain().collect::<Vec<_>>() {
+			for mut idle in conns {
+				let _ = idle.conn.disconnect();
+				if let Some(v) = state.open.get_mut(&host) {
+					*v -= 1;
+				}
+			}
+		}
+		self.available.notify_all();
+	}
+
+	/// Pings each connection which has been idle for at least `max_idle` so that NAT devices and
+	/// firewalls don't silently drop it. Connections which don't answer are replaced with new
+	/// ones, so that the next caller gets a working connection without waiting for a timeout.
+	/// Returns the number of connections which were replaced.
+	pub fn keepalive(&self, max_idle: Duration) -> usize {
+
+		// Take the stale connections out of the idle lists so that nobody else can use them while
+		// they are being checked. They still count against the host limits.
+		let mut stale = Vec::<(String, ServerConnection)>::new();
+		{
+			let mut state = self.lock_state();
+			for (host, conns) in state.idle.iter_mut() {
+				let mut i = 0;
+				while i < conns.len() {
+					if conns[i].since.elapsed() >= max_idle {
+						stale.push((host.clone(), conns.swap_remove(i).conn));
+					} else {
+						i += 1;
+					}
+				}
+			}
+		}
+
+		let mut replaced = 0;
+		for (host, mut conn) in stale {
+			if conn.ping(KEEPALIVE_TIMEOUT).is_ok() {
+				self.release(&host, Some(conn));
+				continue
+			}
+
+			drop(conn);
+			replaced += 1;
+			match (self.factory)(&host) {
+				Ok(v) => self.release(&host, Some(v)),
+				Err(_) => self.release(&host, None),
+			}
+		}
+		replaced
+	}
+
+	/// Starts a thread which calls `keepalive()` at the specified interval. The thread runs until
+	/// the returned handle is dropped.
+	pub fn start_keepalive(self: &Arc<Self>, interval: Duration) -> KeepaliveHandle {
+
+		let (stop, sleeper) = channel::<()>();
+		let pool = self.clone();
+		let thread = thread::spawn(move || {
+			while let Err(RecvTimeoutError::Timeout) = sleeper.recv_timeout(interval) {
+				pool.keepalive(interval);
+			}
+		});
+
+		KeepaliveHandle {
+			stop: Some(stop),
+			thread: Some(thread),
+		}
+	}
+
+	// Returns a connection to the pool. Passing None frees the connection's slot, which is done
+	// when the connection is broken and has been thrown away.
+	fn release(&self, host: &str, conn: Option<ServerConnection>) {
+		let mut state = self.lock_state();
+		match conn {
+			Some(v) if v.is_connected() => {
+				state.idle.entry(String::from(host)).or_insert(Vec::new())
+					.push(IdleConnection { conn: v, since: Instant::now() });
+			},
+			_ => {
+				if let Some(v) = state.open.get_mut(host) {
+					*v -= 1;
+				}
+			},
+		}
+		self.available.notify_all();
+	}
+
+	fn lock_state(&self) -> std::sync::MutexGuard<'_, PoolState> {
+		// A panic while holding the lock can't leave the bookkeeping in a state worse than
+		// slightly inaccurate counts, so a poisoned lock is still usable.
+		match self.state.lock() {
+			Ok(v) => v,
+			Err(e) => e.into_inner(),
+		}
+	}
+}
+
+/// KeepaliveHandle controls the thread started by `ConnectionPool::start_keepalive()`. Dropping
+/// it stops the thread.
+pub struct KeepaliveHandle {
+	stop: Option<Sender<()>>,
+	thread: Option<thread::JoinHandle<()>>,
+}
+
+impl Drop for KeepaliveHandle {
+	fn drop(&mut self) {
+		// Dropping the sender wakes the thread up
+		self.stop = None;
+		if let Some(handle) = self.thread.take() {
+			let _ = handle.join();
+		}
+	}
+}
+
+/// PooledConnection is a connection checked out from a ConnectionPool. It is returned to the pool
+/// when dropped unless it has been marked as broken with `discard()`.
+pub struct PooledConnection<'a> {
+	pool: &'a ConnectionPool,
+	host: String,
+	conn: Option<ServerConnection>,
+	broken: bool,
+}
+
+impl<'a> PooledConnection<'a> {
+
+	fn new(pool: &'a ConnectionPool, host: &str, conn: ServerConnection) -> PooledConnection<'a> {
+		PooledConnection {
+			pool,
+			host: String::from(host),
+			conn: Some(conn),
+			broken: false,
+		}
+	}
+
+	/// Marks the connection as unusable, such as after a network error, so that it is closed
+	/// instead of being returned to the pool
+	pub fn discard(&mut self) {
+		self.broken = true;
+	}
+
+	/// Returns the host the connection belongs to
+	#[inline]
+	pub fn get_host(&self) -> &str {
+		&self.host
+	}
+}
+
+impl<'a> Deref for PooledConnection<'a> {
+	type Target = ServerConnection;
+
+	fn deref(&self) -> &ServerConnection {
+		self.conn.as_ref().unwrap()
+	}
+}
+
+impl<'a> DerefMut for PooledConnection<'a> {
+	fn deref_mut(&mut self) -> &mut ServerConnection {
+		self.conn.as_mut().unwrap()
+	}
+}
+
+impl<'a> Drop for PooledConnection<'a> {
+	fn drop(&mut self) {
+		let conn = self.conn.take();
+		if self.broken {
+			self.pool.release(&self.host, None);
+		} else {
+			self.pool.release(&self.host, conn);
+		}
+	}
+}
+
+#[cfg(test)]
+mod tests {
+	use crate::*;
+	use crate::commands::testserver::*;
+	use std::sync::Arc;
+	use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+	use std::time::Duration;
+
+	#[test]
+	fn test_pool_keepalive() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_pool_keepalive");
+
+		// While `dead` is set, the server drops connections instead of answering NOOP, which is
+		// what a connection silently killed by a NAT device looks like to the client
+		let dead = Arc::new(AtomicBool::new(false));
+		let server_dead = dead.clone();
+		let server = TestServer::start(move |req, conn| {
+			if req.action != "NOOP" || server_dead.load(Ordering::SeqCst) {
+				return Ok(false)
+			}
+			TestServer::send(conn, &TestServer::response(200, "OK", &[]))?;
+			Ok(true)
+		});
+
+		let connects = Arc::new(AtomicUsize::new(0));
+		let factory_connects = connects.clone();
+		let address = server.address.clone();
+		let port = server.port.clone();
+		let pool = ConnectionPool::new(move |_host| {
+			factory_connects.fetch_add(1, Ordering::SeqCst);
+			let mut conn = ServerConnection::new();
+			conn.connect(&address, &port)?;
+			Ok(conn)
+		}, 2);
+
+		{
+			let _conn1 = pool.get("host1")?;
+			let _conn2 = pool.get("host1")?;
+		}
+
+		// Nothing has been idle long enough to need checking
+		if pool.keepalive(Duration::from_secs(60)) != 0 || connects.load(Ordering::SeqCst) != 2 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: fresh connections were checked", testname)))
+		}
+
+		dead.store(true, Ordering::SeqCst);
+		let replaced = pool.keepalive(Duration::from_secs(0));
+		dead.store(false, Ordering::SeqCst);
+		if replaced != 2 || connects.load(Ordering::SeqCst) != 4 || pool.count_open("host1") != 2 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: dead connections not replaced: {} replaced, {} connects, {} open",
+					testname, replaced, connects.load(Ordering::SeqCst),
+					pool.count_open("host1"))))
+		}
+
+		// The replacements work and are handed out without connecting again
+		let mut conn = pool.get("host1")?;
+		conn.ping(Duration::from_secs(5))?;
+		drop(conn);
+		if pool.keepalive(Duration::from_secs(0)) != 0 || connects.load(Ordering::SeqCst) != 4 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: live connections were replaced", testname)))
+		}
+
+		Ok(())
+	}
+}
@@ -0,0 +1,391 @@
+//! The prefetch module guesses which message the user will open next and loads it ahead of time.
+//! People mostly read a folder in order, so after message N is opened, N+1 (or N-1 when moving
+//! up the list) is loaded into the MessageCache. Messages whose bodies haven't been downloaded
+//! yet are queued with the DownloadManager at background priority, and the downloaded bodies are
+//! stored once their results are passed to `finish_download()`.
+//!
+//! The number of messages loaded ahead adapts to how well the guesses work out. It doubles each
+//! time the user opens a message which was prefetched and halves when they jump somewhere else.
+
+use libkeycard::*;
+use rusqlite;
+use std::collections::{HashMap, HashSet};
+use std::fs;
+use std::path::Path;
+use std::sync::{Arc, Mutex, MutexGuard};
+use crate::base::*;
+use crate::download::*;
+use crate::messages::*;
+use crate::msgcache::*;
+
+/// Function which returns the download for a message whose body isn't stored locally, or None if
+/// it can't be downloaded
+pub type PrefetchResolver = dyn Fn(&str) -> Option<DownloadItem> + Send + Sync;
+
+/// Counts of how the prefetcher's guesses have worked out
+#[derive(Debug, Clone, PartialEq)]
+pub struct PrefetchStats {
+	pub hits: u64,
+	pub misses: u64,
+	pub loaded: u64,
+	pub queued: u64,
+	pub depth: usize,
+}
+
+struct PrefetchState {
+	listing: Vec<String>,
+	positions: HashMap<String, usize>,
+	last: Option<usize>,
+	forward: bool,
+	depth: usize,
+	pending: Vec<String>,
+	predicted: HashSet<String>,
+	// Downloads queued by the prefetcher whose results haven't been handled yet, by message ID
+	requested: HashMap<String, u64>,
+	stats: PrefetchStats,
+}
+
+/// Prefetcher watches the order messages are listed and opened in and loads the ones likely to be
+/// opened next. It can be shared between threads, so the reading code can report what the user
+/// opens while a worker thread with its own database connection calls `prefetch()`.
+pub struct Prefetcher {
+	cache: Arc<MessageCache>,
+	max_depth: usize,
+	downloads: Option<(Arc<DownloadManager>, Box<PrefetchResolver>)>,
+	state: Mutex<PrefetchState>,
+}
+
+impl Prefetcher {
+
+	/// Creates a new prefetcher which loads messages into the specified cache, at most
+	/// `max_depth` messages ahead of the one being read
+	pub fn new(cache: Arc<MessageCache>, max_depth: usize) -> Prefetcher {
+		Prefetcher {
+			cache,
+			max_depth: max_depth.max(1),
+			downloads: None,
+			state: Mutex::new(PrefetchState {
+				listing: Vec::new(),
+				positions: HashMap::new(),
+				last: None,
+				forward: true,
+				depth: 1,
+				pending: Vec::new(),
+				predicted: HashSet::new(),
+				requested: HashMap::new(),
+				stats: PrefetchStats { hits: 0, misses: 0, loaded: 0, queued: 0, depth: 1 },
+			}),
+		}
+	}
+
+	/// Sets up downloading of message bodies which aren't stored locally. The resolver is given a
+	/// message ID and returns what to download for it. Items are always queued at background
+	/// priority so that they never hold up anything the user asked for. The results of the
+	/// manager's downloads need to be passed to `finish_download()`, which stores the bodies.
+	pub fn set_downloads<F>(&mut self, downloads: Arc<DownloadManager>, resolver: F)
+	where F: Fn(&str) -> Option<DownloadItem> + Send + Sync + 'static {
+		self.downloads = Some((downloads, Box::new(resolver)));
+	}
+
+	/// Tells the prefetcher the order in which messages are currently listed, such as the
+	/// contents of the folder the user is looking at. This replaces any earlier listing.
+	pub fn set_listing(&self, ids: &[String]) {
+		let mut state = self.lock_state();
+		state.positions = ids.iter().enumerate().map(|(i, id)| (id.clone(), i)).collect();
+		state.listing = ids.to_vec();
+		state.last = None;
+		state.pending.clear();
+		state.predicted.clear();
+	}
+
+	/// Returns a message for display, from the cache if possible, and records that it was opened
+	pub fn get_message(&self, conn: &rusqlite::Connection, id: &RandomID)
+	-> Result<Arc<Message>, MensagoError> {
+		let msg = self.cache.get(conn, id)?;
+		self.note_open(id.as_string());
+		Ok(msg)
+	}
+
+	/// Records that the user opened the specified message and works out which messages to load
+	/// next. Nothing is loaded until `prefetch()` is called.
+	pub fn note_open(&self, id: &str) {
+
+		let mut state = self.lock_state();
+
+		if state.predicted.len() > 0 {
+			if state.predicted.contains(id) {
+				state.stats.hits += 1;
+				state.depth = (state.depth * 2).min(self.max_depth);
+			} else {
+				state.stats.misses += 1;
+				state.depth = (state.depth / 2).max(1);
+			}
+		}
+		state.stats.depth = state.depth;
+
+		let pos = match state.positions.get(id) {
+			Some(v) => *v,
+			None => {
+				state.last = None;
+				state.pending.clear();
+				state.predicted.clear();
+				return
+			},
+		};
+
+		// Moving up the list is the only case where the user reads backward
+		match state.last {
+			Some(last) if pos + 1 == last => state.forward = false,
+			Some(last) if pos == last + 1 => state.forward = true,
+			_ => (),
+		}
+		state.last = Some(pos);
+
+		let ahead: Vec<String> = if state.forward {
+			state.listing.iter().skip(pos + 1).take(state.depth).cloned().collect()
+		} else {
+			state.listing[..pos].iter().rev().take(state.depth).cloned().collect()
+		};
+		state.predicted = ahead.iter().cloned().collect();
+		state.pending = ahead;
+	}
+
+	/// Loads the messages the user is expected to open next into the cache and queues downloads
+	/// for those without a body. This is meant to be called from an idle handler or a worker
+	/// thread. Returns the number of messages loaded.
+	pub fn prefetch(&self, conn: &rusqlite::Connection) -> Result<usize, MensagoError> {
+
+		let pending = std::mem::take(&mut self.lock_state().pending);
+
+		let mut loaded = 0;
+		let mut queued = 0;
+		for id in pending.iter() {
+
+			// A message may be cached with only its header, in which case its body still needs to
+			// be downloaded
+			if let Some(msg) = self.cache.peek(id) {
+				if msg.body.is_none() && self.queue_download(id) {
+					queued += 1;
+				}
+				continue
+			}
+			let rid = match RandomID::from(id) {
+				Some(v) => v,
+				None => continue,
+			};
+
+			let missing = match self.cache.get(conn, &rid) {
+				Ok(msg) => {
+					loaded += 1;
+					msg.body.is_none()
+				},
+				Err(MensagoError::ErrNotFound) => true,
+				Err(e) => return Err(e),
+			};
+			if missing && self.queue_download(id) {
+				queued += 1;
+			}
+		}
+
+		let mut state = self.lock_state();
+		state.stats.loaded += loaded as u64;
+		state.stats.queued += queued;
+		Ok(loaded)
+	}
+
+	/// Handles the result of a finished download. If it is one the prefetcher queued, the file is
+	/// turned into the message's body by `decode`, such as by opening the envelope with the
+	/// workspace's keys, and the body is stored in the database. Returns true if a body was
+	/// stored. A download which failed, or whose file couldn't be decoded or stored, is queued
+	/// again the next time its message is predicted.
+	pub fn finish_download<F>(&self, conn: &rusqlite::Connection, result: &DownloadResult,
+		decode: F) -> Result<bool, MensagoError>
+	where F: FnOnce(&[u8]) -> Result<String, MensagoError> {
+
+		let msgid = match self.lock_state().requested.iter().find(|(_, dl)| **dl == result.id) {
+			Some((k, _)) => k.clone(),
+			None => return Ok(false),
+		};
+
+		// The message stays in the list until its body is stored so that it isn't queued again
+		// in the meantime
+		let stored = match &result.result {
+			Ok(path) => self.store_body(conn, &msgid, path, decode).map(|_| true),
+			Err(_) => Ok(false),
+		};
+		self.lock_state().requested.remove(&msgid);
+		stored
+	}
+
+	/// Returns how the prefetcher's guesses have worked out so far
+	pub fn get_stats(&self) -> PrefetchStats {
+		self.lock_state().stats.clone()
+	}
+
+	// Queues a download for a message unless one is already queued, in progress, or waiting for
+	// its result to be handled. Returns true if one was queued.
+	fn queue_download(&self, id: &str) -> bool {
+
+		let (downloads, resolver) = match self.downloads.as_ref() {
+			Some(v) => v,
+			None => return false,
+		};
+		if self.lock_state().requested.contains_key(id) {
+			return false
+		}
+
+		match resolver(id) {
+			Some(mut item) => {
+				item.priority = DownloadPriority::Background;
+				let dl = downloads.enqueue(item);
+				self.lock_state().requested.insert(String::from(id), dl);
+				true
+			},
+			None => false,
+		}
+	}
+
+	// Decodes a downloaded file and stores it as the message's body. Once stored, the body is
+	// loaded along with the rest of the message, so the copy in the blob store isn't needed.
+	fn store_body<F>(&self, conn: &rusqlite::Connection, id: &str, path: &Path, decode: F)
+	-> Result<(), MensagoError>
+	where F: FnOnce(&[u8]) -> Result<String, MensagoError> {
+
+		let rid = match RandomID::from(id) {
+			Some(v) => v,
+			None => return Err(MensagoError::ErrBadValue),
+		};
+		let body = decode(&fs::read(path)?)?;
+		set_message_body(conn, &rid, &body)?;
+		let _ = fs::remove_file(path);
+		Ok(())
+	}
+
+	fn lock_state(&self) -> MutexGuard<'_, PrefetchState> {
+		match self.state.lock() {
+			Ok(v) => v,
+			Err(e) => e.into_inner(),
+		}
+	}
+}
+
+#[cfg(test)]
+mod tests {
+	use crate::*;
+	use crate::testutil::*;
+	use libkeycard::*;
+	use std::fs;
+	use std::path::PathBuf;
+	use std::sync::Arc;
+
+	#[test]
+	fn test_prefetch() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_prefetch");
+		let conn = open_storage()?;
+
+		// Every other message has only its header stored locally
+		let mut ids = Vec::new();
+		for i in 0..20 {
+			let msg = Message {
+				subject: Some(format!("Message {}", i)),
+				body: if i % 2 == 0 { Some(String::from("body")) } else { None },
+				..make_message("")
+			};
+			add_message(&conn, &msg)?;
+			ids.push(msg.id);
+		}
+
+		let pool = Arc::new(ConnectionPool::new(|_host: &str| {
+			Err(MensagoError::ErrNotConnected)
+		}, 1));
+		let downloads = Arc::new(DownloadManager::new(pool, &PathBuf::new()));
+		let cache = MessageCache::new(100, 0);
+		let mut prefetcher = Prefetcher::new(cache.clone(), 8);
+		prefetcher.set_downloads(downloads.clone(), |id: &str| {
+			Some(DownloadItem {
+				host: String::from("example.com"),
+				server_path: format!("/ wsp {}", id),
+				size: 0,
+				priority: DownloadPriority::Interactive,
+			})
+		});
+		prefetcher.set_listing(&ids);
+
+		// Reading in order makes the prefetcher look further ahead each time
+		for i in 0..4 {
+			prefetcher.get_message(&conn, &RandomID::from(&ids[i]).unwrap())?;
+			prefetcher.prefetch(&conn)?;
+			if !cache.contains(&ids[i + 1]) {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: message {} not prefetched", testname, i + 1)))
+			}
+		}
+		let stats = prefetcher.get_stats();
+		if stats.hits != 3 || stats.depth != 8 || !cache.contains(&ids[11]) {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: prefetch didn't adapt: {:?}", testname, stats)))
+		}
+
+		// Messages without bodies are queued once each at background priority
+		if stats.queued as usize != downloads.count_queued() || stats.queued != 6 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: wrong downloads queued: {:?}", testname, stats)))
+		}
+
+		// Jumping elsewhere shrinks the window, and moving up the list prefetches upward
+		prefetcher.get_message(&conn, &RandomID::from(&ids[18]).unwrap())?;
+		prefetcher.get_message(&conn, &RandomID::from(&ids[17]).unwrap())?;
+		prefetcher.prefetch(&conn)?;
+		let stats = prefetcher.get_stats();
+		if stats.depth != 2 || !cache.contains(&ids[16]) {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: prefetch didn't follow the user: {:?}", testname, stats)))
+		}
+
+		// A failed download is queued again the next time its message is predicted, even though
+		// the header-only message is still cached
+		for result in downloads.run() {
+			if prefetcher.finish_download(&conn, &result, |_| Err(MensagoError::ErrBadValue))? {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: failed download reported as stored", testname)))
+			}
+		}
+		prefetcher.set_listing(&ids);
+		prefetcher.get_message(&conn, &RandomID::from(&ids[2]).unwrap())?;
+		prefetcher.prefetch(&conn)?;
+		let stats = prefetcher.get_stats();
+		if stats.queued != 8 || downloads.count_queued() != 1 || !cache.contains(&ids[1]) {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: failed download not retried: {:?}", testname, stats)))
+		}
+
+		// A finished download's body is stored, replacing the cached header-only message, and the
+		// message isn't queued again
+		let test_path = setup_test(&testname);
+		let mut bodypath = test_path.clone();
+		bodypath.push("body");
+		fs::write(&bodypath, "Downloaded body")?;
+		let mut result = downloads.run().pop().unwrap();
+		result.result = Ok(bodypath.clone());
+		let oldsize = get_folder_counts(&conn, INBOX_FOLDER)?.size;
+		let stored = prefetcher.finish_download(&conn, &result, |data| {
+			Ok(String::from_utf8(data.to_vec())?)
+		})?;
+		if !stored || cache.contains(&ids[1]) || bodypath.exists()
+			|| get_folder_counts(&conn, INBOX_FOLDER)?.size != oldsize + 15 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: downloaded body not stored", testname)))
+		}
+
+		prefetcher.get_message(&conn, &RandomID::from(&ids[2]).unwrap())?;
+		prefetcher.prefetch(&conn)?;
+		let msg = cache.get(&conn, &RandomID::from(&ids[1]).unwrap())?;
+		if msg.body.as_deref() != Some("Downloaded body") || prefetcher.get_stats().queued != 8 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: stored body not used", testname)))
+		}
+
+		Ok(())
+	}
+}
@@ -1,10 +1,14 @@
 use libkeycard::*;
 use rusqlite;
+use std::collections::HashMap;
 use std::env;
 use std::fs;
 use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicUsize, Ordering};
 use crate::base::*;
+use crate::changes::*;
 use crate::config::*;
+use crate::messages::*;
 use crate::workspace::*;
 
 // String for initializing a new profile database
@@ -47,7 +51,30 @@ static STORAGE_DB_SETUP_COMMANDS: &str = "
 		'thread_id' TEXT NOT NULL,
 		'subject' TEXT,
 		'body' TEXT,
-		'attachments' TEXT
+		'attachments' TEXT,
+		'preview' TEXT,
+		'has_attachments' INTEGER NOT NULL DEFAULT 0,
+		'folder' TEXT NOT NULL DEFAULT 'inbox',
+		'flags' INTEGER NOT NULL DEFAULT 0,
+		'size' INTEGER NOT NULL DEFAULT 0
+	);
+	CREATE INDEX 'messages_date' ON 'messages'('date');
+	CREATE INDEX 'messages_thread' ON 'messages'('thread_id','date');
+	CREATE INDEX 'messages_folder' ON 'messages'('folder','date');
+	CREATE INDEX 'messages_unread' ON 'messages'('folder','date') WHERE (flags & 1)=0;
+	CREATE INDEX 'messages_flagged' ON 'messages'('date') WHERE (flags & 2)!=0;
+	CREATE TABLE 'message_labels' (
+		'label' TEXT NOT NULL,
+		'msgid' TEXT NOT NULL,
+		PRIMARY KEY('label','msgid')
+	) WITHOUT ROWID;
+	CREATE INDEX 'message_labels_msgid' ON 'message_labels'('msgid');
+	CREATE TABLE 'folder_counters' (
+		'folder' TEXT NOT NULL PRIMARY KEY,
+		'total' INTEGER NOT NULL,
+		'unread' INTEGER NOT NULL,
+		'flagged' INTEGER NOT NULL,
+		'size' INTEGER NOT NULL
 	);
 	CREATE TABLE 'contactinfo' (
 		'id' TEXT NOT NULL,
@@ -95,8 +122,34 @@ static STORAGE_DB_SETUP_COMMANDS: &str = "
 		'type'	TEXT NOT NULL,
 		'path'	TEXT NOT NULL
 	);
+	CREATE TABLE 'journal' (
+		'seq' INTEGER PRIMARY KEY AUTOINCREMENT,
+		'key' TEXT NOT NULL UNIQUE,
+		'action' TEXT NOT NULL,
+		'target' TEXT NOT NULL,
+		'data' TEXT NOT NULL,
+		'created' TEXT NOT NULL,
+		'attempts' INTEGER NOT NULL DEFAULT 0
+	);
+	CREATE INDEX 'journal_target' ON 'journal'('target');
+	CREATE TABLE 'changeseq' (
+		'area' TEXT NOT NULL PRIMARY KEY,
+		'seq' INTEGER NOT NULL
+	);
 	COMMIT;";
 
+// Amount of a database, in bytes, to memory-map when opened read-only. Reads from mapped pages
+// skip a copy through SQLite's page cache, which adds up when scanning a large profile. Only
+// address space is reserved, so this can be much larger than the database itself.
+const READONLY_MMAP_SIZE: i64 = 1 << 30;
+
+// Number of files held open by a profile's change monitor: the storage database, its write-ahead
+// log, and its shared-memory index
+const MONITOR_OPEN_FILES: usize = 3;
+
+// Rough memory used by a change monitor's connection, which only ever reads a few small pages
+const MONITOR_MEMORY_USAGE: usize = 64 * 1024;
+
 static SECRETS_DB_SETUP_COMMANDS: &str = "
 	BEGIN;
 	CREATE table 'keys' (
@@ -120,12 +173,68 @@ static SECRETS_DB_SETUP_COMMANDS: &str = "
 ";
 
 
+/// ProfileMode is how an activated profile accesses its databases
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum ProfileMode {
+	/// Normal access, which creates the databases if needed
+	ReadWrite,
+	/// The databases are only read. Other processes may still change them, and `refresh()`
+	/// reports those changes.
+	ReadOnly,
+	/// The databases are only read and are assumed to never change, so SQLite skips locking
+	/// entirely. This is only safe for profiles no process is using, such as backup copies.
+	Immutable,
+}
+
+// Counter used to give each in-memory profile's databases their own names
+static MEMORY_PROFILE_COUNT: AtomicUsize = AtomicUsize::new(0);
+
+// The databases and files of a profile which exists only in memory. SQLite frees a shared-cache
+// in-memory database when its last connection closes, so a connection to each is kept open for
+// as long as the profile exists.
+#[derive(Debug)]
+struct MemoryStore {
+	storage_uri: String,
+	secrets_uri: String,
+	_storage: rusqlite::Connection,
+	_secrets: rusqlite::Connection,
+	files: HashMap<String, Vec<u8>>,
+}
+
+impl MemoryStore {
+
+	fn new() -> Result<MemoryStore, MensagoError> {
+		let id = MEMORY_PROFILE_COUNT.fetch_add(1, Ordering::SeqCst);
+		let storage_uri = format!("file:mensago-{}-storage?mode=memory&cache=shared", id);
+		let secrets_uri = format!("file:mensago-{}-secrets?mode=memory&cache=shared", id);
+		Ok(MemoryStore {
+			_storage: open_memory_db(&storage_uri)?,
+			_secrets: open_memory_db(&secrets_uri)?,
+			storage_uri,
+			secrets_uri,
+			files: HashMap::new(),
+		})
+	}
+}
+
+pub(crate) fn open_memory_db(uri: &str) -> Result<rusqlite::Connection, rusqlite::Error> {
+	rusqlite::Connection::open_with_flags(uri, rusqlite::OpenFlags::SQLITE_OPEN_READ_WRITE |
+		rusqlite::OpenFlags::SQLITE_OPEN_CREATE | rusqlite::OpenFlags::SQLITE_OPEN_URI)
+}
+
 /// The Profile type is the client's entry point to interacting with local storage. A profile
 /// consists of a SQLCipher database for storing user data (messages, etc) and config info
 /// and a SQLCipher database for storing secrets (signing keys, password hash, etc.). Neither
 /// database is encrypted currently, but will be a future date. Each profile also contains a
 /// folder called 'files' for storing files outside the databases to cut down on bloat and make
 /// it easier for the user to access attachments with other programs in the OS.
+///
+/// A profile may be used by several processes at once. The databases use write-ahead logging so
+/// that readers and a writer don't block each other, and `refresh()` picks up changes made by
+/// other processes.
+///
+/// Profiles can also be kept entirely in memory for short-lived sessions and tests. These work
+/// the same way, but vanish when dropped unless saved to disk with `snapshot()`.
 #[derive(Debug)]
 pub struct Profile {
 	pub name: String,
@@ -136,6 +245,10 @@ pub struct Profile {
 	pub domain: Option<Domain>,
 	pub devid: Option<RandomID>,
 	pub config: Config,
+	mode: ProfileMode,
+	active: bool,
+	monitor: Option<ChangeMonitor>,
+	memory: Option<MemoryStore>,
 }
 
 impl Profile {
@@ -143,20 +256,20 @@ impl Profile {
 	/// Creates a new profile from a specified path
 	fn new(profpath: &Path) -> Result<Profile, MensagoError> {
 
-		let mut profname = match profpath.to_str() {
+		let profname = match profpath.to_str() {
 			Some(v) => v,
 			None =>  { return Err(MensagoError::ErrBadValue) },
 		};
 		if profname.len() == 0 {
 			return Err(MensagoError::ErrEmptyData);
 		}
-		profname = match profpath.parent() {
-			Some(v) => v.to_str().unwrap(),
+		let profname = match profpath.file_name() {
+			Some(v) => v.to_str().unwrap().to_lowercase(),
 			None => { return Err(MensagoError::ErrBadValue) },
 		};
 		
 		let mut profile = Profile{
-			name: String::from(profname),
+			name: profname,
 			path: PathBuf::from(profpath),
 			is_default: false,
 			uid: None,
@@ -164,6 +277,10 @@ impl Profile {
 			domain: None,
 			devid: None,
 			config: Config::new(""),
+			mode: ProfileMode::ReadWrite,
+			active: false,
+			monitor: None,
+			memory: None,
 		};
 		
 		let mut defpath = profile.path.to_path_buf();
@@ -175,9 +292,53 @@ impl Profile {
 		Ok(profile)
 	}
 
+	/// Creates a new profile which is kept entirely in memory. Its databases are ready for use.
+	pub fn new_memory(name: &str) -> Result<Profile, MensagoError> {
+
+		if name.len() == 0 {
+			return Err(MensagoError::ErrEmptyData)
+		}
+
+		let profile = Profile {
+			name: name.to_lowercase(),
+			path: PathBuf::new(),
+			is_default: false,
+			uid: None,
+			wid: None,
+			domain: None,
+			devid: Some(RandomID::generate()),
+			config: Config::new(""),
+			mode: ProfileMode::ReadWrite,
+			active: false,
+			monitor: None,
+			memory: Some(MemoryStore::new()?),
+		};
+		profile.reset_db()?;
+
+		Ok(profile)
+	}
+
+	/// Returns true if the profile is kept in memory instead of on disk
+	pub fn is_memory(&self) -> bool {
+		self.memory.is_some()
+	}
+
+	// Returns the URIs of the storage and secrets databases of an in-memory profile
+	pub(crate) fn get_memory_uris(&self) -> Option<(String, String)> {
+		self.memory.as_ref().map(|m| (m.storage_uri.clone(), m.secrets_uri.clone()))
+	}
+
 	/// Connects the profile to its associated database, initializing it if necessary.
 	pub fn activate(&mut self) -> Result<(), MensagoError> {
 
+		if self.memory.is_some() {
+			self.mode = ProfileMode::ReadWrite;
+			let db = self.open_storage()?;
+			self.config.load_from_db(&db)?;
+			self.active = true;
+			return Ok(())
+		}
+
 		let mut tempdir = self.path.clone();
 		tempdir.push("temp");
 		if !tempdir.exists() {
@@ -186,20 +347,174 @@ impl Profile {
 
 		let mut storagepath = self.path.clone();
 		storagepath.push("storage.db");
-		if storagepath.exists() {
+		if !storagepath.exists() {
+			self.reset_db()?;
+		}
+
+		// The monitor is opened before the config is loaded so that changes made in between are
+		// reported on the next refresh instead of being missed
+		self.mode = ProfileMode::ReadWrite;
+		self.monitor = Some(ChangeMonitor::open(&storagepath)?);
+
+		let db = rusqlite::Connection::open(storagepath)?;
+		set_wal_mode(&db)?;
+		update_message_schema(&db)?;
+		self.config.load_from_db(&db)?;
+		db.close().expect("BUG: Profile.activate(): error closing database");
+		self.active = true;
+
+		Ok(())
+	}
+
+	/// Connects the profile to its existing databases for reading only. Unlike `activate()`, this
+	/// doesn't create anything or write to the profile, so it is quick even for large profiles.
+	/// Immutable mode is faster still, but must only be used with profiles which no process is
+	/// using.
+	///
+	/// The databases use write-ahead logging, so SQLite can only open them read-only if the
+	/// profile's folder is writable or their `-wal` and `-shm` files already exist. Immutable mode
+	/// also ignores anything still in the write-ahead log. Deactivating a read-write profile
+	/// checkpoints the log, so a profile which was last closed cleanly has nothing left in it.
+	pub fn activate_readonly(&mut self, immutable: bool) -> Result<(), MensagoError> {
+
+		if self.memory.is_some() {
+			return Err(MensagoError::ErrUnimplemented)
+		}
+
+		let mut storagepath = self.path.clone();
+		storagepath.push("storage.db");
+		if !storagepath.exists() {
+			return Err(MensagoError::ErrNotFound)
+		}
+
+		if immutable {
+			self.mode = ProfileMode::Immutable;
+			self.monitor = None;
+		} else {
+			self.mode = ProfileMode::ReadOnly;
+			self.monitor = Some(ChangeMonitor::open(&storagepath)?);
+		}
 
-			let db = rusqlite::Connection::open(storagepath)?;
+		// The config table can't be created here, so a profile without one has an empty config
+		let db = self.open_db()?;
+		let has_config = db
+			.prepare("SELECT name FROM sqlite_master WHERE type='table' AND name='appconfig'")?
+			.exists([])?;
+		if has_config {
 			self.config.load_from_db(&db)?;
-			db.close().expect("BUG: Profile.activate(): error closing database");
-			return Ok(());
+		} else {
+			self.config = Config::new("");
 		}
+		self.active = true;
 
-		self.reset_db()
+		Ok(())
+	}
+
+	/// Releases the resources the profile holds while active: its connection for watching other
+	/// processes' changes and its loaded configuration. Unsaved configuration changes are written
+	/// to the database first, and the write-ahead logs are checkpointed. The profile can be
+	/// activated again later.
+	pub fn deactivate(&mut self) -> Result<(), MensagoError> {
+
+		if !self.active {
+			return Ok(())
+		}
+
+		if self.mode == ProfileMode::ReadWrite && self.config.is_modified() {
+			let db = self.open_db()?;
+			self.config.update_db(&db)?;
+		}
+
+		// Moving everything in the logs into the databases means read-only and immutable opens
+		// see every change. A process still using the profile can keep a log from being emptied,
+		// in which case SQLite reports it as busy instead of failing.
+		if self.mode == ProfileMode::ReadWrite && self.memory.is_none() {
+			for db in [self.open_storage()?, self.open_secrets()?] {
+				db.query_row("PRAGMA wal_checkpoint(TRUNCATE)", [], |_| Ok(()))?;
+			}
+		}
+		self.monitor = None;
+		self.config = Config::new("");
+		self.active = false;
+
+		Ok(())
+	}
+
+	/// Returns true if the profile has been activated and not deactivated since
+	pub fn is_active(&self) -> bool {
+		self.active
+	}
+
+	/// Returns how the profile accesses its databases
+	pub fn get_mode(&self) -> ProfileMode {
+		self.mode
+	}
+
+	/// Returns the number of files the profile keeps open while active
+	pub fn get_open_files(&self) -> usize {
+		match self.monitor {
+			Some(_) => MONITOR_OPEN_FILES,
+			None => 0,
+		}
+	}
+
+	/// Returns an estimate of how much memory the profile takes up while active, in bytes. The
+	/// databases of in-memory profiles aren't counted.
+	pub fn get_memory_usage(&self) -> usize {
+		let mut out = std::mem::size_of::<Profile>() + self.config.get_memory_usage();
+		if self.monitor.is_some() {
+			out += MONITOR_MEMORY_USAGE;
+		}
+		out
+	}
+
+	/// Checks for changes made to the profile by other processes since activation or the last
+	/// refresh and returns which parts of the storage database changed, such as CHANGE_MESSAGES,
+	/// so that the caller can update whatever it has cached from them. The profile's config is
+	/// reloaded if it changed, unless it has unsaved changes of its own.
+	pub fn refresh(&mut self) -> Result<Vec<String>, MensagoError> {
+
+		let changed = match self.monitor.as_mut() {
+			Some(v) => v.poll()?,
+			// Nothing else can change immutable or in-memory profiles
+			None if self.mode == ProfileMode::Immutable || self.memory.is_some() => {
+				return Ok(Vec::new())
+			},
+			None => return Err(MensagoError::ErrNotFound),
+		};
+
+		if changed.iter().any(|a| a == CHANGE_CONFIG) && !self.config.is_modified() {
+			let db = self.open_db()?;
+			self.config.load_from_db(&db)?;
+		}
+
+		Ok(changed)
+	}
+
+	/// Waits until no other process is writing to the profile and then locks it for writing. The
+	/// lock is advisory and held until the returned WriterLock is dropped. It is needed only for
+	/// series of changes which shouldn't be interleaved with another process's; single
+	/// transactions are safe without it.
+	pub fn lock_for_writing(&self) -> Result<WriterLock, MensagoError> {
+		if self.mode != ProfileMode::ReadWrite {
+			return Err(MensagoError::ErrReadOnly)
+		}
+		if self.memory.is_some() {
+			return Ok(WriterLock::uncontended())
+		}
+		let mut lockpath = self.path.clone();
+		lockpath.push("profile.lock");
+		WriterLock::acquire(&lockpath)
 	}
 
 	/// Sets the profile's internal flag that it is the default profile
 	pub fn set_default(&mut self, is_default: bool) -> Result<(), MensagoError> {
 
+		if self.memory.is_some() {
+			self.is_default = is_default;
+			return Ok(())
+		}
+
 		let mut dbpath = self.path.clone();
 		dbpath.push("default.txt");
 		if is_default {
@@ -323,6 +638,9 @@ impl Profile {
 		if self.domain.is_some() && (self.uid.is_some() || self.wid.is_some()) {
 			return Err(MensagoError::ErrExists)
 		}
+		if self.mode != ProfileMode::ReadWrite {
+			return Err(MensagoError::ErrReadOnly)
+		}
 
 		let conn = self.open_db()?;
 
@@ -356,7 +674,9 @@ impl Profile {
 			}
 		}
 		
-		w.add_to_db(pw)?;
+		// The profile's own connection is used so that in-memory profiles work no matter how the
+		// workspace was created
+		w.add_to_conn(&conn, pw)?;
 
 		self.wid = w.get_wid();
 		self.uid = w.get_uid();
@@ -368,6 +688,35 @@ impl Profile {
 	/// Reinitializes the profile's database to empty
 	pub fn reset_db(&self) -> Result<(),MensagoError> {
 
+		if self.mode != ProfileMode::ReadWrite {
+			return Err(MensagoError::ErrReadOnly)
+		}
+
+		if let Some(store) = self.memory.as_ref() {
+			let strdata = [
+				(&store.storage_uri, STORAGE_DB_SETUP_COMMANDS),
+				(&store.secrets_uri, SECRETS_DB_SETUP_COMMANDS),
+			];
+			for s in strdata {
+				let conn = open_memory_db(s.0)?;
+				let tables = conn
+					.prepare("SELECT name FROM sqlite_master WHERE type='table'
+						AND name NOT LIKE 'sqlite_%'")?
+					.query_map([], |row| row.get::<usize,String>(0))?
+					.collect::<Result<Vec<String>, rusqlite::Error>>()?;
+				for table in tables {
+					conn.execute(&format!("DROP TABLE '{}'", table), [])?;
+				}
+				match conn.execute_batch(s.1) {
+					Ok(_) => (),
+					Err(e) => {
+						return Err(MensagoError::ErrDatabaseException(String::from(e.to_string())));
+					}
+				}
+			}
+			return Ok(())
+		}
+
 		let strdata = [
 			("storage.db", STORAGE_DB_SETUP_COMMANDS),
 			("secrets.db", SECRETS_DB_SETUP_COMMANDS),
@@ -395,6 +744,7 @@ impl Profile {
 						return Err(MensagoError::ErrDatabaseException(String::from(e.to_string())));
 					}
 				}
+				set_wal_mode(&conn)?;
 			}
 		}
 
@@ -445,25 +795,253 @@ impl Profile {
 		}
 	}
 
+	/// Opens a new connection to the profile's storage database
+	pub fn open_storage(&self) -> Result<rusqlite::Connection, MensagoError> {
+		Ok(self.open_db()?)
+	}
+
+	/// Opens a new connection to the profile's secrets database
+	pub fn open_secrets(&self) -> Result<rusqlite::Connection, MensagoError> {
+		if let Some(store) = self.memory.as_ref() {
+			return Ok(open_memory_db(&store.secrets_uri)?)
+		}
+		let mut dbpath = self.path.clone();
+		dbpath.push("secrets.db");
+		match self.mode {
+			ProfileMode::ReadWrite => {
+				Ok(rusqlite::Connection::open_with_flags(dbpath,
+					rusqlite::OpenFlags::SQLITE_OPEN_READ_WRITE)?)
+			},
+			ProfileMode::ReadOnly => Ok(open_db_readonly(&dbpath, false)?),
+			ProfileMode::Immutable => Ok(open_db_readonly(&dbpath, true)?),
+		}
+	}
+
+	/// Saves a file, such as an attachment, in the profile. In-memory profiles keep it in memory.
+	/// Other profiles save it in the 'files' folder.
+	pub fn put_file(&mut self, name: &str, data: &[u8]) -> Result<(), MensagoError> {
+
+		check_file_name(name)?;
+		if self.mode != ProfileMode::ReadWrite {
+			return Err(MensagoError::ErrReadOnly)
+		}
+		if let Some(store) = self.memory.as_mut() {
+			store.files.insert(String::from(name), data.to_vec());
+			return Ok(())
+		}
+
+		let mut filepath = self.path.clone();
+		filepath.push("files");
+		fs::create_dir_all(&filepath)?;
+		filepath.push(name);
+		Ok(fs::write(filepath, data)?)
+	}
+
+	/// Returns the contents of a file saved with `put_file()`
+	pub fn get_file(&self, name: &str) -> Result<Vec<u8>, MensagoError> {
+
+		check_file_name(name)?;
+		if let Some(store) = self.memory.as_ref() {
+			return match store.files.get(name) {
+				Some(v) => Ok(v.clone()),
+				None => Err(MensagoError::ErrNotFound),
+			}
+		}
+
+		let mut filepath = self.path.clone();
+		filepath.push("files");
+		filepath.push(name);
+		if !filepath.exists() {
+			return Err(MensagoError::ErrNotFound)
+		}
+		Ok(fs::read(filepath)?)
+	}
+
+	/// Deletes a file saved with `put_file()`
+	pub fn remove_file(&mut self, name: &str) -> Result<(), MensagoError> {
+
+		check_file_name(name)?;
+		if self.mode != ProfileMode::ReadWrite {
+			return Err(MensagoError::ErrReadOnly)
+		}
+		if let Some(store) = self.memory.as_mut() {
+			return match store.files.remove(name) {
+				Some(_) => Ok(()),
+				None => Err(MensagoError::ErrNotFound),
+			}
+		}
+
+		let mut filepath = self.path.clone();
+		filepath.push("files");
+		filepath.push(name);
+		if !filepath.exists() {
+			return Err(MensagoError::ErrNotFound)
+		}
+		Ok(fs::remove_file(filepath)?)
+	}
+
+	/// Saves a copy of the profile's databases and files to the specified folder, which is
+	/// created if needed. The copy is an ordinary profile which can be loaded from disk. This is
+	/// mostly for keeping the contents of an in-memory profile, but works with any profile.
+	pub fn snapshot(&self, dest: &Path) -> Result<(), MensagoError> {
+
+		fs::create_dir_all(dest)?;
+		let dbs = [("storage.db", self.open_storage()?), ("secrets.db", self.open_secrets()?)];
+		for (filename, conn) in dbs {
+			let mut dbpath = dest.to_path_buf();
+			dbpath.push(filename);
+			if dbpath.exists() {
+				fs::remove_file(&dbpath)?;
+			}
+			let pathstr = match dbpath.to_str() {
+				Some(v) => v.replace("'", "''"),
+				None => return Err(MensagoError::ErrBadValue),
+			};
+			conn.execute(&format!("VACUUM INTO '{}'", pathstr), [])?;
+		}
+
+		let mut filedir = dest.to_path_buf();
+		filedir.push("files");
+		match self.memory.as_ref() {
+			Some(store) => {
+				if store.files.len() > 0 {
+					fs::create_dir_all(&filedir)?;
+				}
+				for (name, data) in store.files.iter() {
+					fs::write(filedir.join(name), data)?;
+				}
+			},
+			None => {
+				let mut srcdir = self.path.clone();
+				srcdir.push("files");
+				if srcdir.exists() {
+					fs::create_dir_all(&filedir)?;
+					for item in fs::read_dir(&srcdir)? {
+						let entry = item?;
+						if entry.path().is_file() {
+							fs::copy(entry.path(), filedir.join(entry.file_name()))?;
+						}
+					}
+				}
+			},
+		}
+
+		if self.is_default {
+			fs::File::create(dest.join("default.txt"))?;
+		}
+
+		Ok(())
+	}
+
 	/// Private function to make code that deals with the database easier. It also ensures that
 	/// an error is returned if the database doesn't exist.
 	fn open_db(&self) -> Result<rusqlite::Connection, rusqlite::Error> {
-		
+
+		if let Some(store) = self.memory.as_ref() {
+			return open_memory_db(&store.storage_uri)
+		}
+
 		let mut dbpath = self.path.clone();
 		dbpath.push("storage.db");
-		rusqlite::Connection::open_with_flags(dbpath, rusqlite::OpenFlags::SQLITE_OPEN_READ_WRITE)
+		match self.mode {
+			ProfileMode::ReadWrite => {
+				rusqlite::Connection::open_with_flags(dbpath,
+					rusqlite::OpenFlags::SQLITE_OPEN_READ_WRITE)
+			},
+			ProfileMode::ReadOnly => open_db_readonly(&dbpath, false),
+			ProfileMode::Immutable => open_db_readonly(&dbpath, true),
+		}
+	}
+}
+
+/// Checks that a file name given to a Profile is a plain name which can't refer to something
+/// outside the profile's files
+pub(crate) fn check_file_name(name: &str) -> Result<(), MensagoError> {
+	if name.len() == 0 {
+		return Err(MensagoError::ErrEmptyData)
+	}
+	if name.contains('/') || name.contains('\\') || name == "." || name == ".." {
+		return Err(MensagoError::ErrBadValue)
+	}
+	Ok(())
+}
+
+/// Opens a database for reading only with a large memory map. Immutable databases are opened
+/// through a URI because that is the only way to pass SQLite the flag.
+fn open_db_readonly(dbpath: &Path, immutable: bool)
+-> Result<rusqlite::Connection, rusqlite::Error> {
+
+	let flags = rusqlite::OpenFlags::SQLITE_OPEN_READ_ONLY |
+		rusqlite::OpenFlags::SQLITE_OPEN_NO_MUTEX;
+	let conn = if immutable {
+		rusqlite::Connection::open_with_flags(path_to_uri(dbpath) + "?immutable=1",
+			flags | rusqlite::OpenFlags::SQLITE_OPEN_URI)?
+	} else {
+		rusqlite::Connection::open_with_flags(dbpath, flags)?
+	};
+
+	// Memory mapping is only an optimization, so it isn't an error if the platform doesn't have it
+	let _ = conn.query_row(&format!("PRAGMA mmap_size={}", READONLY_MMAP_SIZE), [],
+		|row| row.get::<usize,i64>(0));
+
+	Ok(conn)
+}
+
+/// Converts a path to a SQLite file URI, escaping the characters which have special meaning
+fn path_to_uri(path: &Path) -> String {
+
+	let pathstr = path.to_string_lossy();
+	let mut out = String::from("file:");
+
+	// Windows paths with a drive letter have to be made absolute URI paths
+	if pathstr.chars().nth(1) == Some(':') {
+		out.push('/');
+	}
+	for c in pathstr.chars() {
+		match c {
+			'\\' if cfg!(windows) => out.push('/'),
+			'%' => out.push_str("%25"),
+			'?' => out.push_str("%3f"),
+			'#' => out.push_str("%23"),
+			_ => out.push(c),
+		}
+	}
+
+	out
+}
+
+/// Switches a database to write-ahead logging, which lets other processes read while one writes.
+/// The setting is saved in the database file, so this only does work the first time.
+fn set_wal_mode(conn: &rusqlite::Connection) -> Result<(), MensagoError> {
+	let mode = conn.query_row("PRAGMA journal_mode=WAL", [], |row| row.get::<usize,String>(0))?;
+	if mode.to_lowercase() != "wal" {
+		return Err(MensagoError::ErrDatabaseException(
+			format!("Unable to enable write-ahead logging, mode is {}", mode)))
 	}
+	Ok(())
 }
 
 /// The ProfileManager is an type which creates and deletes user on-disk profiles and otherwise
 /// provides access to them.
+///
+/// A manager can hold thousands of profiles, such as on a machine hosting many users. Profiles
+/// are looked up by name through an index, and loading them only reads their directory names.
+/// Nothing else is read until a profile is activated. Activated profiles are kept in order of
+/// use, and when they hold more open files or memory than the limits set with
+/// `set_open_limits()`, the least recently used ones are deactivated. The active profile is
+/// never deactivated this way.
 #[derive(Debug)]
 pub struct ProfileManager {
 	profiles: Vec<Profile>,
+	names: HashMap<String, usize>,
+	open: Vec<String>,
+	max_open_files: usize,
+	max_open_memory: usize,
 	profile_folder: PathBuf,
 	active_index: isize,
 	default_index: isize,
 	profile_id: String,
+	in_memory: bool,
 }
 
 impl ProfileManager {
@@ -473,15 +1051,35 @@ impl ProfileManager {
 
 		ProfileManager {
 			profiles: Vec::<Profile>::new(),
+			names: HashMap::new(),
+			open: Vec::new(),
+			max_open_files: 0,
+			max_open_memory: 0,
 			profile_folder: profile_path.clone(),
 			active_index: -1,
 			default_index: -1,
 			profile_id: String::from(""),
+			in_memory: false,
 		}
 	}
 
+	/// Creates a new ProfileManager whose profiles are kept in memory instead of on disk. This is
+	/// useful for short-lived sessions and for tests.
+	pub fn new_in_memory() -> ProfileManager {
+		let mut out = ProfileManager::new(&PathBuf::new());
+		out.in_memory = true;
+		out
+	}
+
 	/// Sets the named profile as active.
 	pub fn activate_profile(&mut self, name: &str) -> Result<&Profile, MensagoError> {
+		self.activate_profile_with_mode(name, ProfileMode::ReadWrite)
+	}
+
+	/// Sets the named profile as active, accessing its databases in the specified mode. This is
+	/// meant for tools which only read from the profile, such as indexers and exporters.
+	pub fn activate_profile_with_mode(&mut self, name: &str, mode: ProfileMode)
+	-> Result<&Profile, MensagoError> {
 
 		if name.len() == 0 {
 			return Err(MensagoError::ErrEmptyData);
@@ -495,17 +1093,69 @@ impl ProfileManager {
 
 		self.profile_id = name_squashed;
 		self.active_index = active_index;
-		self.profiles[active_index as usize].activate()?;
+		self.open_index(active_index as usize, mode)?;
 
-		// Force loading of basic identity info if it hasn't already been done
-		match self.profiles[active_index as usize].get_identity() {
-			Ok(_) => (),
-			Err(_) => {
-				// We ignore errors because uninitialized profiles won't have any identity info
-			},
+		return Ok(&self.profiles[active_index as usize]);
+	}
+
+	/// Activates the named profile if it isn't already and returns it without making it the
+	/// active profile. This is meant for servers and daemons which work with many users' profiles
+	/// at once. Opening a profile may deactivate the least recently used ones to stay within the
+	/// limits set by `set_open_limits()`.
+	pub fn open_profile(&mut self, name: &str) -> Result<&mut Profile, MensagoError> {
+
+		if name.len() == 0 {
+			return Err(MensagoError::ErrEmptyData);
 		}
 
-		return Ok(&self.profiles[active_index as usize]);
+		let index = match self.index_for_name(&name.to_lowercase()) {
+			x if x >= 0 => x as usize,
+			_ => return Err(MensagoError::ErrNotFound)
+		};
+
+		if !self.profiles[index].is_active() {
+			self.open_index(index, ProfileMode::ReadWrite)?;
+		} else {
+			self.touch_profile(index);
+		}
+
+		Ok(&mut self.profiles[index])
+	}
+
+	/// Deactivates the named profile, saving any unsaved configuration changes. The active profile
+	/// can't be closed.
+	pub fn close_profile(&mut self, name: &str) -> Result<(), MensagoError> {
+
+		if name.len() == 0 {
+			return Err(MensagoError::ErrEmptyData);
+		}
+
+		let index = match self.index_for_name(&name.to_lowercase()) {
+			x if x >= 0 => x,
+			_ => return Err(MensagoError::ErrNotFound)
+		};
+		if index == self.active_index {
+			return Err(MensagoError::ErrBadValue)
+		}
+
+		let profile = &mut self.profiles[index as usize];
+		self.open.retain(|v| *v != profile.name);
+		profile.deactivate()
+	}
+
+	/// Sets how many files and how much memory, in bytes, activated profiles may hold between
+	/// them. A limit of 0 means unlimited, which is the default. Profiles over the new limits are
+	/// deactivated right away.
+	pub fn set_open_limits(&mut self, max_files: usize, max_memory: usize)
+	-> Result<(), MensagoError> {
+		self.max_open_files = max_files;
+		self.max_open_memory = max_memory;
+		self.enforce_open_limits(None)
+	}
+
+	/// Returns the number of profiles which are currently activated
+	pub fn count_open_profiles(&self) -> usize {
+		self.profiles.iter().filter(|p| p.is_active()).count()
 	}
 
 	/// Returns the number of profiles in the user's profile folder
@@ -532,6 +1182,18 @@ impl ProfileManager {
 			return Err(MensagoError::ErrExists);
 		}
 
+		if self.in_memory {
+			let mut profile = Profile::new_memory(&name_squashed)?;
+			if self.count_profiles() == 0 {
+				profile.is_default = true;
+				self.default_index = 0;
+			}
+			self.profiles.push(profile);
+			let length = self.profiles.len() - 1;
+			self.names.insert(name_squashed, length);
+			return Ok(self.profiles.get_mut(length).unwrap())
+		}
+
 		let mut new_profile_path = PathBuf::from(&self.profile_folder);
 		new_profile_path.push(&name_squashed);
 		match fs::DirBuilder::new().recursive(true).create(new_profile_path.as_path()) {
@@ -548,12 +1210,16 @@ impl ProfileManager {
 			domain: None,
 			devid: Some(RandomID::generate()),
 			config: Config::new(""),
+			mode: ProfileMode::ReadWrite,
+			active: false,
+			monitor: None,
+			memory: None,
 		};
 
 		if self.count_profiles() == 0 {
 			profile.is_default = true;
-			self.default_index = 1;
-			
+			self.default_index = 0;
+
 			let mut defaultpath = PathBuf::from(&self.profile_folder);
 			defaultpath.push(&name_squashed);
 			defaultpath.push("default.txt");
@@ -561,11 +1227,12 @@ impl ProfileManager {
 				let _ = fs::File::create(defaultpath)?;
 			}
 		}
-		
+
 		profile.reset_db()?;
 		self.profiles.push(profile);
 
 		let length = self.profiles.len() - 1;
+		self.names.insert(name_squashed, length);
 		Ok(self.profiles.get_mut(length).unwrap())
 	}
 
@@ -587,15 +1254,26 @@ impl ProfileManager {
 		};
 
 		let profile = self.profiles.remove(pindex as usize);
-		if Path::new(profile.path.as_path()).exists() {
-			fs::remove_dir_all(profile.path.as_path())?
+		self.open.retain(|v| *v != name_squashed);
+		self.rebuild_names();
+		self.active_index = shift_index(self.active_index, pindex);
+		self.default_index = shift_index(self.default_index, pindex);
+
+		// The monitor has to be closed before the files can be removed on some platforms
+		let is_default = profile.is_default();
+		let is_memory = profile.is_memory();
+		let path = profile.path.clone();
+		drop(profile);
+		if !is_memory && path.exists() {
+			fs::remove_dir_all(path.as_path())?
 		}
 
-		if profile.is_default() && self.profiles.len() > 0 {
+		if is_default && self.profiles.len() > 0 {
 			match self.profiles[0].set_default(true) {
 				Ok(_) => (),
 				Err(e) => return Err(e)
 			}
+			self.default_index = 0;
 		}
 
 		Ok(())
@@ -639,7 +1317,7 @@ impl ProfileManager {
 			},
 		}
 	}
-	
+
 	/// Returns the specified profile
 	pub fn get_profile(&self, index: usize) -> Option<&Profile> {
 		self.profiles.get(index)
@@ -650,6 +1328,15 @@ impl ProfileManager {
 		self.profiles.get_mut(index)
 	}
 
+	/// Returns the profile with the specified name. Unlike `open_profile()`, this doesn't activate
+	/// it.
+	pub fn get_profile_by_name(&self, name: &str) -> Option<&Profile> {
+		match self.index_for_name(&name.to_lowercase()) {
+			x if x >= 0 => self.profiles.get(x as usize),
+			_ => None,
+		}
+	}
+
 	/// Returns a Vec of all available profiles
 	pub fn get_profiles(&self) -> &Vec<Profile> {
 		&self.profiles
@@ -659,9 +1346,13 @@ impl ProfileManager {
 	/// manager will look in ~/.config/mensago on POSIX platforms and %LOCALAPPDATA%\mensago on
 	/// Windows. It returns None on success or a String error.
 	pub fn load_profiles(&mut self, profile_path: Option<&PathBuf>) -> Result<(), MensagoError> {
-		
+
 		self.active_index = -1;
 
+		if self.in_memory {
+			return self.load_memory_profiles()
+		}
+
 		self.profile_folder = match profile_path {
 			Some(s) => PathBuf::from(s),
 			None => {
@@ -684,25 +1375,30 @@ impl ProfileManager {
 		}
 
 		self.profiles.clear();
+		self.names.clear();
+		self.open.clear();
+		self.default_index = -1;
 		for item in fs::read_dir(self.profile_folder.as_path())? {
 			let entry = item?;
-			let itempath  = entry.path();
-			if !itempath.is_dir() {
+
+			// The entry's type usually comes from the directory listing itself, which saves a
+			// stat call per profile
+			if !entry.file_type()?.is_dir() {
 				continue;
 			}
 
-			let mut profile = Profile::new(&itempath)?;
+			let mut profile = Profile::new(&entry.path())?;
 			if profile.is_default() {
 				if self.default_index >= 0 {
 					// If we have more than one profile marked as default, the one in the list
 					// with the lower index retains that status
 					profile.set_default(false)?;
-					self.profiles.push(profile);
 				} else {
-					self.profiles.push(profile);
-					self.default_index = (self.profiles.len()-1) as isize;
+					self.default_index = self.profiles.len() as isize;
 				}
 			}
+			self.names.insert(profile.name.clone(), self.profiles.len());
+			self.profiles.push(profile);
 		}
 
 		// If we've gotten through the entire loading process and we haven't got a single profile
@@ -717,17 +1413,39 @@ impl ProfileManager {
 				}
 			}
 		}
-		
+
+		// If none of the profiles is marked as the default, the first one becomes the default
+		if self.default_index < 0 {
+			let name = self.profiles[0].name.clone();
+			self.set_default_profile(&name)?;
+		}
+
 		let default_name = match self.get_default_profile() {
 			Some(v) => String::from(&v.name),
 			None => {
-				return Err(MensagoError::ErrProgramException( 
+				return Err(MensagoError::ErrProgramException(
 					String::from("BUG: Couldn't find default profile in load_profiles()")));
 			},
 		};
 
 		self.activate_profile(&default_name)?;
-		
+
+		Ok(())
+	}
+
+	// In-memory managers have nothing to load, so they only make sure that there is a default
+	// profile and activate it, as load_profiles() does for those on disk
+	fn load_memory_profiles(&mut self) -> Result<(), MensagoError> {
+
+		if self.profiles.len() == 0 {
+			self.create_profile("primary")?;
+		}
+		let default_name = match self.get_default_profile() {
+			Some(v) => v.name.clone(),
+			None => self.profiles[0].name.clone(),
+		};
+		self.activate_profile(&default_name)?;
+
 		Ok(())
 	}
 
@@ -750,17 +1468,37 @@ impl ProfileManager {
 			return Err(MensagoError::ErrExists)
 		}
 
-		let oldpath = self.profiles[index as usize].path.clone();
-		let mut newpath = oldpath.parent().unwrap().to_path_buf();
-		newpath.push(&new_squashed);
+		// The index is only updated once the profile's folder has actually been moved, so a failed
+		// rename leaves it pointing at the profile under its old name
+		let index = index as usize;
+		if !self.profiles[index].is_memory() {
+			let oldpath = self.profiles[index].path.clone();
+			let mut newpath = oldpath.parent().unwrap().to_path_buf();
+			newpath.push(&new_squashed);
 
-		fs::rename(&oldpath, &newpath)?;
+			fs::rename(&oldpath, &newpath)?;
+			self.profiles[index].path = newpath;
+		}
 
-		self.profiles[index as usize].name = new_squashed;
-		self.profiles[index as usize].path = newpath;
+		self.profiles[index].name = new_squashed.clone();
+		self.names.remove(&old_squashed);
+		self.names.insert(new_squashed.clone(), index);
+		for name in self.open.iter_mut().filter(|v| **v == old_squashed) {
+			*name = new_squashed.clone();
+		}
+		if self.profile_id == old_squashed {
+			self.profile_id = new_squashed;
+		}
 
-		if index == self.active_index {
-			self.profiles[index as usize].activate()?;
+		// The change monitor has to be reopened at the new location, keeping the mode the profile
+		// was opened in
+		let profile = &mut self.profiles[index];
+		if profile.is_active() && !profile.is_memory() {
+			match profile.get_mode() {
+				ProfileMode::ReadWrite => profile.activate()?,
+				ProfileMode::ReadOnly => profile.activate_readonly(false)?,
+				ProfileMode::Immutable => profile.activate_readonly(true)?,
+			}
 		}
 
 		Ok(())
@@ -781,50 +1519,137 @@ impl ProfileManager {
 			return Ok(());
 		}
 
-		let mut oldindex: isize = -1;
-		for i in 0..self.profiles.len() {
-			if self.profiles[i].is_default() {
-				oldindex = i as isize;
-				break
-			}
-		}
-
 		let name_squashed = name.to_lowercase();
 		let newindex = match self.index_for_name(&name_squashed) {
 			x if x >= 0 => x,
 			_ => return Err(MensagoError::ErrNotFound)
 		};
 
-		if oldindex <= 0 {
-			if name_squashed == self.profiles[oldindex as usize].name {
+		let oldindex = self.default_index;
+		if oldindex >= 0 {
+			if oldindex == newindex {
 				return Ok(())
 			}
 			self.profiles[oldindex as usize].set_default(false)?;
 		}
 
-		self.profiles[newindex as usize].set_default(true)
+		self.profiles[newindex as usize].set_default(true)?;
+		self.default_index = newindex;
+		Ok(())
 	}
 
 	/// Obtains the index for a profile with the supplied name. Returns None on error.
 	fn index_for_name(&self, name: &str) -> isize {
-		
-		if name.len() == 0 {
-			return -1
+		match self.names.get(name) {
+			Some(v) => *v as isize,
+			None => -1,
+		}
+	}
+
+	// Rebuilds the name index after profiles have been removed from the list
+	fn rebuild_names(&mut self) {
+		self.names = self.profiles.iter()
+			.enumerate()
+			.map(|(i, p)| (p.name.clone(), i))
+			.collect();
+	}
+
+	// Activates the profile at the specified index, marks it as the most recently used, and then
+	// deactivates others if the limits have been exceeded
+	fn open_index(&mut self, index: usize, mode: ProfileMode) -> Result<(), MensagoError> {
+
+		let profile = &mut self.profiles[index];
+		match mode {
+			ProfileMode::ReadWrite => profile.activate()?,
+			ProfileMode::ReadOnly => profile.activate_readonly(false)?,
+			ProfileMode::Immutable => profile.activate_readonly(true)?,
 		}
 
-		for i in 0..self.profiles.len() {
-			let p = match self.profiles.get(i) {
-				Some(v) => v,
-				None => { return -1; },
+		// Force loading of basic identity info if it hasn't already been done
+		match profile.get_identity() {
+			Ok(_) => (),
+			Err(_) => {
+				// We ignore errors because uninitialized profiles won't have any identity info
+			},
+		}
+
+		self.touch_profile(index);
+		self.enforce_open_limits(Some(index))
+	}
+
+	// Moves a profile to the most recently used end of the open list. In-memory profiles aren't
+	// tracked because deactivating them wouldn't free their databases.
+	fn touch_profile(&mut self, index: usize) {
+
+		let profile = &self.profiles[index];
+		if profile.is_memory() {
+			return
+		}
+		if let Some(pos) = self.open.iter().position(|v| *v == profile.name) {
+			if pos == self.open.len() - 1 {
+				return
+			}
+			self.open.remove(pos);
+		}
+		self.open.push(profile.name.clone());
+	}
+
+	// Deactivates the least recently used profiles until the open profiles are within the limits.
+	// The active profile and the one specified are left alone.
+	fn enforce_open_limits(&mut self, keep: Option<usize>) -> Result<(), MensagoError> {
+
+		if self.max_open_files == 0 && self.max_open_memory == 0 {
+			return Ok(())
+		}
+
+		let mut files = 0;
+		let mut memory = 0;
+		for name in self.open.iter() {
+			if let Some(i) = self.names.get(name) {
+				files += self.profiles[*i].get_open_files();
+				memory += self.profiles[*i].get_memory_usage();
+			}
+		}
+
+		let mut pos = 0;
+		while pos < self.open.len() {
+			if (self.max_open_files == 0 || files <= self.max_open_files)
+				&& (self.max_open_memory == 0 || memory <= self.max_open_memory) {
+				break
+			}
+
+			let index = match self.names.get(&self.open[pos]) {
+				Some(v) => *v,
+				None => {
+					self.open.remove(pos);
+					continue
+				},
 			};
-			
-			if p.name == name {
-				return i as isize;
+			if Some(index) == keep || index as isize == self.active_index {
+				pos += 1;
+				continue
 			}
+
+			let profile = &mut self.profiles[index];
+			files -= profile.get_open_files();
+			memory -= profile.get_memory_usage();
+			self.open.remove(pos);
+			profile.deactivate()?;
 		}
 
+		Ok(())
+	}
+}
+
+// Adjusts an index into the profile list after the profile at the specified index was removed
+fn shift_index(index: isize, removed: isize) -> isize {
+	if index == removed {
 		-1
-	}	
+	} else if index > removed {
+		index - 1
+	} else {
+		index
+	}
 }
 
 #[cfg(test)]
@@ -1001,7 +1826,46 @@ mod tests {
 		match pm.rename_profile("foo", "secondary") {
 			Ok(_) => (),
 			Err(e) => {
-				return Err(format!("{} failed to rename profile: {}", testname, e.to_string())) 
+				return Err(format!("{} failed to rename profile: {}", testname, e.to_string()))
+			},
+		}
+
+		// A folder which can't be renamed over leaves the profile under its old name
+		let mut strayfile = test_path.clone();
+		strayfile.push("stray");
+		fs::create_dir_all(&strayfile).unwrap();
+		strayfile.push("file.txt");
+		fs::write(&strayfile, "").unwrap();
+		match pm.rename_profile("secondary", "stray") {
+			Ok(_) => {
+				return Err(format!("{}: rename over a non-empty folder succeeded", testname))
+			},
+			Err(_) => (),
+		}
+		if pm.get_profile_by_name("secondary").is_none()
+			|| pm.get_profile_by_name("stray").is_some() {
+			return Err(format!("{}: failed rename changed the profile index", testname))
+		}
+
+		// Renaming an active profile keeps the mode it was opened in
+		match pm.activate_profile_with_mode("secondary", ProfileMode::ReadOnly) {
+			Ok(_) => (),
+			Err(e) => {
+				return Err(format!("{} failed to activate profile read-only: {}", testname,
+					e.to_string()))
+			},
+		}
+		match pm.rename_profile("secondary", "tertiary") {
+			Ok(_) => (),
+			Err(e) => {
+				return Err(format!("{} failed to rename active profile: {}", testname,
+					e.to_string()))
+			},
+		}
+		match pm.get_active_profile() {
+			Some(p) if p.name == "tertiary" && p.get_mode() == ProfileMode::ReadOnly => (),
+			_ => {
+				return Err(format!("{}: renamed profile not reactivated read-only", testname))
 			},
 		}
 
@@ -1104,6 +1968,273 @@ mod tests {
 			},
 		}
 
+		Ok(())
+	}
+	#[test]
+	fn test_profile_readonly() -> Result<(), String> {
+
+		let testname = String::from("profile_readonly");
+		let test_path = setup_test(&testname);
+		let mut pm = ProfileManager::new(&test_path);
+		match pm.load_profiles(Some(&test_path)) {
+			Ok(_) => (),
+			Err(e) => {
+				return Err(format!("{} failed to load profiles: {}", testname, e.to_string()))
+			},
+		}
+
+		// Save a config value to check that read-only profiles still load the config
+		{
+			let profile = pm.get_active_profile_mut().unwrap();
+			let mut dbpath = profile.path.clone();
+			dbpath.push("storage.db");
+			let conn = rusqlite::Connection::open(&dbpath).unwrap();
+			profile.config.set("test_field", ConfigScope::Global, "", "value").unwrap();
+			match profile.config.save_to_db(&conn) {
+				Ok(_) => (),
+				Err(e) => {
+					return Err(format!("{} failed to save config: {}", testname, e.to_string()))
+				},
+			}
+		}
+
+		for mode in [ProfileMode::ReadOnly, ProfileMode::Immutable] {
+			let profile = match pm.activate_profile_with_mode("primary", mode) {
+				Ok(v) => v,
+				Err(e) => {
+					return Err(format!("{} failed to activate profile as {:?}: {}", testname, mode,
+						e.to_string()))
+				},
+			};
+
+			if profile.get_mode() != mode
+				|| profile.config.get("test_field").ok() != Some("value") {
+				return Err(format!("{}: profile not loaded correctly as {:?}", testname, mode))
+			}
+
+			match profile.reset_db() {
+				Err(MensagoError::ErrReadOnly) => (),
+				_ => {
+					return Err(format!("{}: reset_db() allowed in {:?} mode", testname, mode))
+				},
+			}
+		}
+
+		// Read-only activation never creates databases
+		let mut dbpath = pm.get_active_profile().unwrap().path.clone();
+		dbpath.push("storage.db");
+		fs::remove_file(&dbpath).unwrap();
+		match pm.activate_profile_with_mode("primary", ProfileMode::ReadOnly) {
+			Err(MensagoError::ErrNotFound) => (),
+			_ => {
+				return Err(format!("{}: activated profile without a database", testname))
+			},
+		}
+		if dbpath.exists() {
+			return Err(format!("{}: read-only activation created a database", testname))
+		}
+
+		Ok(())
+	}
+
+	#[test]
+	fn test_profile_memory() -> Result<(), String> {
+
+		let testname = String::from("profile_memory");
+		let test_path = setup_test(&testname);
+
+		let mut pm = ProfileManager::new_in_memory();
+		match pm.load_profiles(None) {
+			Ok(_) => (),
+			Err(e) => {
+				return Err(format!("{} failed to load profiles: {}", testname, e.to_string()))
+			},
+		}
+		if pm.count_profiles() != 1 || pm.get_default_profile().is_none() {
+			return Err(format!("{}: in-memory manager didn't create a default profile", testname))
+		}
+
+		// Profiles are separate from each other and work like those on disk
+		match pm.create_profile("secondary") {
+			Ok(_) => (),
+			Err(e) => {
+				return Err(format!("{} failed to create profile: {}", testname, e.to_string()))
+			},
+		}
+		let profile = pm.get_active_profile_mut().unwrap();
+		{
+			let conn = profile.open_storage().unwrap();
+			profile.config.set("test_field", ConfigScope::Global, "", "value").unwrap();
+			profile.config.save_to_db(&conn).unwrap();
+		}
+		profile.put_file("attachment.txt", b"attachment data").unwrap();
+		match profile.put_file("../escape.txt", b"") {
+			Err(MensagoError::ErrBadValue) => (),
+			_ => return Err(format!("{}: put_file() accepted a path", testname)),
+		}
+		if profile.get_file("attachment.txt").unwrap() != b"attachment data" {
+			return Err(format!("{}: attachment data mismatch", testname))
+		}
+		if pm.get_profile(1).unwrap().open_storage().unwrap()
+			.query_row("SELECT COUNT(*) FROM appconfig", [], |row| row.get::<usize,i64>(0))
+			.is_ok() {
+			return Err(format!("{}: profiles share a database", testname))
+		}
+		if test_path.read_dir().unwrap().count() != 0 {
+			return Err(format!("{}: in-memory profiles wrote to disk", testname))
+		}
+
+		// A snapshot can be loaded like any other profile
+		let mut snappath = test_path.clone();
+		snappath.push("primary");
+		match pm.get_active_profile().unwrap().snapshot(&snappath) {
+			Ok(_) => (),
+			Err(e) => {
+				return Err(format!("{} failed to save snapshot: {}", testname, e.to_string()))
+			},
+		}
+
+		let mut diskpm = ProfileManager::new(&test_path);
+		match diskpm.load_profiles(Some(&test_path)) {
+			Ok(_) => (),
+			Err(e) => {
+				return Err(format!("{} failed to load snapshot: {}", testname, e.to_string()))
+			},
+		}
+		let restored = diskpm.get_active_profile().unwrap();
+		if restored.is_memory() || restored.config.get("test_field").ok() != Some("value")
+			|| restored.get_file("attachment.txt").ok() != Some(b"attachment data".to_vec()) {
+			return Err(format!("{}: snapshot contents mismatch", testname))
+		}
+
+		Ok(())
+	}
+	#[test]
+	fn test_profman_open_limits() -> Result<(), String> {
+
+		let testname = String::from("profman_open_limits");
+		let test_path = setup_test(&testname);
+		let mut pm = ProfileManager::new(&test_path);
+		match pm.load_profiles(Some(&test_path)) {
+			Ok(_) => (),
+			Err(e) => {
+				return Err(format!("{} failed to load profiles: {}", testname, e.to_string()))
+			},
+		}
+		for name in ["one", "two", "three"] {
+			match pm.create_profile(name) {
+				Ok(_) => (),
+				Err(e) => {
+					return Err(format!("{} failed to create profile {}: {}", testname, name,
+						e.to_string()))
+				},
+			}
+		}
+
+		// Room for the active profile and one other
+		let files = pm.get_active_profile().unwrap().get_open_files();
+		match pm.set_open_limits(files * 2, 0) {
+			Ok(_) => (),
+			Err(e) => {
+				return Err(format!("{} failed to set limits: {}", testname, e.to_string()))
+			},
+		}
+
+		match pm.open_profile("one") {
+			Ok(v) => v.config.set("test_field", ConfigScope::Global, "", "value").unwrap(),
+			Err(e) => {
+				return Err(format!("{} failed to open profile: {}", testname, e.to_string()))
+			},
+		}
+		match pm.open_profile("two") {
+			Ok(_) => (),
+			Err(e) => {
+				return Err(format!("{} failed to open profile: {}", testname, e.to_string()))
+			},
+		}
+
+		// The least recently used profile is closed, but never the active one
+		if pm.count_open_profiles() != 2 || pm.get_profile_by_name("one").unwrap().is_active()
+			|| !pm.get_active_profile().unwrap().is_active() {
+			return Err(format!("{}: wrong profile closed", testname))
+		}
+
+		// Closing a profile saves its config
+		match pm.open_profile("one") {
+			Ok(v) => {
+				if v.config.get("test_field").ok() != Some("value") {
+					return Err(format!("{}: config not saved when profile closed", testname))
+				}
+			},
+			Err(e) => {
+				return Err(format!("{} failed to reopen profile: {}", testname, e.to_string()))
+			},
+		}
+
+		// Lookups still work after the list changes
+		match pm.delete_profile("two") {
+			Ok(_) => (),
+			Err(e) => {
+				return Err(format!("{} failed to delete profile: {}", testname, e.to_string()))
+			},
+		}
+		if pm.get_profile_by_name("three").map(|p| p.name.as_str()) != Some("three")
+			|| pm.get_active_profile().unwrap().name != "primary" {
+			return Err(format!("{}: profile index wrong after delete", testname))
+		}
+
+		match pm.close_profile("primary") {
+			Err(MensagoError::ErrBadValue) => (),
+			_ => return Err(format!("{}: closed the active profile", testname)),
+		}
+
+		Ok(())
+	}
+
+	// Measures loading and looking up 10,000 profiles and cycling through 1,000 of them with room
+	// for only 100 to be open at once. Run with
+	// `cargo test --release bench_profile_manager -- --ignored --nocapture`.
+	#[test]
+	#[ignore]
+	fn bench_profile_manager() -> Result<(), MensagoError> {
+
+		let testname = String::from("bench_profile_manager");
+		let test_path = setup_test(&testname);
+
+		for i in 0..10_000 {
+			let mut path = test_path.clone();
+			path.push(format!("user{}", i));
+			fs::create_dir(&path)?;
+		}
+
+		let mut pm = ProfileManager::new(&test_path);
+		let start = std::time::Instant::now();
+		pm.load_profiles(Some(&test_path))?;
+		println!("load 10000 profiles: {:?}", start.elapsed());
+
+		let start = std::time::Instant::now();
+		for i in 0..10_000 {
+			if pm.get_profile_by_name(&format!("User{}", i)).is_none() {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: profile user{} not found", testname, i)))
+			}
+		}
+		println!("look up 10000 profiles: {:?}", start.elapsed());
+
+		let files = pm.get_active_profile().unwrap().get_open_files();
+		pm.set_open_limits(files * 100, 0)?;
+		for round in 0..2 {
+			let start = std::time::Instant::now();
+			for i in 0..1_000 {
+				pm.open_profile(&format!("user{}", i))?;
+			}
+			println!("open 1000 profiles, round {}: {:?}", round + 1, start.elapsed());
+		}
+		if pm.count_open_profiles() > 100 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: {} profiles open", testname, pm.count_open_profiles())))
+		}
+
 		Ok(())
 	}
 }
\ No newline at end of file
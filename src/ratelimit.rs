@@ -0,0 +1,322 @@
+//! The ratelimit module limits how fast data is sent to servers so that bulk transfers, such as
+//! syncing, imports, and downloads, don't saturate the link and leave interactive commands waiting
+//! behind them. Connections are tagged as bulk or interactive and share a RateLimiter which keeps a
+//! token bucket for each kind of traffic.
+
+use std::io::{Read, Write};
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant};
+use crate::base::*;
+use crate::config::*;
+use crate::transport::*;
+
+/// Config field for the bulk traffic limit in bytes per second. 0 or missing means unlimited.
+pub const CONFIG_RATELIMIT_BULK: &str = "ratelimit_bulk";
+
+/// Config field for the interactive traffic limit in bytes per second. 0 or missing means
+/// unlimited.
+pub const CONFIG_RATELIMIT_INTERACTIVE: &str = "ratelimit_interactive";
+
+// The smallest burst allowed, in bytes, so that slow limits don't break writes into tiny pieces
+const MIN_BURST_SIZE: f64 = 4096.0;
+
+// How much traffic, in seconds at the full rate, may be sent at once after a quiet period
+const BURST_SECONDS: f64 = 0.1;
+
+/// TrafficClass tells the RateLimiter which budget a connection's traffic is charged against
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum TrafficClass {
+	Interactive,
+	Bulk,
+}
+
+// A token bucket measured in bytes. The level may go below zero when traffic is charged without
+// waiting, which makes later takers wait until the debt is paid back.
+#[derive(Debug)]
+struct TokenBucket {
+	rate: f64,
+	burst: f64,
+	level: f64,
+	last: Instant,
+}
+
+impl TokenBucket {
+
+	fn new(rate: u64) -> TokenBucket {
+		let rate = rate as f64;
+		let burst = (rate * BURST_SECONDS).max(MIN_BURST_SIZE);
+		TokenBucket { rate, burst, level: burst, last: Instant::now() }
+	}
+
+	fn refill(&mut self) {
+		let now = Instant::now();
+		let elapsed = now.duration_since(self.last).as_secs_f64();
+		self.level = (self.level + elapsed * self.rate).min(self.burst);
+		self.last = now;
+	}
+
+	// Takes the tokens if they are available. Otherwise returns how long to wait for them.
+	fn try_take(&mut self, amount: f64) -> Option<Duration> {
+		self.refill();
+		if self.level >= amount {
+			self.level -= amount;
+			return None
+		}
+		Some(Duration::from_secs_f64((amount - self.level) / self.rate))
+	}
+
+	// Takes the tokens without waiting. The debt is limited to one burst so that a long stretch of
+	// charged traffic doesn't stall the bucket's own users for more than a moment.
+	fn charge(&mut self, amount: f64) {
+		self.refill();
+		self.level = (self.level - amount).max(-self.burst);
+	}
+}
+
+/// RateLimiter holds the bandwidth budgets for bulk and interactive traffic. It is meant to be
+/// shared by all of a client's connections through an Arc.
+///
+/// Interactive traffic is also charged against the bulk budget, but never waits for it. This way
+/// bulk transfers slow down whenever interactive commands are being sent, and the bulk limit acts
+/// as a cap on the total rate while both are active.
+#[derive(Debug)]
+pub struct RateLimiter {
+	interactive: Mutex<Option<TokenBucket>>,
+	bulk: Mutex<Option<TokenBucket>>,
+}
+
+impl RateLimiter {
+
+	/// Creates a new limiter. Rates are in bytes per second, and a rate of 0 means unlimited.
+	pub fn new(interactive_rate: u64, bulk_rate: u64) -> RateLimiter {
+		let make_bucket = |rate: u64| {
+			if rate > 0 { Some(TokenBucket::new(rate)) } else { None }
+		};
+		RateLimiter {
+			interactive: Mutex::new(make_bucket(interactive_rate)),
+			bulk: Mutex::new(make_bucket(bulk_rate)),
+		}
+	}
+
+	/// Creates a limiter using the rates in the `ratelimit_interactive` and `ratelimit_bulk`
+	/// fields of the configuration. Missing fields mean unlimited.
+	pub fn from_config(config: &Config) -> Result<RateLimiter, MensagoError> {
+		let get_rate = |field: &str| {
+			match config.get_int(field) {
+				Ok(v) if v >= 0 => Ok(v as u64),
+				Ok(_) => Err(MensagoError::ErrBadValue),
+				Err(MensagoError::ErrNotFound) => Ok(0),
+				Err(e) => Err(e),
+			}
+		};
+		Ok(RateLimiter::new(get_rate(CONFIG_RATELIMIT_INTERACTIVE)?,
+			get_rate(CONFIG_RATELIMIT_BULK)?))
+	}
+
+	/// Returns the largest number of bytes which should be sent in one piece for the traffic class
+	/// so that other traffic can be sent in between
+	pub fn get_chunk_size(&self, class: TrafficClass) -> usize {
+		let bucket = match class {
+			TrafficClass::Interactive => &self.interactive,
+			TrafficClass::Bulk => &self.bulk,
+		};
+		match lock_bucket(bucket).as_ref() {
+			Some(v) => v.burst as usize,
+			None => usize::MAX,
+		}
+	}
+
+	/// Waits until the specified number of bytes may be sent for the traffic class. Amounts
+	/// larger than the class's chunk size are treated as a full chunk.
+	pub fn acquire(&self, class: TrafficClass, size: usize) {
+
+		let size = size as f64;
+		let own = match class {
+			TrafficClass::Interactive => &self.interactive,
+			TrafficClass::Bulk => &self.bulk,
+		};
+
+		// The lock isn't held while sleeping so that other connections can take their share
+		loop {
+			let wait = match lock_bucket(own).as_mut() {
+				Some(v) => v.try_take(size.min(v.burst)),
+				None => None,
+			};
+			match wait {
+				Some(v) => std::thread::sleep(v),
+				None => break,
+			}
+		}
+
+		if class == TrafficClass::Interactive {
+			if let Some(v) = lock_bucket(&self.bulk).as_mut() {
+				v.charge(size);
+			}
+		}
+	}
+
+	/// Wraps a transport so that data written to it is limited as the specified class of traffic
+	pub fn shape(self: &Arc<Self>, inner: Box<dyn Transport>, class: TrafficClass)
+	-> ShapedTransport {
+		ShapedTransport { inner, limiter: self.clone(), class }
+	}
+}
+
+fn lock_bucket(bucket: &Mutex<Option<TokenBucket>>)
+-> std::sync::MutexGuard<'_, Option<TokenBucket>> {
+	match bucket.lock() {
+		Ok(v) => v,
+		Err(e) => e.into_inner(),
+	}
+}
+
+/// ShapedTransport limits the rate data is written to another transport using a RateLimiter.
+/// Large writes, such as the frames of a big message, are sent one chunk at a time, each waiting
+/// its turn. Reads are passed through unchanged.
+pub struct ShapedTransport {
+	inner: Box<dyn Transport>,
+	limiter: Arc<RateLimiter>,
+	class: TrafficClass,
+}
+
+impl ShapedTransport {
+
+	/// Returns the class of traffic the transport's writes are charged as
+	pub fn get_class(&self) -> TrafficClass {
+		self.class
+	}
+
+	/// Changes the class of traffic the transport's writes are charged as, such as for a
+	/// connection which is switched between interactive use and a bulk transfer
+	pub fn set_class(&mut self, class: TrafficClass) {
+		self.class = class;
+	}
+}
+
+impl Read for ShapedTransport {
+	fn read(&mut self, buf: &mut [u8]) -> std::io::Result<usize> {
+		self.inner.read(buf)
+	}
+}
+
+impl Write for ShapedTransport {
+	fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+		let size = buf.len().min(self.limiter.get_chunk_size(self.class));
+		self.limiter.acquire(self.class, size);
+		self.inner.write_all(&buf[..size])?;
+		Ok(size)
+	}
+
+	fn flush(&mut self) -> std::io::Result<()> {
+		self.inner.flush()
+	}
+}
+
+impl Transport for ShapedTransport {
+
+	fn try_clone_transport(&self) -> Result<Box<dyn Transport>, MensagoError> {
+		Ok(Box::new(ShapedTransport {
+			inner: self.inner.try_clone_transport()?,
+			limiter: self.limiter.clone(),
+			class: self.class,
+		}))
+	}
+
+	fn shutdown_transport(&self) -> Result<(), MensagoError> {
+		self.inner.shutdown_transport()
+	}
+
+	fn get_read_timeout(&self) -> Result<Option<Duration>, MensagoError> {
+		self.inner.get_read_timeout()
+	}
+
+	fn set_read_timeout(&self, timeout: Option<Duration>) -> Result<(), MensagoError> {
+		self.inner.set_read_timeout(timeout)
+	}
+}
+
+#[cfg(test)]
+mod tests {
+	use crate::*;
+	use crate::commands::servermsg::write_message;
+	use std::io::Read;
+	use std::sync::Arc;
+	use std::time::{Duration, Instant};
+
+	// Sends the data through a shaped pipe and returns how long it took
+	fn timed_send(limiter: &Arc<RateLimiter>, class: TrafficClass, data: &[u8])
+	-> Result<Duration, MensagoError> {
+
+		let (a, mut b) = pipe();
+		let mut shaped = limiter.shape(Box::new(a), class);
+		let size = data.len();
+		let reader = std::thread::spawn(move || {
+			let mut buffer = vec![0u8; size];
+			b.read_exact(&mut buffer).map(|_| buffer)
+		});
+
+		let start = Instant::now();
+		write_message(&mut shaped, data)?;
+		let elapsed = start.elapsed();
+		drop(shaped);
+		reader.join().unwrap()?;
+		Ok(elapsed)
+	}
+
+	#[test]
+	fn test_rate_limit() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_rate_limit");
+
+		// 200KB at 1MB/s with a 100KB burst should take about 100ms
+		let limiter = Arc::new(RateLimiter::new(0, 1_000_000));
+		let data = vec![b'x'; 200_000];
+		let elapsed = timed_send(&limiter, TrafficClass::Bulk, &data)?;
+		if elapsed < Duration::from_millis(80) || elapsed > Duration::from_millis(500) {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: bulk transfer took {:?}", testname, elapsed)))
+		}
+
+		// Interactive traffic has no limit here and doesn't wait for the drained bulk budget
+		let elapsed = timed_send(&limiter, TrafficClass::Interactive, &data)?;
+		if elapsed > Duration::from_millis(50) {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: interactive transfer took {:?}", testname, elapsed)))
+		}
+
+		// ...but it is charged against the bulk budget, so bulk traffic now waits for it
+		let elapsed = timed_send(&limiter, TrafficClass::Bulk, &data[..10_000])?;
+		if elapsed < Duration::from_millis(80) {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: bulk transfer didn't yield: {:?}", testname, elapsed)))
+		}
+
+		Ok(())
+	}
+
+	#[test]
+	fn test_rate_limit_config() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_rate_limit_config");
+
+		let mut config = Config::new("");
+		config.set_int(CONFIG_RATELIMIT_BULK, ConfigScope::Local, "", 50_000)?;
+		let limiter = RateLimiter::from_config(&config)?;
+		if limiter.get_chunk_size(TrafficClass::Bulk) != 5000
+			|| limiter.get_chunk_size(TrafficClass::Interactive) != usize::MAX {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: limits not loaded from config", testname)))
+		}
+
+		config.set_int(CONFIG_RATELIMIT_INTERACTIVE, ConfigScope::Local, "", -1)?;
+		match RateLimiter::from_config(&config) {
+			Err(MensagoError::ErrBadValue) => (),
+			_ => {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: negative limit accepted", testname)))
+			}
+		}
+
+		Ok(())
+	}
+}
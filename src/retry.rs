@@ -0,0 +1,399 @@
+//! The retry module retries idempotent commands which fail for reasons that are likely to go away
+//! on their own. Waits between attempts grow exponentially with random jitter so that many clients
+//! failing at once don't retry in lockstep, and a circuit breaker for each host stops requests
+//! entirely for a while when a server is down or overloaded.
+
+use rand::Rng;
+use std::collections::HashMap;
+use std::sync::Mutex;
+use std::thread;
+use std::time::{Duration, Instant};
+use crate::base::*;
+
+/// ErrorClass groups errors by what should be done about them
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum ErrorClass {
+	/// Network problems and garbled responses. Retrying soon will probably work.
+	Transient,
+	/// The server is in maintenance or is too busy. Retrying is fine, but not for a while.
+	Overloaded,
+	/// Retrying won't help, such as when the server rejected the request
+	Permanent,
+}
+
+/// Returns the class of an error for deciding whether an operation should be retried
+pub fn classify_error(err: &MensagoError) -> ErrorClass {
+	match err {
+		MensagoError::IOError(_) | MensagoError::ErrBadMessage | MensagoError::ErrNotConnected => {
+			ErrorClass::Transient
+		},
+		MensagoError::ErrCircuitOpen => ErrorClass::Overloaded,
+		MensagoError::ErrProtocol(status) => match status.code {
+			// 300 Internal Server Error
+			300 => ErrorClass::Transient,
+			// 302 Server Maintenance, 303 Server Unavailable
+			302 | 303 => ErrorClass::Overloaded,
+			_ => ErrorClass::Permanent,
+		},
+		_ => ErrorClass::Permanent,
+	}
+}
+
+/// RetryPolicy decides how many times an operation is attempted and how long to wait in between
+#[derive(Debug, Clone)]
+pub struct RetryPolicy {
+	max_attempts: u32,
+	base_delay: Duration,
+	overload_delay: Duration,
+	max_delay: Duration,
+}
+
+impl RetryPolicy {
+
+	/// Creates a policy which makes up to 4 attempts, starting with a wait of up to 100ms after
+	/// transient errors and up to 2s when the server is overloaded, never waiting more than 30s
+	pub fn new() -> RetryPolicy {
+		RetryPolicy {
+			max_attempts: 4,
+			base_delay: Duration::from_millis(100),
+			overload_delay: Duration::from_secs(2),
+			max_delay: Duration::from_secs(30),
+		}
+	}
+
+	/// Sets the maximum number of times an operation is attempted, including the first
+	pub fn set_max_attempts(&mut self, attempts: u32) {
+		self.max_attempts = attempts.max(1);
+	}
+
+	/// Sets the base waits for transient errors and server overload and the cap on any wait
+	pub fn set_delays(&mut self, base: Duration, overload: Duration, max: Duration) {
+		self.base_delay = base;
+		self.overload_delay = overload;
+		self.max_delay = max;
+	}
+
+	/// Returns how long to wait before the next attempt, given the number of attempts made so far
+	/// and the class of the last error. The wait is random, between half the backoff for the
+	/// attempt and the whole of it, which keeps some distance between retries while spreading
+	/// them out.
+	pub fn get_delay(&self, attempt: u32, class: ErrorClass) -> Duration {
+
+		let base = match class {
+			ErrorClass::Overloaded => self.overload_delay,
+			_ => self.base_delay,
+		};
+		let backoff = base.saturating_mul(1u32 << attempt.saturating_sub(1).min(20))
+			.min(self.max_delay);
+
+		let half = backoff / 2;
+		let jitter = rand::thread_rng().gen_range(0..=half.as_micros() as u64);
+		half + Duration::from_micros(jitter)
+	}
+
+	/// Runs an operation, retrying it according to the policy. Only idempotent operations, such as
+	/// lookups, should be run this way. If a circuit breaker is given, the host's circuit is
+	/// checked before each attempt and updated with the result.
+	pub fn run<T, F>(&self, breaker: Option<&CircuitBreaker>, host: &str, mut op: F)
+	-> Result<T, MensagoError>
+	where F: FnMut() -> Result<T, MensagoError> {
+
+		let mut attempt = 0;
+		loop {
+			attempt += 1;
+
+			let result = match breaker {
+				Some(b) => b.check(host).and_then(|_| op()),
+				None => op(),
+			};
+
+			let err = match result {
+				Ok(v) => {
+					if let Some(b) = breaker {
+						b.record_success(host);
+					}
+					return Ok(v)
+				},
+				Err(e) => e,
+			};
+
+			// Failing fast is the point of an open circuit, so don't wait around for it to close
+			if matches!(err, MensagoError::ErrCircuitOpen) {
+				return Err(err)
+			}
+
+			let class = classify_error(&err);
+			if let Some(b) = breaker {
+				b.record_failure(host, class);
+			}
+
+			if class == ErrorClass::Permanent || attempt >= self.max_attempts {
+				return Err(err)
+			}
+			thread::sleep(self.get_delay(attempt, class));
+		}
+	}
+}
+
+#[derive(Debug)]
+enum CircuitState {
+	Closed(u32),
+	Open(Instant),
+	HalfOpen,
+}
+
+/// CircuitBreaker tracks failures for each host. After too many transient failures in a row, or
+/// as soon as a host reports that it is overloaded, the host's circuit opens and requests to it
+/// fail immediately with ErrCircuitOpen. Once the cooldown has passed, one request is let
+/// through as a trial: success closes the circuit and failure opens it again.
+#[derive(Debug)]
+pub struct CircuitBreaker {
+	threshold: u32,
+	cooldown: Duration,
+	hosts: Mutex<HashMap<String, CircuitState>>,
+}
+
+impl CircuitBreaker {
+
+	/// Creates a breaker which opens after the specified number of consecutive transient failures
+	/// and stays open for the cooldown period
+	pub fn new(threshold: u32, cooldown: Duration) -> CircuitBreaker {
+		CircuitBreaker {
+			threshold: threshold.max(1),
+			cooldown,
+			hosts: Mutex::new(HashMap::new()),
+		}
+	}
+
+	/// Returns ErrCircuitOpen if requests to the host should not be made right now
+	pub fn check(&self, host: &str) -> Result<(), MensagoError> {
+
+		let mut hosts = self.lock_hosts();
+		let state = match hosts.get_mut(host) {
+			Some(v) => v,
+			None => return Ok(()),
+		};
+
+		match state {
+			CircuitState::Closed(_) => Ok(()),
+			CircuitState::HalfOpen => Err(MensagoError::ErrCircuitOpen),
+			CircuitState::Open(until) => {
+				if Instant::now() < *until {
+					return Err(MensagoError::ErrCircuitOpen)
+				}
+				*state = CircuitState::HalfOpen;
+				Ok(())
+			},
+		}
+	}
+
+	/// Returns true if requests to the host are currently being refused
+	pub fn is_open(&self, host: &str) -> bool {
+		match self.lock_hosts().get(host) {
+			Some(CircuitState::Open(until)) => Instant::now() < *until,
+			Some(CircuitState::HalfOpen) => true,
+			_ => false,
+		}
+	}
+
+	/// Records a successful request, closing the host's circuit
+	pub fn record_success(&self, host: &str) {
+		self.lock_hosts().remove(host);
+	}
+
+	/// Records a failed request. Permanent errors mean that the server is responding, so they
+	/// don't count against it.
+	pub fn record_failure(&self, host: &str, class: ErrorClass) {
+
+		let mut hosts = self.lock_hosts();
+		let state = hosts.entry(String::from(host)).or_insert(CircuitState::Closed(0));
+		let open = CircuitState::Open(Instant::now() + self.cooldown);
+
+		*state = match (&*state, class) {
+			(CircuitState::Closed(_), ErrorClass::Permanent) => CircuitState::Closed(0),
+			(CircuitState::HalfOpen, ErrorClass::Permanent) => CircuitState::Closed(0),
+			(CircuitState::Closed(n), ErrorClass::Transient) if n + 1 < self.threshold => {
+				CircuitState::Closed(n + 1)
+			},
+			(CircuitState::Open(until), _) => CircuitState::Open(*until),
+			_ => open,
+		};
+	}
+
+	fn lock_hosts(&self) -> std::sync::MutexGuard<'_, HashMap<String, CircuitState>> {
+		match self.hosts.lock() {
+			Ok(v) => v,
+			Err(e) => e.into_inner(),
+		}
+	}
+}
+
+#[cfg(test)]
+mod tests {
+	use crate::*;
+	use std::time::Duration;
+
+	#[test]
+	fn test_classify_error() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_classify_error");
+
+		let status = |code| MensagoError::ErrProtocol(CmdStatus {
+			code,
+			description: String::new(),
+			info: String::new(),
+		});
+		let cases = [
+			(MensagoError::ErrBadMessage, ErrorClass::Transient),
+			(MensagoError::IOError(std::io::Error::from(std::io::ErrorKind::ConnectionReset)),
+				ErrorClass::Transient),
+			(status(300), ErrorClass::Transient),
+			(status(302), ErrorClass::Overloaded),
+			(status(303), ErrorClass::Overloaded),
+			(status(404), ErrorClass::Permanent),
+			(MensagoError::ErrSchemaFailure, ErrorClass::Permanent),
+		];
+		for (err, class) in cases.iter() {
+			if classify_error(err) != *class {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: {:?} classified as {:?}", testname, err, classify_error(err))))
+			}
+		}
+
+		Ok(())
+	}
+
+	#[test]
+	fn test_retry_delay() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_retry_delay");
+
+		let mut policy = RetryPolicy::new();
+		policy.set_delays(Duration::from_millis(100), Duration::from_secs(2),
+			Duration::from_secs(1));
+
+		for _ in 0..100 {
+			let delay = policy.get_delay(3, ErrorClass::Transient);
+			if delay < Duration::from_millis(200) || delay > Duration::from_millis(400) {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: transient delay {:?} out of range", testname, delay)))
+			}
+
+			// Capped at the maximum
+			let delay = policy.get_delay(3, ErrorClass::Overloaded);
+			if delay < Duration::from_millis(500) || delay > Duration::from_secs(1) {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: overload delay {:?} out of range", testname, delay)))
+			}
+		}
+
+		Ok(())
+	}
+
+	#[test]
+	fn test_retry_run() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_retry_run");
+
+		let mut policy = RetryPolicy::new();
+		policy.set_delays(Duration::from_millis(1), Duration::from_millis(1),
+			Duration::from_millis(5));
+
+		// Transient errors are retried until the operation succeeds
+		let mut calls = 0;
+		let result = policy.run(None, "host1", || {
+			calls += 1;
+			if calls < 3 { Err(MensagoError::ErrBadMessage) } else { Ok(calls) }
+		})?;
+		if result != 3 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: transient errors took {} calls", testname, result)))
+		}
+
+		// Permanent errors are not
+		let mut calls = 0;
+		let result: Result<(), MensagoError> = policy.run(None, "host1", || {
+			calls += 1;
+			Err(MensagoError::ErrSchemaFailure)
+		});
+		if result.is_ok() || calls != 1 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: permanent error retried {} times", testname, calls)))
+		}
+
+		// Nor are operations retried forever
+		let mut calls = 0;
+		let result: Result<(), MensagoError> = policy.run(None, "host1", || {
+			calls += 1;
+			Err(MensagoError::ErrNotConnected)
+		});
+		if result.is_ok() || calls != 4 {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: failing operation called {} times", testname, calls)))
+		}
+
+		Ok(())
+	}
+
+	#[test]
+	fn test_circuit_breaker() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_circuit_breaker");
+
+		let breaker = CircuitBreaker::new(3, Duration::from_millis(50));
+		let mut policy = RetryPolicy::new();
+		policy.set_max_attempts(10);
+		policy.set_delays(Duration::from_millis(1), Duration::from_millis(1),
+			Duration::from_millis(1));
+
+		// An overloaded server opens the circuit at once and later calls don't reach it
+		let mut calls = 0;
+		let _: Result<(), MensagoError> = policy.run(Some(&breaker), "host1", || {
+			calls += 1;
+			Err(MensagoError::ErrProtocol(CmdStatus {
+				code: 303,
+				description: String::from("SERVER UNAVAILABLE"),
+				info: String::new(),
+			}))
+		});
+		if calls != 1 || !breaker.is_open("host1") {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: overloaded server was called {} times", testname, calls)))
+		}
+
+		// Other hosts aren't affected
+		breaker.check("host2")?;
+
+		// Transient failures open the circuit once the threshold is reached
+		for _ in 0..2 {
+			breaker.record_failure("host2", ErrorClass::Transient);
+		}
+		breaker.check("host2")?;
+		breaker.record_failure("host2", ErrorClass::Transient);
+		if breaker.check("host2").is_ok() {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: circuit not opened by transient errors", testname)))
+		}
+
+		// After the cooldown, a single trial request is allowed, and its success closes the
+		// circuit
+		std::thread::sleep(Duration::from_millis(60));
+		breaker.check("host1")?;
+		if breaker.check("host1").is_ok() {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: more than one trial request allowed", testname)))
+		}
+		breaker.record_success("host1");
+		breaker.check("host1")?;
+
+		// A failed trial opens it again
+		breaker.check("host2")?;
+		breaker.record_failure("host2", ErrorClass::Transient);
+		if !breaker.is_open("host2") {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: failed trial didn't reopen circuit", testname)))
+		}
+
+		Ok(())
+	}
+}
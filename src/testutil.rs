@@ -0,0 +1,54 @@
+//! Fixtures shared by the unit tests
+
+use libkeycard::*;
+use std::env;
+use std::fs;
+use std::path::PathBuf;
+use std::str::FromStr;
+use crate::base::*;
+use crate::messages::*;
+use crate::profile::*;
+
+/// Returns an empty directory for a test's files, named after the test, next to the test binary
+pub fn setup_test(name: &str) -> PathBuf {
+	if name.len() < 1 {
+		panic!("Invalid name {} in setup_test", name);
+	}
+	let args: Vec<String> = env::args().collect();
+	let test_path = PathBuf::from_str(&args[0]).unwrap();
+	let mut test_path = test_path.parent().unwrap().to_path_buf();
+	test_path.push("testfiles");
+	test_path.push(name);
+
+	if test_path.exists() {
+		fs::remove_dir_all(&test_path).unwrap();
+	}
+	fs::create_dir_all(&test_path).unwrap();
+
+	test_path
+}
+
+/// Returns a connection to the storage database of a new in-memory profile. The database lasts
+/// as long as the connection to it, so each call starts with an empty one.
+pub fn open_storage() -> Result<rusqlite::Connection, MensagoError> {
+	let mut profman = ProfileManager::new_in_memory();
+	profman.create_profile("Primary")?;
+	profman.activate_profile("Primary")?;
+	profman.get_active_profile().unwrap().open_storage()
+}
+
+/// Returns a message with a new ID and the specified body
+pub fn make_message(body: &str) -> Message {
+	Message {
+		id: RandomID::generate().to_string(),
+		from: String::from("admin/example.com"),
+		address: String::from("csimons/example.com"),
+		cc: None,
+		bcc: None,
+		date: String::from("2022-07-01T12:00:00Z"),
+		thread_id: RandomID::generate().to_string(),
+		subject: Some(String::from("Test message")),
+		body: Some(String::from(body)),
+		attachments: None,
+	}
+}
@@ -0,0 +1,345 @@
+//! The transport module abstracts the byte stream a connection to a server runs over. Besides TCP,
+//! connections can be made over Unix domain sockets, which are handy for talking to a local proxy,
+//! and over in-process pipes, which skip the network stack entirely for benchmarks and tests.
+
+use std::collections::VecDeque;
+use std::io::{Read, Write};
+use std::net::{Shutdown, TcpStream};
+use std::sync::{Arc, Condvar, Mutex, MutexGuard};
+use std::time::{Duration, Instant};
+use crate::base::*;
+
+/// Transport is implemented by the streams a ServerConnection can use
+pub trait Transport: Read + Write + Send {
+
+	/// Returns a new handle to the same stream, such as for reading on one thread while writing
+	/// on another
+	fn try_clone_transport(&self) -> Result<Box<dyn Transport>, MensagoError>;
+
+	/// Shuts down both directions of the stream, which also wakes up any pending reads on other
+	/// handles to it
+	fn shutdown_transport(&self) -> Result<(), MensagoError>;
+
+	/// Returns the read timeout. None means that reads block indefinitely.
+	fn get_read_timeout(&self) -> Result<Option<Duration>, MensagoError>;
+
+	/// Sets the read timeout. None means that reads block indefinitely.
+	fn set_read_timeout(&self, timeout: Option<Duration>) -> Result<(), MensagoError>;
+}
+
+impl Transport for TcpStream {
+
+	fn try_clone_transport(&self) -> Result<Box<dyn Transport>, MensagoError> {
+		Ok(Box::new(self.try_clone()?))
+	}
+
+	fn shutdown_transport(&self) -> Result<(), MensagoError> {
+		Ok(self.shutdown(Shutdown::Both)?)
+	}
+
+	fn get_read_timeout(&self) -> Result<Option<Duration>, MensagoError> {
+		Ok(self.read_timeout()?)
+	}
+
+	fn set_read_timeout(&self, timeout: Option<Duration>) -> Result<(), MensagoError> {
+		Ok(TcpStream::set_read_timeout(self, timeout)?)
+	}
+}
+
+#[cfg(unix)]
+impl Transport for std::os::unix::net::UnixStream {
+
+	fn try_clone_transport(&self) -> Result<Box<dyn Transport>, MensagoError> {
+		Ok(Box::new(self.try_clone()?))
+	}
+
+	fn shutdown_transport(&self) -> Result<(), MensagoError> {
+		Ok(self.shutdown(Shutdown::Both)?)
+	}
+
+	fn get_read_timeout(&self) -> Result<Option<Duration>, MensagoError> {
+		Ok(self.read_timeout()?)
+	}
+
+	fn set_read_timeout(&self, timeout: Option<Duration>) -> Result<(), MensagoError> {
+		Ok(std::os::unix::net::UnixStream::set_read_timeout(self, timeout)?)
+	}
+}
+
+impl<T: Transport + ?Sized> Transport for Box<T> {
+
+	fn try_clone_transport(&self) -> Result<Box<dyn Transport>, MensagoError> {
+		(**self).try_clone_transport()
+	}
+
+	fn shutdown_transport(&self) -> Result<(), MensagoError> {
+		(**self).shutdown_transport()
+	}
+
+	fn get_read_timeout(&self) -> Result<Option<Duration>, MensagoError> {
+		(**self).get_read_timeout()
+	}
+
+	fn set_read_timeout(&self, timeout: Option<Duration>) -> Result<(), MensagoError> {
+		(**self).set_read_timeout(timeout)
+	}
+}
+
+// One direction of a pipe
+#[derive(Default)]
+struct PipeBuffer {
+	state: Mutex<PipeState>,
+	ready: Condvar,
+}
+
+#[derive(Default)]
+struct PipeState {
+	data: VecDeque<u8>,
+	closed: bool,
+}
+
+impl PipeBuffer {
+
+	fn lock(&self) -> MutexGuard<'_, PipeState> {
+		match self.state.lock() {
+			Ok(v) => v,
+			Err(e) => e.into_inner(),
+		}
+	}
+
+	fn close(&self) {
+		self.lock().closed = true;
+		self.ready.notify_all();
+	}
+}
+
+// Closes both directions of a pipe when the last handle to one of its ends goes away
+struct PipeCloser {
+	incoming: Arc<PipeBuffer>,
+	outgoing: Arc<PipeBuffer>,
+}
+
+impl Drop for PipeCloser {
+	fn drop(&mut self) {
+		self.incoming.close();
+		self.outgoing.close();
+	}
+}
+
+/// PipeEnd is one end of an in-process pipe created with `pipe()`. Data written to one end can be
+/// read from the other. When all handles to one end are dropped or shut down, reads on the other
+/// end return end-of-file once the data already sent has been read.
+pub struct PipeEnd {
+	incoming: Arc<PipeBuffer>,
+	outgoing: Arc<PipeBuffer>,
+	timeout: Arc<Mutex<Option<Duration>>>,
+	_closer: Arc<PipeCloser>,
+}
+
+/// Creates an in-process pipe and returns its two ends
+pub fn pipe() -> (PipeEnd, PipeEnd) {
+
+	let a_to_b = Arc::new(PipeBuffer::default());
+	let b_to_a = Arc::new(PipeBuffer::default());
+
+	let make_end = |incoming: &Arc<PipeBuffer>, outgoing: &Arc<PipeBuffer>| {
+		PipeEnd {
+			incoming: incoming.clone(),
+			outgoing: outgoing.clone(),
+			timeout: Arc::new(Mutex::new(None)),
+			_closer: Arc::new(PipeCloser {
+				incoming: incoming.clone(),
+				outgoing: outgoing.clone(),
+			}),
+		}
+	};
+
+	(make_end(&b_to_a, &a_to_b), make_end(&a_to_b, &b_to_a))
+}
+
+impl Read for PipeEnd {
+	fn read(&mut self, buf: &mut [u8]) -> std::io::Result<usize> {
+
+		if buf.len() == 0 {
+			return Ok(0)
+		}
+
+		let deadline = self.get_read_timeout().unwrap_or(None).map(|t| Instant::now() + t);
+		let mut state = self.incoming.lock();
+		while state.data.len() == 0 && !state.closed {
+			state = match deadline {
+				Some(d) => {
+					let now = Instant::now();
+					if now >= d {
+						return Err(std::io::Error::from(std::io::ErrorKind::TimedOut))
+					}
+					match self.incoming.ready.wait_timeout(state, d - now) {
+						Ok(v) => v.0,
+						Err(e) => e.into_inner().0,
+					}
+				},
+				None => match self.incoming.ready.wait(state) {
+					Ok(v) => v,
+					Err(e) => e.into_inner(),
+				},
+			};
+		}
+
+		let count = buf.len().min(state.data.len());
+		for (i, byte) in state.data.drain(..count).enumerate() {
+			buf[i] = byte;
+		}
+		Ok(count)
+	}
+}
+
+impl Write for PipeEnd {
+	fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+		let mut state = self.outgoing.lock();
+		if state.closed {
+			return Err(std::io::Error::from(std::io::ErrorKind::BrokenPipe))
+		}
+		state.data.extend(buf);
+		self.outgoing.ready.notify_all();
+		Ok(buf.len())
+	}
+
+	fn flush(&mut self) -> std::io::Result<()> {
+		Ok(())
+	}
+}
+
+impl Transport for PipeEnd {
+
+	fn try_clone_transport(&self) -> Result<Box<dyn Transport>, MensagoError> {
+		Ok(Box::new(PipeEnd {
+			incoming: self.incoming.clone(),
+			outgoing: self.outgoing.clone(),
+			timeout: self.timeout.clone(),
+			_closer: self._closer.clone(),
+		}))
+	}
+
+	fn shutdown_transport(&self) -> Result<(), MensagoError> {
+		self.incoming.close();
+		self.outgoing.close();
+		Ok(())
+	}
+
+	fn get_read_timeout(&self) -> Result<Option<Duration>, MensagoError> {
+		match self.timeout.lock() {
+			Ok(v) => Ok(*v),
+			Err(e) => Ok(*e.into_inner()),
+		}
+	}
+
+	fn set_read_timeout(&self, timeout: Option<Duration>) -> Result<(), MensagoError> {
+		match self.timeout.lock() {
+			Ok(mut v) => { *v = timeout },
+			Err(e) => { *e.into_inner() = timeout },
+		}
+		Ok(())
+	}
+}
+
+#[cfg(test)]
+mod tests {
+	use crate::*;
+	use crate::commands::testserver::*;
+	use std::io::{Read, Write};
+	use std::time::{Duration, Instant};
+
+	#[test]
+	fn test_pipe() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_pipe");
+
+		let (mut a, mut b) = pipe();
+		a.write_all(b"ping")?;
+		let mut buffer = [0u8; 4];
+		b.read_exact(&mut buffer)?;
+		if &buffer != b"ping" {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: data mismatch", testname)))
+		}
+
+		b.set_read_timeout(Some(Duration::from_millis(20)))?;
+		match b.read(&mut buffer) {
+			Err(e) if e.kind() == std::io::ErrorKind::TimedOut => (),
+			other => {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: read didn't time out: {:?}", testname, other)))
+			}
+		}
+
+		// Data sent before the other end goes away can still be read, followed by end-of-file
+		a.write_all(b"pong")?;
+		let clone = a.try_clone_transport()?;
+		drop(a);
+		b.read_exact(&mut buffer)?;
+		drop(clone);
+		if b.read(&mut buffer)? != 0 || b.write(b"x").is_ok() {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: pipe not closed", testname)))
+		}
+
+		Ok(())
+	}
+
+	#[test]
+	fn test_pipe_connection() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_pipe_connection");
+
+		let transport = TestServer::start_pipe(|req, conn| {
+			if req.action != "NOOP" {
+				return Ok(false)
+			}
+			TestServer::send(conn, &TestServer::response(200, "OK", &[]))?;
+			Ok(true)
+		});
+
+		let mut conn = ServerConnection::new();
+		conn.connect_transport(Box::new(transport))?;
+		let start = Instant::now();
+		for _ in 0..100 {
+			noop(conn.get_socket()?)?;
+		}
+		if start.elapsed() > Duration::from_secs(1) {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: pipe transport too slow: {:?}", testname, start.elapsed())))
+		}
+		conn.disconnect()?;
+
+		Ok(())
+	}
+
+	#[cfg(unix)]
+	#[test]
+	fn test_unix_connection() -> Result<(), MensagoError> {
+
+		let mut path = std::env::temp_dir();
+		path.push(format!("libmensago-test-{}.sock", std::process::id()));
+		let _ = std::fs::remove_file(&path);
+		let listener = std::os::unix::net::UnixListener::bind(&path)?;
+		let server = std::thread::spawn(move || {
+			let (stream, _) = listener.accept().unwrap();
+			let _ = TestServer::serve_transport(Box::new(stream), |req, conn| {
+				if req.action != "NOOP" {
+					return Ok(false)
+				}
+				TestServer::send(conn, &TestServer::response(200, "OK", &[]))?;
+				Ok(true)
+			});
+		});
+
+		let mut conn = ServerConnection::new();
+		conn.connect_unix(&path)?;
+		noop(conn.get_socket()?)?;
+		conn.disconnect()?;
+		server.join().unwrap();
+		let _ = std::fs::remove_file(&path);
+
+		Ok(())
+	}
+}
@@ -5,6 +5,7 @@ use std::path::PathBuf;
 use crate::auth;
 use crate::base::*;
 use crate::dbfs::*;
+use crate::profile::*;
 use crate::types::*;
 
 #[derive(Debug, PartialEq, PartialOrd, Clone)]
@@ -17,6 +18,8 @@ pub struct Workspace {
 	domain: Option<Domain>,
 	_type: String,
 	pw: String,
+	// The storage and secrets database URIs when the workspace belongs to an in-memory profile
+	memory: Option<(String, String)>,
 }
 
 impl Workspace {
@@ -39,11 +42,24 @@ impl Workspace {
 			domain: None,
 			_type: String::from("identity"),
 			pw: String::from(""),
+			memory: None,
 		}
 	}
 
+	/// Creates a new, uninitialized Workspace which uses the specified profile's databases. Unlike
+	/// `new()`, this also works with in-memory profiles.
+	pub fn from_profile(profile: &Profile) -> Workspace {
+		let mut out = Workspace::new(&profile.path);
+		out.memory = profile.get_memory_uris();
+		out
+	}
+
 	/// Returns a connection to the workspace's storage database
 	pub fn open_storage(&self) -> Result<rusqlite::Connection, MensagoError> {
+		if let Some((uri, _)) = self.memory.as_ref() {
+			return Ok(open_memory_db(uri)?)
+		}
+		self.check_path()?;
 		match rusqlite::Connection::open_with_flags(&self.dbpath,
 			rusqlite::OpenFlags::SQLITE_OPEN_READ_WRITE) {
 				Ok(v) => Ok(v),
@@ -56,6 +72,10 @@ impl Workspace {
 	/// Returns a connection to the workspace's secrets database, which houses keys, password
 	/// hashes, and similar sensitive information
 	pub fn open_secrets(&self) -> Result<rusqlite::Connection, MensagoError> {
+		if let Some((_, uri)) = self.memory.as_ref() {
+			return Ok(open_memory_db(uri)?)
+		}
+		self.check_path()?;
 		match rusqlite::Connection::open_with_flags(&self.secretspath,
 			rusqlite::OpenFlags::SQLITE_OPEN_READ_WRITE) {
 				Ok(v) => Ok(v),
@@ -65,6 +85,15 @@ impl Workspace {
 		}
 	}
 
+	// Workspaces made with `new()` from an in-memory profile's empty path would otherwise open
+	// databases in the process's working directory
+	fn check_path(&self) -> Result<(), MensagoError> {
+		if self.path.as_os_str().is_empty() {
+			return Err(MensagoError::ErrBadValue)
+		}
+		Ok(())
+	}
+
 	/// Returns the workspace ID of the workspace, assuming one has been set
 	pub fn get_wid(&self) -> Option<RandomID> {
 		self.wid.clone()
@@ -197,12 +226,15 @@ impl Workspace {
 			})?;
 		}
 
-		// Create the folders for files and attachments
-		let mut attachmentdir = self.path.clone();
-		attachmentdir.push("files");
-		attachmentdir.push("attachments");
-		if !attachmentdir.exists() {
-			fs::create_dir_all(attachmentdir)?;
+		// Create the folders for files and attachments. In-memory profiles keep their files in
+		// memory, so they don't need any.
+		if self.memory.is_none() {
+			let mut attachmentdir = self.path.clone();
+			attachmentdir.push("files");
+			attachmentdir.push("attachments");
+			if !attachmentdir.exists() {
+				fs::create_dir_all(attachmentdir)?;
+			}
 		}
 
 		self.set_userid(uid)?;
@@ -266,8 +298,12 @@ impl Workspace {
 
 	/// Adds the workspace instance to the storage database as the profile's identity workspace
 	pub fn add_to_db(&self, pw: &ArgonHash) -> Result<(), MensagoError> {
+		self.add_to_conn(&self.open_storage()?, pw)
+	}
 
-		let conn = self.open_storage()?;
+	// Adds the workspace to the storage database open on the specified connection
+	pub(crate) fn add_to_conn(&self, conn: &rusqlite::Connection, pw: &ArgonHash)
+	-> Result<(), MensagoError> {
 
 		match conn.prepare("SELECT wid FROM workspaces WHERE type = 'identity'")?.exists([]) {
 			Ok(v) => { if v { return Err(MensagoError::ErrExists) } },
@@ -396,13 +432,7 @@ impl Workspace {
 	/// Adds a mapping of a folder ID to a specific path in the workspace
 	pub fn add_folder(&self, fmap: &FolderMap) -> Result<(), MensagoError> {
 
-		let conn = match rusqlite::Connection::open_with_flags(&self.dbpath,
-			rusqlite::OpenFlags::SQLITE_OPEN_READ_WRITE) {
-				Ok(v) => v,
-				Err(e) => {
-					return Err(MensagoError::ErrDatabaseException(String::from(e.to_string())));
-				}
-		};
+		let conn = self.open_storage()?;
 
 		let mut stmt = conn.prepare("SELECT fid FROM folders WHERE fid=?1")?;
 		match stmt.exists([fmap.fid.as_string()]) {
@@ -427,13 +457,7 @@ impl Workspace {
 	/// Deletes a mapping of a folder ID to a specific path in the workspace
 	pub fn remove_folder(&self, fid: &RandomID) -> Result<(), MensagoError> {
 
-		let conn = match rusqlite::Connection::open_with_flags(&self.dbpath,
-			rusqlite::OpenFlags::SQLITE_OPEN_READ_WRITE) {
-				Ok(v) => v,
-				Err(e) => {
-					return Err(MensagoError::ErrDatabaseException(String::from(e.to_string())));
-				}
-		};
+		let conn = self.open_storage()?;
 
 		// Check to see if the folder ID passed to the function exists
 		let mut stmt = match conn.prepare("SELECT fid FROM folders WHERE fid=?1") {
@@ -475,13 +499,7 @@ impl Workspace {
 	/// Gets the specified folder mapping.
 	pub fn get_folder(&self, fid: &RandomID) -> Result<FolderMap, MensagoError> {
 
-		let conn = match rusqlite::Connection::open_with_flags(&self.dbpath,
-			rusqlite::OpenFlags::SQLITE_OPEN_READ_WRITE) {
-				Ok(v) => v,
-				Err(e) => {
-					return Err(MensagoError::ErrDatabaseException(String::from(e.to_string())));
-				}
-		};
+		let conn = self.open_storage()?;
 			
 		// For the fully-commented version of this query, see profile::get_identity()
 		let mut stmt = conn
@@ -847,5 +865,40 @@ mod tests {
 		}
 
 		Ok(())
-	}		
-}
\ No newline at end of file
+	}
+
+	#[test]
+	fn test_workspace_in_memory() -> Result<(), MensagoError> {
+
+		let testname = String::from("test_workspace_in_memory");
+
+		let mut profman = ProfileManager::new_in_memory();
+		profman.create_profile("Primary")?;
+		profman.activate_profile("Primary")?;
+		let profile = profman.get_active_profile_mut().unwrap();
+
+		// A workspace made from the empty path of an in-memory profile must not fall back to the
+		// working directory
+		match Workspace::new(&profile.path).open_storage() {
+			Err(MensagoError::ErrBadValue) => (),
+			other => {
+				return Err(MensagoError::ErrProgramException(
+					format!("{}: workspace opened without a path: {:?}", testname, other.is_ok())))
+			}
+		}
+
+		let pw = String::from("$argon2id$v=19$m=1048576,t=1,p=2$jc/H+Cn1NwJBJOTmFqAdlA$\
+			b2zoU9ZNhHlo/ZYuSJwoqUAXEdf1cbN3fxmbQhP0zJc");
+		let mut w = Workspace::from_profile(profile);
+		w.generate(&UserID::from("csimons").unwrap(), &Domain::from("example.com").unwrap(),
+			&RandomID::from("b5a9367e-680d-46c0-bb2c-73932a6d4007").unwrap(), &pw)?;
+		profile.set_identity(w, &ArgonHash::from_hashstr(&pw))?;
+
+		if profile.get_identity()?.to_string() != "csimons/example.com" {
+			return Err(MensagoError::ErrProgramException(
+				format!("{}: identity not stored in memory", testname)))
+		}
+
+		Ok(())
+	}
+}